@@ -13,4 +13,26 @@ LOCAL_MODULE := gps.$(TARGET_DEVICE)
 LOCAL_MODULE_TAGS := optional
 
 include $(BUILD_SHARED_LIBRARY)
+
+# capture and replay of the receiver output through a pty
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := tools/nmea_replay.c tools/nmea_log.c
+
+LOCAL_MODULE := nmea_replay
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
+
+# runs a capture through the HAL and reports its throughput and latency
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := tools/nmea_bench.c tools/nmea_log.c
+
+LOCAL_CFLAGS := -DTARGET_DEVICE=\"$(TARGET_DEVICE)\"
+LOCAL_SHARED_LIBRARIES := libdl
+LOCAL_MODULE := nmea_bench
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
 endif
@@ -29,12 +29,14 @@
 #include <termios.h>
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
-#include <math.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #define  LOG_TAG  "gps_nmea"
 #include <cutils/log.h>
 #include <cutils/sockets.h>
+#include <cutils/properties.h>
 #include <hardware/gps.h>
 
 #define  GPS_DEBUG  0
@@ -49,6 +51,12 @@
 #define __HAVE_NMEA_CALLBACK__
 
 #define GPS_SERIAL_DEVICE  "/dev/ttymxc1"
+/* another port, such as the pty of nmea_replay, from the environment of a
+ * process that loads the HAL itself or from a property */
+#define GPS_SERIAL_ENV      "GPS_NMEA_DEVICE"
+#define GPS_SERIAL_PROPERTY "gps.nmea.device"
+/* "1" switches a u-blox receiver to UBX binary output when a session starts */
+#define GPS_UBX_PROPERTY    "gps.nmea.ubx"
 #define GPS_POWER_CONTROL "/sys/devices/platform/gps-control.0/gps_pwr_en"
 GpsStatus sGpsStatus;
 
@@ -73,11 +81,27 @@ typedef struct {
     Token   tokens[ MAX_NMEA_TOKENS ];
 } NmeaTokenizer;
 
+static int
+hex2int( char  c )
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/* splits the sentence at commas and checks the "*hh" checksum in the same
+ * pass over it. empty fields are kept so that token indexes are NMEA field
+ * numbers. returns the token count, or -1 when the checksum is wrong */
 static int
 nmea_tokenizer_init( NmeaTokenizer*  t, const char*  p, const char*  end )
 {
-    int    count = 0;
-    char*  q;
+    int            count = 0;
+    unsigned char  sum   = 0;
+    const char*    field;
 
     // the initial '$' is optional
     if (p < end && p[0] == '$')
@@ -90,30 +114,33 @@ nmea_tokenizer_init( NmeaTokenizer*  t, const char*  p, const char*  end )
             end -= 1;
     }
 
-    // get rid of checksum at the end of the sentecne
-    if (end >= p+3 && end[-3] == '*') {
-        end -= 3;
-    }
-
-    while (p < end) {
-        const char*  q = p;
-
-        q = memchr(p, ',', end-p);
-        if (q == NULL)
-            q = end;
-
-        //jump over double comma such as ",,"
-        if (q > p) {
+    for (field = p; p < end && *p != '*'; p++) {
+        sum ^= (unsigned char)*p;
+        if (*p == ',') {
             if (count < MAX_NMEA_TOKENS) {
-                t->tokens[count].p   = p;
-                t->tokens[count].end = q;
+                t->tokens[count].p   = field;
+                t->tokens[count].end = p;
                 count += 1;
             }
+            field = p + 1;
         }
-        if (q < end)
-            q += 1;
+    }
+    if (count < MAX_NMEA_TOKENS) {
+        t->tokens[count].p   = field;
+        t->tokens[count].end = p;
+        count += 1;
+    }
 
-        p = q;
+    // the checksum is optional, but when present it must match
+    if (p < end) {
+        int  hi, lo;
+
+        if (end - p != 3)
+            return -1;
+        hi = hex2int(p[1]);
+        lo = hex2int(p[2]);
+        if (hi < 0 || lo < 0 || (unsigned char)((hi << 4) | lo) != sum)
+            return -1;
     }
 
     t->count = count;
@@ -160,19 +187,71 @@ Fail:
     return -1;
 }
 
-static double
-str2float( const char*  p, const char*  end )
+/* "[-]ddd[.ddd]" as an integer in units of 10^-decimals, read straight
+ * from the field. digits past the last kept decimal are dropped */
+static int
+str2fixed( const char*  p, const char*  end, int  decimals, int32_t*  result )
 {
-    int   result = 0;
-    int   len    = end - p;
-    char  temp[16];
+    int32_t  value = 0;
+    int      neg   = 0;
+    int      frac  = -1;    /* decimals read, -1 before the point */
+
+    if (p < end && (*p == '-' || *p == '+')) {
+        neg = (*p == '-');
+        p += 1;
+    }
+    if (p >= end)
+        return -1;
 
-    if (len >= (int)sizeof(temp))
-        return 0.;
+    for ( ; p < end; p++ ) {
+        int  c;
+
+        if (*p == '.') {
+            if (frac >= 0)
+                return -1;
+            frac = 0;
+            continue;
+        }
+
+        c = *p - '0';
+        if ((unsigned)c >= 10)
+            return -1;
+
+        if (frac < 0) {
+            value = value*10 + c;
+        } else if (frac < decimals) {
+            value = value*10 + c;
+            frac += 1;
+        }
+    }
+
+    for (frac = (frac < 0) ? 0 : frac; frac < decimals; frac++)
+        value *= 10;
+
+    *result = neg ? -value : value;
+    return 0;
+}
+
+/* "dddmm.mmmm" as degrees * 1e7, minutes converted with one rounded
+ * integer division */
+static int
+str2coord( const char*  p, const char*  end, int32_t*  result )
+{
+    const char*  dot = memchr(p, '.', end - p);
+    int          degrees;
+    int32_t      minutes;
+
+    if (dot == NULL)
+        dot = end;
+    if (dot - p < 3)
+        return -1;
+
+    degrees = str2int(p, dot - 2);
+    if (degrees < 0 || str2fixed(dot - 2, end, 7, &minutes) < 0)
+        return -1;
 
-    memcpy( temp, p, len );
-    temp[len] = 0;
-    return strtod( temp, NULL );
+    *result = degrees * 10000000 + (minutes + 30) / 60;
+    return 0;
 }
 
 /*****************************************************************/
@@ -185,6 +264,10 @@ str2float( const char*  p, const char*  end )
 
 #define  NMEA_MAX_SIZE 500 
 
+/* the serial port is read in bulk, sentences are parsed in place in the
+ * read buffer and only a trailing partial sentence is carried over */
+#define  NMEA_READ_SIZE 4096
+
 #define  GGA_FLAG       0x0001
 #define  GSA_FLAG       0x0002
 #define  GSV_FLAG       0x0004
@@ -195,6 +278,57 @@ str2float( const char*  p, const char*  end )
 #define  GDO_FLAG       0x0080
 
 #define  LOCATION_FLAG  0x0009
+/* sentences that can complete the fix of an epoch */
+#define  EPOCH_FLAG     0x000b
+
+/* user range error, metres per unit of HDOP, in cm */
+#define  NMEA_UERE_CM   500
+
+/* sentence types, and UBX messages, also the rows of the diagnostic
+ * counters */
+enum {
+    NMEA_GGA = 0,
+    NMEA_GSA,
+    NMEA_GSV,
+    NMEA_RMC,
+    NMEA_SHF,
+    NMEA_DPS,
+    NMEA_UBX_PVT,
+    NMEA_UBX_SAT,
+    NMEA_UBX,               /* any other UBX message */
+    NMEA_UNKNOWN,
+    NMEA_TYPE_MAX
+};
+
+static const char*  nmea_type_names[NMEA_TYPE_MAX] = {
+    "GGA", "GSA", "GSV", "RMC", "SHF", "DPS", "NAV-PVT", "NAV-SAT", "UBX",
+    "unknown"
+};
+
+/* talkers, the constellation a sentence reports on. GN sentences carry
+ * the combined solution, their PRNs tell the constellation apart */
+enum {
+    NMEA_TALKER_GP = 0,     /* GPS, and SBAS on PRNs 33-64 */
+    NMEA_TALKER_GL,         /* GLONASS */
+    NMEA_TALKER_GA,         /* Galileo */
+    NMEA_TALKER_GN,         /* multi-constellation */
+    NMEA_TALKER_OTHER
+};
+
+/* sentence and talker ids packed into integers, so that dispatch is a
+ * switch instead of string compares */
+#define  NMEA_ID(a,b,c)    (((a) << 16) | ((b) << 8) | (c))
+#define  NMEA_TALKER(a,b)  (((a) << 8) | (b))
+
+/* satellites used in the fix, one bit per SV id 1-255 as numbered by
+ * nmea_sv_id(), bit 0 of word 0 is SV id 1 */
+#define  NMEA_SV_WORDS  8
+
+typedef struct {
+    uint32_t  received;
+    uint32_t  bad_checksum;
+    uint32_t  overflow;
+} NmeaCounters;
 
 #ifdef   __HAVE_CDSHF_AND_CDDPS__
 #define  SVINFO_FLAG    0x0036
@@ -202,45 +336,65 @@ str2float( const char*  p, const char*  end )
 #define  SVINFO_FLAG    0x0006
 #endif
 
+/* position fields as parsed, the flags live in NmeaReader.fix */
+typedef struct {
+    int32_t  latitude;      /* degrees * 1e7 */
+    int32_t  longitude;     /* degrees * 1e7 */
+    int32_t  altitude;      /* millimetres */
+    int32_t  speed;         /* knots * 1000 */
+    int32_t  bearing;       /* degrees * 1000 */
+} NmeaPosition;
+
 typedef struct {
-    int     pos;
+    int     len;        /* partial sentence carried at the start of buf */
     int     overflow;
     int     utc_year;
     int     utc_mon;
     int     utc_day;
-    int     utc_diff;
+    long long  utc_date_ms;   /* midnight of utc_year/mon/day, ms since the epoch */
+    int     utc_time_ms;      /* last time of day, -1 after a date change */
     uint16_t     cb_flag;
+    int     last_type;        /* type of the previous sentence */
+    int     epoch_time;       /* time of day of the current epoch, ms */
+    int     epoch_reported;   /* its fix went to location_cb */
+    uint16_t     epoch_expect;    /* EPOCH_FLAG sentences the last epoch had */
+    int32_t hdop;             /* HDOP * 100 of the current epoch, -1 if none */
+    int     gsv_talker;       /* talker whose GSV group starts a sky view */
+    uint32_t     used_in_fix[ NMEA_SV_WORDS ];
     GpsLocation  fix;
+    NmeaPosition pos;
     GpsSvStatus    sv;
     GpsCallbacks  callback;
-    char    in[ NMEA_MAX_SIZE+1 ];
+    NmeaCounters  counters[ NMEA_TYPE_MAX ];
+    char    buf[ NMEA_READ_SIZE ];
 } NmeaReader;
 
 
+/* days since 1970-01-01 of a proleptic Gregorian date, no tables and no
+ * timezone: the year is shifted to start in March so leap days come last */
+static long
+days_from_civil( int  year, int  mon, int  day )
+{
+    int  era, yoe, doy, doe;
+
+    year -= (mon <= 2);
+    era   = (year >= 0 ? year : year - 399) / 400;
+    yoe   = year - era * 400;
+    doy   = (153 * (mon > 2 ? mon - 3 : mon + 9) + 2) / 5 + day - 1;
+    doe   = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+    return era * 146097L + doe - 719468;
+}
+
+
 static void
-nmea_reader_update_utc_diff( NmeaReader*  r )
+nmea_reader_set_date( NmeaReader*  r, int  year, int  mon, int  day )
 {
-    time_t         now = time(NULL);
-    struct tm      tm_local;
-    struct tm      tm_utc;
-    long           time_local, time_utc;
-
-    gmtime_r( &now, &tm_utc );
-    localtime_r( &now, &tm_local );
-
-    time_local = tm_local.tm_sec +
-                 60*(tm_local.tm_min +
-                 60*(tm_local.tm_hour +
-                 24*(tm_local.tm_yday +
-                 365*tm_local.tm_year)));
-
-    time_utc = tm_utc.tm_sec +
-               60*(tm_utc.tm_min +
-               60*(tm_utc.tm_hour +
-               24*(tm_utc.tm_yday +
-               365*tm_utc.tm_year)));
-
-    r->utc_diff = time_utc - time_local;
+    r->utc_year    = year;
+    r->utc_mon     = mon;
+    r->utc_day     = day;
+    r->utc_date_ms = days_from_civil(year, mon, day) * 86400000LL;
+    r->utc_time_ms = -1;
 }
 
 
@@ -249,18 +403,102 @@ nmea_reader_init( NmeaReader*  r )
 {
     memset( r, 0, sizeof(*r) );
 
-    r->pos      = 0;
+    r->len      = 0;
     r->overflow = 0;
     r->utc_year = -1;
     r->utc_mon  = -1;
     r->utc_day  = -1;
+    r->utc_time_ms = -1;
     r->cb_flag = 0;
+    r->last_type  = NMEA_UNKNOWN;
+    r->epoch_time = -1;
+    r->epoch_reported = 0;
+    r->epoch_expect   = 0;
+    r->hdop       = -1;
+    r->gsv_talker = -1;
     r->callback.location_cb = NULL;
     r->callback.status_cb = NULL;
     r->callback.sv_status_cb = NULL;
     r->callback.nmea_cb = NULL;
+}
+
+
+/* the sentence id is the talker, two characters, then the formatter */
+static int
+nmea_sentence_type( const char*  p, const char*  end, int*  talker )
+{
+    const unsigned char*  id = (const unsigned char*) p;
 
-    nmea_reader_update_utc_diff( r );
+    if (talker)
+        *talker = NMEA_TALKER_OTHER;
+
+    if (id < (const unsigned char*) end && id[0] == '$')
+        id += 1;
+
+    if ((const unsigned char*) end - id < 5)
+        return NMEA_UNKNOWN;
+
+    if (talker) {
+        switch (NMEA_TALKER(id[0], id[1])) {
+        case NMEA_TALKER('G','P'): *talker = NMEA_TALKER_GP; break;
+        case NMEA_TALKER('G','L'): *talker = NMEA_TALKER_GL; break;
+        case NMEA_TALKER('G','A'): *talker = NMEA_TALKER_GA; break;
+        case NMEA_TALKER('G','N'): *talker = NMEA_TALKER_GN; break;
+        }
+    }
+
+    switch (NMEA_ID(id[2], id[3], id[4])) {
+    case NMEA_ID('G','G','A'): return NMEA_GGA;
+    case NMEA_ID('G','S','A'): return NMEA_GSA;
+    case NMEA_ID('G','S','V'): return NMEA_GSV;
+    case NMEA_ID('R','M','C'): return NMEA_RMC;
+    case NMEA_ID('S','H','F'): return NMEA_SHF;
+    case NMEA_ID('D','P','S'): return NMEA_DPS;
+    }
+    return NMEA_UNKNOWN;
+}
+
+
+/* one SV numbering for every constellation, the one u-blox extended NMEA
+ * uses: GPS 1-32, SBAS 33-64, GLONASS 65-96, Galileo 211-246. returns -1
+ * for PRNs outside of it */
+static int
+nmea_sv_id( int  talker, int  prn )
+{
+    if (prn <= 0)
+        return -1;
+
+    switch (talker) {
+    case NMEA_TALKER_GL:
+        // some receivers number GLONASS by slot
+        if (prn <= 24)
+            prn += 64;
+        break;
+    case NMEA_TALKER_GA:
+        // NMEA 4.10 numbers Galileo from 1, or from 301
+        if (prn <= 36)
+            prn += 210;
+        else if (prn >= 301 && prn <= 336)
+            prn -= 90;
+        break;
+    }
+
+    return (prn < 256) ? prn : -1;
+}
+
+
+static void
+nmea_reader_log_counters( NmeaReader*  r )
+{
+    int  n;
+
+    for (n = 0; n < NMEA_TYPE_MAX; n++) {
+        NmeaCounters*  c = &r->counters[n];
+
+        if (c->received | c->bad_checksum | c->overflow)
+            LOGI("%-7s received %u, bad checksum %u, overflow %u",
+                 nmea_type_names[n], c->received, c->bad_checksum, c->overflow);
+    }
 }
 
 
@@ -287,40 +525,50 @@ nmea_reader_set_callback( NmeaReader*  r, GpsCallbacks*  cb )
 }
 
 
+/* "hhmmss.sss" as ms since midnight, -1 if malformed */
 static int
-nmea_reader_update_time( NmeaReader*  r, Token  tok )
+nmea_time_of_day( Token  tok )
 {
-    int        hour, minute;
-    double     seconds;
-    struct tm  tm;
-    time_t     fix_time;
+    int      hour, minute;
+    int32_t  millis;
 
     if (tok.p + 6 > tok.end)
         return -1;
 
+    hour    = str2int(tok.p,   tok.p+2);
+    minute  = str2int(tok.p+2, tok.p+4);
+    if (hour < 0 || hour > 23 || minute < 0 || minute > 59 ||
+        str2fixed(tok.p+4, tok.end, 3, &millis) < 0 || millis < 0 || millis >= 61000)
+        return -1;
+
+    return (hour * 60 + minute) * 60000 + millis;
+}
+
+
+static int
+nmea_reader_update_time( NmeaReader*  r, Token  tok )
+{
+    int        time_ms = nmea_time_of_day(tok);
+
+    if (time_ms < 0)
+        return -1;
+
     if (r->utc_year < 0) {
         // no date yet, get current one
-        time_t  now = time(NULL);
+        struct tm  tm;
+        time_t     now = time(NULL);
+
         gmtime_r( &now, &tm );
-        r->utc_year = tm.tm_year + 1900;
-        r->utc_mon  = tm.tm_mon + 1;
-        r->utc_day  = tm.tm_mday;
+        nmea_reader_set_date( r, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday );
     }
 
-    hour    = str2int(tok.p,   tok.p+2);
-    minute  = str2int(tok.p+2, tok.p+4);
-    seconds = str2float(tok.p+4, tok.end);
-
-    tm.tm_hour  = hour;
-    tm.tm_min   = minute;
-    tm.tm_sec   = (int) seconds;
-    tm.tm_year  = r->utc_year - 1900;
-    tm.tm_mon   = r->utc_mon - 1;
-    tm.tm_mday  = r->utc_day;
-    tm.tm_isdst = -1;
-
-    fix_time = mktime( &tm ) - r->utc_diff;
-    r->fix.timestamp = (long long)fix_time * 1000;
+    // GGA has no date: a time of day that jumps back by more than half a
+    // day crossed midnight before the next RMC brought the new date
+    if (r->utc_time_ms >= 0 && time_ms + 43200000 < r->utc_time_ms)
+        r->utc_date_ms += 86400000LL;
+    r->utc_time_ms = time_ms;
+
+    r->fix.timestamp = r->utc_date_ms + time_ms;
     return 0;
 }
 
@@ -343,25 +591,14 @@ nmea_reader_update_date( NmeaReader*  r, Token  date, Token  time )
         return -1;
     }
 
-    r->utc_year  = year;
-    r->utc_mon   = mon;
-    r->utc_day   = day;
+    // the epoch of the day is computed once per date
+    if (year != r->utc_year || mon != r->utc_mon || day != r->utc_day)
+        nmea_reader_set_date( r, year, mon, day );
 
     return nmea_reader_update_time( r, time );
 }
 
 
-static double
-convert_from_hhmm( Token  tok )
-{
-    double  val     = str2float(tok.p, tok.end);
-    int     degrees = (int)(floor(val) / 100);
-    double  minutes = val - degrees*100.;
-    double  dcoord  = degrees + minutes / 60.0;
-    return dcoord;
-}
-
-
 static int
 nmea_reader_update_latlong( NmeaReader*  r,
                             Token        latitude,
@@ -369,30 +606,28 @@ nmea_reader_update_latlong( NmeaReader*  r,
                             Token        longitude,
                             char         longitudeHemi )
 {
-    double   lat, lon;
+    int32_t  lat, lon;
     Token    tok;
 
     tok = latitude;
-    if (tok.p + 6 > tok.end) {
+    if (tok.p + 6 > tok.end || str2coord(tok.p, tok.end, &lat) < 0) {
         D("latitude is too short: '%.*s'", tok.end-tok.p, tok.p);
         return -1;
     }
-    lat = convert_from_hhmm(tok);
     if (latitudeHemi == 'S')
         lat = -lat;
 
     tok = longitude;
-    if (tok.p + 6 > tok.end) {
+    if (tok.p + 6 > tok.end || str2coord(tok.p, tok.end, &lon) < 0) {
         D("longitude is too short: '%.*s'", tok.end-tok.p, tok.p);
         return -1;
     }
-    lon = convert_from_hhmm(tok);
     if (longitudeHemi == 'W')
         lon = -lon;
 
-    r->fix.flags    |= GPS_LOCATION_HAS_LAT_LONG;
-    r->fix.latitude  = lat;
-    r->fix.longitude = lon;
+    r->fix.flags   |= GPS_LOCATION_HAS_LAT_LONG;
+    r->pos.latitude  = lat;
+    r->pos.longitude = lon;
     return 0;
 }
 
@@ -402,15 +637,13 @@ nmea_reader_update_altitude( NmeaReader*  r,
                              Token        altitude,
                              Token        units )
 {
-    double  alt;
     Token   tok = altitude;
 
-    if (tok.p >= tok.end)
+    if (tok.p >= tok.end || str2fixed(tok.p, tok.end, 3, &r->pos.altitude) < 0)
         return -1;
 
     r->fix.flags   |= GPS_LOCATION_HAS_ALTITUDE;
-    r->fix.altitude = str2float(tok.p, tok.end);
-    D("update altitude, altitude= %f", r->fix.altitude);
+    D("update altitude, altitude= %d mm", r->pos.altitude);
     return 0;
 }
 
@@ -419,14 +652,12 @@ static int
 nmea_reader_update_bearing( NmeaReader*  r,
                             Token        bearing )
 {
-    double  alt;
     Token   tok = bearing;
 
-    if (tok.p >= tok.end)
+    if (tok.p >= tok.end || str2fixed(tok.p, tok.end, 3, &r->pos.bearing) < 0)
         return -1;
 
     r->fix.flags   |= GPS_LOCATION_HAS_BEARING;
-    r->fix.bearing  = str2float(tok.p, tok.end);
     return 0;
 }
 
@@ -435,19 +666,30 @@ static int
 nmea_reader_update_speed( NmeaReader*  r,
                           Token        speed )
 {
-    double  alt;
     Token   tok = speed;
 
-    if (tok.p >= tok.end)
+    if (tok.p >= tok.end || str2fixed(tok.p, tok.end, 3, &r->pos.speed) < 0)
         return -1;
 
     r->fix.flags   |= GPS_LOCATION_HAS_SPEED;
-    r->fix.speed    = str2float(tok.p, tok.end) * (float)0.51444444444;
     return 0;
 }
 
+
+/* the only floating point conversion of a fix, right before it is reported */
+static void
+nmea_reader_fill_location( NmeaReader*  r )
+{
+    r->fix.latitude  = r->pos.latitude  * 1e-7;
+    r->fix.longitude = r->pos.longitude * 1e-7;
+    r->fix.altitude  = r->pos.altitude  * 1e-3;
+    r->fix.speed     = r->pos.speed     * (float)(0.51444444444 * 1e-3);
+    r->fix.bearing   = r->pos.bearing   * 1e-3f;
+}
+
 static int 
 nmea_reader_update_svinfo( NmeaReader* r,
+        int      talker,
         Token    prn,
         Token    snr,
         Token    elevation,
@@ -456,7 +698,9 @@ nmea_reader_update_svinfo( NmeaReader* r,
     int i = r->sv.num_svs;
     int ret;
 
-    ret = r->sv.sv_list[i].prn =  (prn.p < prn.end) ? str2int(prn.p, prn.end) : -1 ;
+    if (i >= GPS_MAX_SVS) return -5;
+
+    ret = r->sv.sv_list[i].prn =  (prn.p < prn.end) ? nmea_sv_id(talker, str2int(prn.p, prn.end)) : -1 ;
     if (ret < 0 ) return -1;
 
     ret = r->sv.sv_list[i].snr = (snr.p < snr.end) ? (float)str2int(snr.p, snr.end) : -1; 
@@ -473,31 +717,152 @@ nmea_reader_update_svinfo( NmeaReader* r,
 }
 
 static void
-nmea_reader_parse( NmeaReader*  r )
+nmea_reader_report_location( NmeaReader*  r )
+{
+    r->epoch_reported = 1;
+
+    if ((r->fix.flags & GPS_LOCATION_HAS_LAT_LONG) == 0) {
+        D("no fix in this epoch");
+        return;
+    }
+
+    if (r->hdop > 0) {
+        r->fix.flags   |= GPS_LOCATION_HAS_ACCURACY;
+        r->fix.accuracy = r->hdop * (NMEA_UERE_CM * 1e-4f);
+    }
+    nmea_reader_fill_location( r );
+
+#if GPS_DEBUG
+    {
+        char   temp[256];
+        char*  p   = temp;
+        char*  end = p + sizeof(temp);
+        struct tm   utc;
+        time_t      seconds = (time_t)(r->fix.timestamp / 1000);
+
+        p += snprintf( p, end-p, "sending fix" );
+        if (r->fix.flags & GPS_LOCATION_HAS_LAT_LONG) {
+            p += snprintf(p, end-p, " lat=%g lon=%g", r->fix.latitude, r->fix.longitude);
+        }
+        if (r->fix.flags & GPS_LOCATION_HAS_ALTITUDE) {
+            p += snprintf(p, end-p, " altitude=%g", r->fix.altitude);
+        }
+        if (r->fix.flags & GPS_LOCATION_HAS_SPEED) {
+            p += snprintf(p, end-p, " speed=%g", r->fix.speed);
+        }
+        if (r->fix.flags & GPS_LOCATION_HAS_BEARING) {
+            p += snprintf(p, end-p, " bearing=%g", r->fix.bearing);
+        }
+        if (r->fix.flags & GPS_LOCATION_HAS_ACCURACY) {
+            p += snprintf(p,end-p, " accuracy=%g", r->fix.accuracy);
+        }
+        gmtime_r( &seconds, &utc );
+        p += snprintf(p, end-p, " time=%s", asctime( &utc ) );
+        D(temp);
+    }
+#endif
+    if (r->callback.location_cb) {
+        r->callback.location_cb( &r->fix );
+    }
+    else {
+        D("no callback, fix dropped");
+    }
+}
+
+
+static void
+nmea_reader_report_sv_status( NmeaReader*  r )
+{
+    r->sv.ephemeris_mask = 0xffffffff;
+    r->sv.almanac_mask = 0xffffffff;
+    if(r->callback.sv_status_cb){
+        D("send a sv status,sv num:%d, used mask:%x, allbacking ......",
+                r->sv.num_svs,r->sv.used_in_fix_mask);
+        r->callback.sv_status_cb( &r->sv );
+    }
+    r->cb_flag &= (~SVINFO_FLAG);
+}
+
+
+/* GGA, RMC and NAV-PVT carry the time of the epoch they belong to, the
+ * sentences without one (GSA, GSV) go with the epoch opened last. when the
+ * time changes, the previous epoch is closed: one fix, unless it already
+ * went out, and one SV status */
+static void
+nmea_reader_start_epoch( NmeaReader*  r, int  time_ms )
+{
+    if (time_ms < 0 || time_ms == r->epoch_time)
+        return;
+
+    if (r->epoch_time >= 0) {
+        // before the SV report clears the GSA flag with the others
+        r->epoch_expect = r->cb_flag & EPOCH_FLAG;
+        if (!r->epoch_reported)
+            nmea_reader_report_location( r );
+        // GSA alone only updates the used set, the sky view needs a GSV
+        if ((r->cb_flag & GSV_FLAG) > 0)
+            nmea_reader_report_sv_status( r );
+    }
+
+    r->epoch_time     = time_ms;
+    r->epoch_reported = 0;
+    r->cb_flag        = 0;
+    r->fix.flags      = 0;
+    r->hdop           = -1;
+}
+
+
+static void
+nmea_reader_update_epoch( NmeaReader*  r, Token  tok_time )
+{
+    nmea_reader_start_epoch( r, nmea_time_of_day(tok_time) );
+}
+
+
+static void
+nmea_reader_update_hdop( NmeaReader*  r, Token  tok )
+{
+    int32_t  hdop;
+
+    if (tok.p < tok.end && str2fixed(tok.p, tok.end, 2, &hdop) == 0 && hdop > 0)
+        r->hdop = hdop;
+}
+
+
+static void
+nmea_reader_parse( NmeaReader*  r, const char*  s, int  len )
 {
     /* we received a complete sentence, now parse it to generate
      * a new GPS fix...
      */
     NmeaTokenizer  tzer[1];
     Token          tok;
+    int            type, talker;
+
+    D("Received: '%.*s'", len, s);
+    //LOGD("%.*s", len, s);
+    if (len < 9) {
+        D("Too short. discarded.");
+        return;
+    }
+
+    type = nmea_sentence_type(s, s + len, &talker);
+    if (nmea_tokenizer_init(tzer, s, s + len) < 0) {
+        D("bad checksum, dropped: '%.*s'", len, s);
+        r->counters[type].bad_checksum += 1;
+        return;
+    }
+    r->counters[type].received += 1;
 
 #ifdef __HAVE_NMEA_CALLBACK__
     //nmea callback, added by xecle 2010-8-11
-    if ( r->callback.nmea_cb && r->pos > 8)
+    if ( r->callback.nmea_cb )
     {
-//        D("NMEA %.*s callbacking....", 6, r->in);
-        r->callback.nmea_cb ( r->fix.timestamp, r->in, r->pos -2 );
+//        D("NMEA %.*s callbacking....", 6, s);
+        r->callback.nmea_cb ( r->fix.timestamp, s, len -2 );
     }
 #endif
 
-    D("Received: '%.*s'", r->pos, r->in);
-    //LOGD("%.*s", r->pos, r->in);
-    if (r->pos < 9) {
-        D("Too short. discarded.");
-        return;
-    }
-
-    nmea_tokenizer_init(tzer, r->in, r->in + r->pos);
 #if GPS_DEBUG
     {
         int  n;
@@ -515,27 +880,32 @@ nmea_reader_parse( NmeaReader*  r )
         return;
     }
 
-    // ignore first two characters.
-    tok.p += 2;
-    if ( !memcmp(tok.p, "GGA", 3) ) {
+    if ( type == NMEA_GGA ) {
         // GPS fix
         Token  tok_time          = nmea_tokenizer_get(tzer,1);
         Token  tok_latitude      = nmea_tokenizer_get(tzer,2);
         Token  tok_latitudeHemi  = nmea_tokenizer_get(tzer,3);
         Token  tok_longitude     = nmea_tokenizer_get(tzer,4);
         Token  tok_longitudeHemi = nmea_tokenizer_get(tzer,5);
+        Token  tok_quality       = nmea_tokenizer_get(tzer,6);
+        Token  tok_hdop          = nmea_tokenizer_get(tzer,8);
         Token  tok_altitude      = nmea_tokenizer_get(tzer,9);
         Token  tok_altitudeUnits = nmea_tokenizer_get(tzer,10);
 
+        nmea_reader_update_epoch(r, tok_time);
         nmea_reader_update_time(r, tok_time);
-        nmea_reader_update_latlong(r, tok_latitude,
-                                      tok_latitudeHemi.p[0],
-                                      tok_longitude,
-                                      tok_longitudeHemi.p[0]);
-        nmea_reader_update_altitude(r, tok_altitude, tok_altitudeUnits);
+        // quality 0 is no fix, the position fields are stale or empty
+        if (tok_quality.p < tok_quality.end && tok_quality.p[0] != '0') {
+            nmea_reader_update_latlong(r, tok_latitude,
+                                          tok_latitudeHemi.p[0],
+                                          tok_longitude,
+                                          tok_longitudeHemi.p[0]);
+            nmea_reader_update_altitude(r, tok_altitude, tok_altitudeUnits);
+            nmea_reader_update_hdop(r, tok_hdop);
+        }
         r->cb_flag |= GGA_FLAG ;
 
-    } else if ( !memcmp(tok.p, "GSV", 3) ) {
+    } else if ( type == NMEA_GSV ) {
         //GSV
         int i,no;
         int ret;
@@ -543,40 +913,65 @@ nmea_reader_parse( NmeaReader*  r )
         Token   tok_order       = nmea_tokenizer_get(tzer,2);
         int     num             = str2int(tok_num.p, tok_num.end);
         int     order           = str2int(tok_order.p, tok_order.end);
-        if( order == 1) 
+        // the talker that opens a sky view opens the next one too, the
+        // other constellations' groups are added to it
+        if( order == 1 && (r->gsv_talker < 0 || r->gsv_talker == talker)) {
             r->sv.num_svs = 0;
+            r->gsv_talker = talker;
+        }
         
         Token  tok_total         = nmea_tokenizer_get(tzer,3);
-        no = (tzer->count-1)/4;
+        no = (tzer->count-4)/4;
         for (i =0; i<no; i++) {
             Token  tok_prn           = nmea_tokenizer_get(tzer,4+i*4);
             Token  tok_elevation     = nmea_tokenizer_get(tzer,5+i*4);
             Token  tok_azimuth       = nmea_tokenizer_get(tzer,6+i*4);
             Token  tok_snr           = nmea_tokenizer_get(tzer,7+i*4);
-            ret = nmea_reader_update_svinfo(r, tok_prn,
+            ret = nmea_reader_update_svinfo(r, talker, tok_prn,
                     tok_snr,
                     tok_elevation,
                     tok_azimuth);
 			if (ret < 0 )
 			  D("GSV update_svinfo error @ %d", ret);
         }
-        D("receive a GSV: %d/%d  NMEA: '%.*s", order, num, r->pos, r->in);
+        D("receive a GSV: %d/%d  NMEA: '%.*s", order, num, len, s);
 
         if( num == order) r->cb_flag |= GSV_FLAG ; 
 
-    } else if ( !memcmp(tok.p, "GSA", 3) ) {
+    } else if ( type == NMEA_GSA ) {
         //GSA
         Token tok_prn;
-        int i,prn;
-        r->sv.used_in_fix_mask = 0;  //masked base on prn
-            for( i=0; i<12; i++){
-                tok_prn = nmea_tokenizer_get(tzer,i+3);
-                prn = str2int(tok_prn.p, tok_prn.end) -1;
-                r->sv.used_in_fix_mask |= ( ((uint32_t)1) << prn);
+        Token tok_system = nmea_tokenizer_get(tzer,18);
+        int i,sv,system = talker;
+
+        // a multi-constellation receiver sends one GSA per constellation,
+        // the first of a run starts the set over
+        if (r->last_type != NMEA_GSA)
+            memset(r->used_in_fix, 0, sizeof(r->used_in_fix));
+
+        // NMEA 4.10 names the constellation of a GN GSA in field 18
+        if (talker == NMEA_TALKER_GN && tok_system.p < tok_system.end) {
+            switch (tok_system.p[0]) {
+            case '2': system = NMEA_TALKER_GL; break;
+            case '3': system = NMEA_TALKER_GA; break;
             }
-            r->cb_flag |= GSA_FLAG;
+        }
 
-    } else if ( !memcmp(tok.p, "RMC", 3) ) {
+        for( i=0; i<12; i++){
+            tok_prn = nmea_tokenizer_get(tzer,i+3);
+            if (tok_prn.p >= tok_prn.end)
+                continue;
+            sv = nmea_sv_id(system, str2int(tok_prn.p, tok_prn.end)) - 1;
+            if (sv >= 0)
+                r->used_in_fix[sv >> 5] |= ((uint32_t)1) << (sv & 31);
+        }
+        // the framework's mask only holds SV ids 1-32
+        r->sv.used_in_fix_mask = r->used_in_fix[0];
+        // HDOP from GSA is the one of the whole solution
+        nmea_reader_update_hdop(r, nmea_tokenizer_get(tzer,16));
+        r->cb_flag |= GSA_FLAG;
+
+    } else if ( type == NMEA_RMC ) {
         Token  tok_time          = nmea_tokenizer_get(tzer,1);
         Token  tok_fixStatus     = nmea_tokenizer_get(tzer,2);
         Token  tok_latitude      = nmea_tokenizer_get(tzer,3);
@@ -588,6 +983,7 @@ nmea_reader_parse( NmeaReader*  r )
         Token  tok_date          = nmea_tokenizer_get(tzer,9);
 
         D("in RMC, fixStatus=%c", tok_fixStatus.p[0]);
+        nmea_reader_update_epoch( r, tok_time );
         if (tok_fixStatus.p[0] == 'A')
         {
             nmea_reader_update_date( r, tok_date, tok_time );
@@ -601,85 +997,385 @@ nmea_reader_parse( NmeaReader*  r )
             nmea_reader_update_speed  ( r, tok_speed );
         } else r->fix.flags = 0;
         r->cb_flag |= RMC_FLAG ;
-    } else if ( !memcmp(tok.p, "SHF", 3) ) {
+    } else if ( type == NMEA_SHF ) {
         r->cb_flag |= SHF_FLAG;
-    } else if ( !memcmp(tok.p, "DPS", 3) ) {
+    } else if ( type == NMEA_DPS ) {
         r->cb_flag |= DPS_FLAG;
     } else {
-        tok.p -= 2;
         D("unknown sentence '%.*s", tok.end-tok.p, tok.p);
     }
-//    if ((r->cb_flag & LOCATION_FLAG) == LOCATION_FLAG  && (r->fix.flags !=0)) {
-    if ((r->cb_flag & RMC_FLAG) == RMC_FLAG ) {
-#if GPS_DEBUG
-        char   temp[256];
-        char*  p   = temp;
-        char*  end = p + sizeof(temp);
-        struct tm   utc;
+    r->last_type = type;
 
-        p += snprintf( p, end-p, "sending fix" );
-        if (r->fix.flags & GPS_LOCATION_HAS_LAT_LONG) {
-            p += snprintf(p, end-p, " lat=%g lon=%g", r->fix.latitude, r->fix.longitude);
-        }
-        if (r->fix.flags & GPS_LOCATION_HAS_ALTITUDE) {
-            p += snprintf(p, end-p, " altitude=%g", r->fix.altitude);
-        }
-        if (r->fix.flags & GPS_LOCATION_HAS_SPEED) {
-            p += snprintf(p, end-p, " speed=%g", r->fix.speed);
-        }
-        if (r->fix.flags & GPS_LOCATION_HAS_BEARING) {
-            p += snprintf(p, end-p, " bearing=%g", r->fix.bearing);
-        }
-        if (r->fix.flags & GPS_LOCATION_HAS_ACCURACY) {
-            p += snprintf(p,end-p, " accuracy=%g", r->fix.accuracy);
-        }
-        gmtime_r( (time_t*) &r->fix.timestamp, &utc );
-        p += snprintf(p, end-p, " time=%s", asctime( &utc ) );
-        D(temp);
-#endif
-        if (r->callback.location_cb) {
-            r->callback.location_cb( &r->fix );
-            r->fix.flags = 0;
-            r->cb_flag &= (~LOCATION_FLAG);
-        }
-        else {
-            D("no callback, keeping data until needed !");
-        }
+    // once the epoch has every sentence the previous one had, its fix is
+    // complete and need not wait for the next epoch to start
+    if (!r->epoch_reported && r->epoch_expect != 0 &&
+        (r->cb_flag & r->epoch_expect) == r->epoch_expect)
+        nmea_reader_report_location( r );
+}
+
+
+/*****************************************************************/
+/*****************************************************************/
+/*****                                                       *****/
+/*****       U B X   D E C O D E R                           *****/
+/*****                                                       *****/
+/*****************************************************************/
+/*****************************************************************/
+
+/* u-blox binary protocol: two sync bytes, class, id, little-endian payload
+ * length, payload, and an 8-bit Fletcher checksum from class to the end of
+ * the payload. frames are decoded in the read buffer, fields are read
+ * where they lie */
+#define  UBX_SYNC1          0xb5
+#define  UBX_SYNC2          0x62
+#define  UBX_HEADER_SIZE    6
+#define  UBX_FRAME_OVERHEAD 8
+/* a NAV-SAT of 84 SVs, a partial frame must fit in NMEA_READ_SIZE */
+#define  UBX_MAX_PAYLOAD    1016
+
+#define  UBX_CLASS_NAV      0x01
+#define  UBX_CLASS_CFG      0x06
+#define  UBX_NAV_PVT        0x07
+#define  UBX_NAV_SAT        0x35
+#define  UBX_CFG_PRT        0x00
+#define  UBX_CFG_MSG        0x01
+
+#define  UBX_NAV_PVT_SIZE   92
+#define  UBX_NAV_SAT_HEADER 8
+#define  UBX_NAV_SAT_BLOCK  12
+
+static uint16_t
+ubx_u16( const unsigned char*  p )
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t
+ubx_u32( const unsigned char*  p )
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void
+ubx_checksum( const unsigned char*  p, int  len, unsigned char  ck[2] )
+{
+    unsigned char  a = 0, b = 0;
+
+    while (len-- > 0) {
+        a += *p++;
+        b += a;
     }
-    if ((r->cb_flag & SVINFO_FLAG) > 0 ) {
-        r->sv.ephemeris_mask = 0xffffffff;
-        r->sv.almanac_mask = 0xffffffff;
-        if(r->callback.sv_status_cb){
-            D("send a sv status,sv num:%d, used mask:%x, allbacking ......",
-                    r->sv.num_svs,r->sv.used_in_fix_mask);
-            r->callback.sv_status_cb( &r->sv );
+    ck[0] = a;
+    ck[1] = b;
+}
+
+
+static int
+ubx_message_type( int  cls, int  id )
+{
+    if (cls == UBX_CLASS_NAV) {
+        switch (id) {
+        case UBX_NAV_PVT: return NMEA_UBX_PVT;
+        case UBX_NAV_SAT: return NMEA_UBX_SAT;
         }
-        r->cb_flag &= (~SVINFO_FLAG);
     }
+    return NMEA_UBX;
 }
 
 
+/* gnssId and svId of NAV-SAT in the numbering of nmea_sv_id(), plus QZSS
+ * at 193-202. BeiDou has no ids there and is left out */
+static int
+ubx_sv_id( int  gnss, int  sv )
+{
+    switch (gnss) {
+    case 0:     // GPS
+        return (sv >= 1 && sv <= 32) ? sv : -1;
+    case 1:     // SBAS, PRN 120-151
+        return (sv >= 120 && sv <= 151) ? sv - 87 : -1;
+    case 2:     // Galileo
+        return (sv >= 1 && sv <= 36) ? nmea_sv_id(NMEA_TALKER_GA, sv) : -1;
+    case 5:     // QZSS
+        return (sv >= 1 && sv <= 10) ? sv + 192 : -1;
+    case 6:     // GLONASS by slot, 255 while the slot is not known
+        return (sv >= 1 && sv <= 32) ? sv + 64 : -1;
+    }
+    return -1;
+}
+
+
+/* UTC time of day of a NAV-PVT in ms, the nanosecond fraction rounded.
+ * nmea_replay tags epochs the same way */
+static int
+ubx_pvt_time_of_day( const unsigned char*  m )
+{
+    int32_t  nano = (int32_t)ubx_u32(m + 16);
+    int      time_ms;
+
+    time_ms = ((m[8] * 60 + m[9]) * 60 + m[10]) * 1000 +
+              (nano >= 0 ? nano + 500000 : nano - 500000) / 1000000;
+
+    return (time_ms < 0) ? time_ms + 86400000 : time_ms;
+}
+
+
+/* NAV-PVT holds the whole solution of an epoch, time, position, velocity
+ * and accuracy, so its fix goes out as soon as it is decoded */
 static void
-nmea_reader_addc( NmeaReader*  r, int  c )
+nmea_reader_ubx_pvt( NmeaReader*  r, const unsigned char*  m, int  len )
 {
-    if (r->overflow) {
-        r->overflow = (c != '\n');
+    int      year, time_ms, fix_type;
+    int32_t  speed;
+
+    if (len < UBX_NAV_PVT_SIZE)
+        return;
+
+    // valid: bit 0 UTC date, bit 1 UTC time
+    if ((m[11] & 0x03) != 0x03) {
+        D("NAV-PVT without UTC time, ignored");
         return;
     }
 
-    if (r->pos >= (int) sizeof(r->in)-1 ) {
-        r->overflow = 1;
-        r->pos      = 0;
+    year = ubx_u16(m + 4);
+    if (year != r->utc_year || m[6] != r->utc_mon || m[7] != r->utc_day)
+        nmea_reader_set_date( r, year, m[6], m[7] );
+
+    time_ms = ubx_pvt_time_of_day(m);
+    nmea_reader_start_epoch( r, time_ms );
+    if (r->epoch_reported) {
+        // the NMEA sentences of this epoch got there first
         return;
     }
 
-    r->in[r->pos] = (char)c;
-    r->pos       += 1;
+    r->utc_time_ms   = time_ms;
+    r->fix.timestamp = r->utc_date_ms + time_ms;
+    r->fix.flags     = 0;
+    r->hdop          = -1;
+
+    // fixType 2D, 3D or GNSS + dead reckoning, and gnssFixOK
+    fix_type = m[20];
+    if (fix_type >= 2 && fix_type <= 4 && (m[21] & 0x01)) {
+        r->pos.latitude  = (int32_t)ubx_u32(m + 28);
+        r->pos.longitude = (int32_t)ubx_u32(m + 24);
+        r->fix.flags    |= GPS_LOCATION_HAS_LAT_LONG;
+
+        if (fix_type != 2) {
+            r->pos.altitude  = (int32_t)ubx_u32(m + 36);     // above MSL
+            r->fix.flags    |= GPS_LOCATION_HAS_ALTITUDE;
+        }
+
+        // ground speed in mm/s to knots * 1000, heading 1e-5 deg
+        speed            = (int32_t)ubx_u32(m + 60);
+        r->pos.speed     = (int32_t)(((int64_t)speed * 1800 + 463) / 926);
+        r->pos.bearing   = (int32_t)ubx_u32(m + 64) / 100;
+        r->fix.flags    |= GPS_LOCATION_HAS_SPEED | GPS_LOCATION_HAS_BEARING;
 
-    if (c == '\n') {
-        nmea_reader_parse( r );
-        r->pos = 0;
+        // the receiver's own horizontal estimate, no HDOP guess
+        r->fix.accuracy  = ubx_u32(m + 40) * 1e-3f;
+        r->fix.flags    |= GPS_LOCATION_HAS_ACCURACY;
     }
+
+    nmea_reader_report_location( r );
+}
+
+
+/* NAV-SAT lists every SV of the sky view with its use in the solution,
+ * one message replaces the GSV groups and GSA runs of an epoch */
+static void
+nmea_reader_ubx_sat( NmeaReader*  r, const unsigned char*  m, int  len )
+{
+    const unsigned char*  b;
+    int                   count, n, sv, pass;
+
+    if (len < UBX_NAV_SAT_HEADER)
+        return;
+
+    count = m[5];
+    if (len < UBX_NAV_SAT_HEADER + count * UBX_NAV_SAT_BLOCK)
+        return;
+
+    memset(r->used_in_fix, 0, sizeof(r->used_in_fix));
+    for (n = 0, b = m + UBX_NAV_SAT_HEADER; n < count; n++, b += UBX_NAV_SAT_BLOCK) {
+        // flags bit 3: svUsed
+        sv = ubx_sv_id(b[0], b[1]) - 1;
+        if (sv >= 0 && (ubx_u32(b + 8) & 0x08))
+            r->used_in_fix[sv >> 5] |= ((uint32_t)1) << (sv & 31);
+    }
+    r->sv.used_in_fix_mask = r->used_in_fix[0];
+
+    // the list holds GPS_MAX_SVS, the SVs with a signal go in first
+    r->sv.num_svs = 0;
+    for (pass = 0; pass < 2; pass++) {
+        for (n = 0, b = m + UBX_NAV_SAT_HEADER; n < count; n++, b += UBX_NAV_SAT_BLOCK) {
+            GpsSvInfo*  info;
+
+            if ((b[2] != 0) != (pass == 0))
+                continue;
+            sv = ubx_sv_id(b[0], b[1]);
+            if (sv < 0 || r->sv.num_svs >= GPS_MAX_SVS)
+                continue;
+
+            info            = &r->sv.sv_list[r->sv.num_svs++];
+            info->prn       = sv;
+            info->snr       = b[2];
+            info->elevation = (signed char)b[3];
+            info->azimuth   = (int16_t)ubx_u16(b + 4);
+        }
+    }
+
+    nmea_reader_report_sv_status( r );
+}
+
+
+/* the frame at p, which starts with UBX_SYNC1. returns its size once it is
+ * decoded, 0 if it is not complete yet, or 1 to skip a sync byte that
+ * does not start a good frame */
+static int
+nmea_reader_ubx_frame( NmeaReader*  r, const unsigned char*  p, const unsigned char*  end )
+{
+    unsigned char  ck[2];
+    int            len, type;
+
+    if (end - p < UBX_HEADER_SIZE)
+        return (end - p < 2 || p[1] == UBX_SYNC2) ? 0 : 1;
+    if (p[1] != UBX_SYNC2)
+        return 1;
+
+    type = ubx_message_type(p[2], p[3]);
+    len  = ubx_u16(p + 4);
+    if (len > UBX_MAX_PAYLOAD) {
+        r->counters[type].overflow += 1;
+        return 1;
+    }
+    if (end - p < len + UBX_FRAME_OVERHEAD)
+        return 0;
+
+    ubx_checksum(p + 2, len + 4, ck);
+    if (ck[0] != p[len + 6] || ck[1] != p[len + 7]) {
+        D("bad UBX checksum, class %02x id %02x dropped", p[2], p[3]);
+        r->counters[type].bad_checksum += 1;
+        return 1;
+    }
+    r->counters[type].received += 1;
+
+    switch (type) {
+    case NMEA_UBX_PVT: nmea_reader_ubx_pvt( r, p + UBX_HEADER_SIZE, len ); break;
+    case NMEA_UBX_SAT: nmea_reader_ubx_sat( r, p + UBX_HEADER_SIZE, len ); break;
+    }
+    r->last_type = type;
+
+    return len + UBX_FRAME_OVERHEAD;
+}
+
+
+/* the caller read count bytes into r->buf + r->len. NMEA and UBX may come
+ * interleaved: a sync byte starts a binary frame, anything else is text.
+ * every complete line is parsed where it lies, found with memchr (word at
+ * a time in bionic) instead of a call per byte, and the tail is moved to
+ * the front of the buffer for the next read */
+static void
+nmea_reader_ingest( NmeaReader*  r, int  count )
+{
+    const char*  p   = r->buf;
+    const char*  end = r->buf + r->len + count;
+    const char*  q;
+    const char*  sync;
+    int          n;
+
+    while (p < end) {
+        if ((unsigned char)*p == UBX_SYNC1) {
+            n = nmea_reader_ubx_frame( r, (const unsigned char*)p,
+                                          (const unsigned char*)end );
+            if (n == 0)
+                break;
+            if (n > 1)
+                r->overflow = 0;
+            p += n;
+            continue;
+        }
+
+        // NMEA is 7-bit text, a sync byte before the end of the line is a
+        // frame that cut the sentence short
+        q    = memchr(p, '\n', end - p);
+        sync = memchr(p, UBX_SYNC1, (q != NULL ? q : end) - p);
+        if (sync != NULL) {
+            p = sync;
+            continue;
+        }
+        if (q == NULL)
+            break;
+
+        q += 1;
+        if (r->overflow) {
+            // end of a sentence whose start was dropped
+            r->overflow = 0;
+        } else if (q - p <= NMEA_MAX_SIZE) {
+            nmea_reader_parse( r, p, q - p );
+        } else {
+            r->counters[nmea_sentence_type(p, q, NULL)].overflow += 1;
+        }
+        p = q;
+    }
+
+    r->len = end - p;
+    if (r->len > NMEA_MAX_SIZE && (unsigned char)*p != UBX_SYNC1) {
+        // no end of line in sight, resync on the next one
+        if (!r->overflow)
+            r->counters[nmea_sentence_type(p, end, NULL)].overflow += 1;
+        r->overflow = 1;
+        r->len      = 0;
+    } else if (r->len > 0 && p != r->buf) {
+        memmove( r->buf, p, r->len );
+    }
+}
+
+
+/* frames a command and writes it to the receiver */
+static void
+ubx_send( int  fd, int  cls, int  id, const unsigned char*  payload, int  len )
+{
+    unsigned char  frame[UBX_FRAME_OVERHEAD + 32];
+    int            size = len + UBX_FRAME_OVERHEAD;
+    int            ret;
+
+    frame[0] = UBX_SYNC1;
+    frame[1] = UBX_SYNC2;
+    frame[2] = cls;
+    frame[3] = id;
+    frame[4] = len & 0xff;
+    frame[5] = len >> 8;
+    memcpy( frame + UBX_HEADER_SIZE, payload, len );
+    ubx_checksum( frame + 2, len + 4, frame + UBX_HEADER_SIZE + len );
+
+    do {
+        ret = write( fd, frame, size );
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret != size)
+        LOGE("could not send UBX class %02x id %02x: %s", cls, id, strerror(errno));
+}
+
+
+/* enables NAV-PVT and NAV-SAT every epoch, then turns the NMEA output of
+ * the port off. the module is on its UART1, kept at 115200 8N1 */
+static void
+ubx_enable_binary( int  fd )
+{
+    static const unsigned char  msg_pvt[3] = { UBX_CLASS_NAV, UBX_NAV_PVT, 1 };
+    static const unsigned char  msg_sat[3] = { UBX_CLASS_NAV, UBX_NAV_SAT, 1 };
+    static const unsigned char  prt[20] = {
+        0x01, 0x00, 0x00, 0x00,     // UART1, txReady off
+        0xd0, 0x08, 0x00, 0x00,     // 8N1
+        0x00, 0xc2, 0x01, 0x00,     // 115200 baud
+        0x03, 0x00,                 // in: UBX and NMEA
+        0x01, 0x00,                 // out: UBX only
+        0x00, 0x00, 0x00, 0x00
+    };
+
+    D("switching the receiver to UBX output");
+    ubx_send( fd, UBX_CLASS_CFG, UBX_CFG_MSG, msg_pvt, sizeof(msg_pvt) );
+    ubx_send( fd, UBX_CLASS_CFG, UBX_CFG_MSG, msg_sat, sizeof(msg_sat) );
+    ubx_send( fd, UBX_CLASS_CFG, UBX_CFG_PRT, prt, sizeof(prt) );
 }
 
 
@@ -706,6 +1402,7 @@ typedef struct {
     GpsCallbacks            callbacks;
     pthread_t               thread;
     int                     control[2];
+    int                     ubx;        /* switch the receiver to UBX */
 } GpsState;
 
 static GpsState  _gps_state[1];
@@ -817,6 +1514,7 @@ gps_state_thread( void*  arg )
     NmeaReader  reader[1];
     int         epoll_fd   = epoll_create(2);
     int         started    = 0;
+    int         ubx_pending = 0;
     int         gps_fd     = state->fd;
     int         control_fd = state->control[1];
 
@@ -867,6 +1565,12 @@ gps_state_thread( void*  arg )
                             gps_power_control(1);
                             D("gps thread starting  location_cb=%p", state->callbacks.location_cb);
                             started = 1;
+                            // the receiver was powered off, its epochs
+                            // start over and have to be seen again
+                            reader->epoch_time   = -1;
+                            reader->epoch_expect = 0;
+                            reader->cb_flag      = 0;
+                            ubx_pending = state->ubx;
                             nmea_reader_set_callback( reader, &state->callbacks );
                             sGpsStatus.status = GPS_STATUS_SESSION_BEGIN;
                             state->callbacks.status_cb(&sGpsStatus);
@@ -877,6 +1581,7 @@ gps_state_thread( void*  arg )
                         if (started) {
                             D("gps thread stopping");
                             started = 0;
+                            nmea_reader_log_counters( reader );
                             nmea_reader_set_callback( reader, NULL );
                             sGpsStatus.status = GPS_STATUS_SESSION_END;
                             state->callbacks.status_cb(&sGpsStatus);
@@ -888,12 +1593,12 @@ gps_state_thread( void*  arg )
                 }
                 else if (fd == gps_fd)
                 {
-                    char  buff[32];
                     //D("gps fd event");
                     for (;;) {
-                        int  nn, ret;
+                        int  ret;
 
-                        ret = read( fd, buff, sizeof(buff) );
+                        ret = read( fd, reader->buf + reader->len,
+                                    sizeof(reader->buf) - reader->len );
                         if (ret < 0) {
                             if (errno == EINTR)
                                 continue;
@@ -901,9 +1606,16 @@ gps_state_thread( void*  arg )
                                 LOGE("error while reading from gps daemon socket: %s:", strerror(errno));
                             break;
                         }
-                        //D("received %d bytes: %.*s", ret, ret, buff);
-                        for (nn = 0; nn < ret; nn++)
-                            nmea_reader_addc( reader, buff[nn] );
+                        if (ret == 0)
+                            break;
+                        //D("received %d bytes: %.*s", ret, ret, reader->buf + reader->len);
+                        nmea_reader_ingest( reader, ret );
+                    }
+                    // the receiver is up once it has sent an epoch, and
+                    // forgets its configuration when powered off
+                    if (ubx_pending && reader->epoch_time >= 0) {
+                        ubx_enable_binary( gps_fd );
+                        ubx_pending = 0;
                     }
                     D("gps fd event end");
                 }
@@ -925,19 +1637,28 @@ static int gps_serial_open(void)
     speed_t speed;
     int i, fd, flags;
     int oFlags = O_NOCTTY | O_RDWR;
+    char device[PROPERTY_VALUE_MAX];
+    const char* env = getenv(GPS_SERIAL_ENV);
     oFlags |= O_NONBLOCK;       // open O_NONBLOCK to avoid program hang at open
 
     speed = B115200;
 
-    fd = open(GPS_SERIAL_DEVICE, oFlags);
+    if (env != NULL && env[0] != '\0') {
+        strncpy(device, env, sizeof(device) - 1);
+        device[sizeof(device) - 1] = '\0';
+    } else {
+        property_get(GPS_SERIAL_PROPERTY, device, GPS_SERIAL_DEVICE);
+    }
+
+    fd = open(device, oFlags);
     if (-1 == fd)
     {
-        LOGE("gps_serial_open: erro %d \"%s\" Opening the serial port.\n",
-                errno, strerror(errno));
+        LOGE("gps_serial_open: erro %d \"%s\" Opening the serial port %s.\n",
+                errno, strerror(errno), device);
         return -1;
     }
 
-    D("gps will read from '%s'", GPS_SERIAL_DEVICE );
+    D("gps will read from '%s'", device );
 
     flags = fcntl(fd, F_GETFL);
     if (-1 == flags)
@@ -990,12 +1711,17 @@ static int gps_serial_open(void)
 static void
 gps_state_init( GpsState*  state )
 {
+    char  prop[PROPERTY_VALUE_MAX];
+
     state->init       = 1;
     state->control[0] = -1;
     state->control[1] = -1;
     state->fd         = -1;
     sGpsStatus.status = GPS_STATUS_NONE;
 
+    property_get(GPS_UBX_PROPERTY, prop, "0");
+    state->ubx = (prop[0] == '1');
+
     state->fd = gps_serial_open();
 
     if (state->fd < 0) {
@@ -0,0 +1,329 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* loads the GPS HAL, points it at a pty and replays a capture through it
+ * the way the location provider would see it:
+ *
+ *   nmea_bench [-h hal.so] [-r] [-n loops] drive.nmea
+ *
+ * reports the sentences parsed per second, the latency from the write of
+ * an epoch to its location_cb, and the CPU time of the HAL per fix. the
+ * default is to replay as fast as the HAL reads, -r paces the epochs by
+ * their time tags.
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <hardware/hardware.h>
+#include <hardware/gps.h>
+
+#include "nmea_log.h"
+
+#ifndef TARGET_DEVICE
+#  define TARGET_DEVICE  "default"
+#endif
+
+#define  DEFAULT_HAL      "/system/lib/hw/gps." TARGET_DEVICE ".so"
+#define  MAX_PENDING      256       /* epochs written but not reported yet */
+#define  MAX_SAMPLES      65536
+#define  IDLE_NS          500000000LL
+
+typedef struct {
+    int      time_ms;
+    int64_t  written;
+} Pending;
+
+static pthread_mutex_t  bench_lock = PTHREAD_MUTEX_INITIALIZER;
+static Pending          pending[MAX_PENDING];
+static int              pending_next;
+static int64_t          first_write;
+static int64_t          last_event;
+static long             sentences;
+static long             sv_reports;
+static long             fixes;
+static long             unmatched;
+static int              latency_count;
+static int32_t          latency_us[MAX_SAMPLES];
+
+
+static void
+bench_epoch( int  time_ms, void*  arg )
+{
+    int64_t  now = nmea_now_ns();
+
+    (void)arg;
+    pthread_mutex_lock( &bench_lock );
+    if (first_write == 0)
+        first_write = now;
+    if (time_ms >= 0) {
+        pending[pending_next].time_ms = time_ms;
+        pending[pending_next].written = now;
+        pending_next = (pending_next + 1) % MAX_PENDING;
+    }
+    pthread_mutex_unlock( &bench_lock );
+}
+
+
+static void
+bench_location( GpsLocation*  location )
+{
+    int64_t  now     = nmea_now_ns();
+    int      time_ms = (int)(location->timestamp % 86400000);
+    int      n;
+
+    pthread_mutex_lock( &bench_lock );
+    fixes     += 1;
+    last_event = now;
+
+    // the most recent write of that epoch, loops repeat the time tags
+    for (n = 1; n <= MAX_PENDING; n++) {
+        Pending*  p = &pending[(pending_next - n + MAX_PENDING) % MAX_PENDING];
+
+        if (p->written != 0 && p->time_ms == time_ms) {
+            if (latency_count < MAX_SAMPLES)
+                latency_us[latency_count++] = (int32_t)((now - p->written) / 1000);
+            break;
+        }
+    }
+    if (n > MAX_PENDING)
+        unmatched += 1;
+    pthread_mutex_unlock( &bench_lock );
+}
+
+
+static void
+bench_status( GpsStatus*  status )
+{
+    (void)status;
+}
+
+
+static void
+bench_sv_status( GpsSvStatus*  sv_status )
+{
+    (void)sv_status;
+    pthread_mutex_lock( &bench_lock );
+    sv_reports += 1;
+    last_event  = nmea_now_ns();
+    pthread_mutex_unlock( &bench_lock );
+}
+
+
+static void
+bench_nmea( GpsUtcTime  timestamp, const char*  nmea, int  length )
+{
+    (void)timestamp; (void)nmea; (void)length;
+    pthread_mutex_lock( &bench_lock );
+    sentences += 1;
+    last_event = nmea_now_ns();
+    pthread_mutex_unlock( &bench_lock );
+}
+
+
+static void
+bench_set_capabilities( uint32_t  capabilities )
+{
+    (void)capabilities;
+}
+
+
+static void
+bench_wakelock( void )
+{
+}
+
+
+static pthread_t
+bench_create_thread( const char*  name, void (*start)(void*), void*  arg )
+{
+    pthread_t  thread;
+
+    (void)name;
+    pthread_create( &thread, NULL, (void* (*)(void*))start, arg );
+    return thread;
+}
+
+
+static GpsCallbacks  bench_callbacks = {
+    .size                = sizeof(GpsCallbacks),
+    .location_cb         = bench_location,
+    .status_cb           = bench_status,
+    .sv_status_cb        = bench_sv_status,
+    .nmea_cb             = bench_nmea,
+    .set_capabilities_cb = bench_set_capabilities,
+    .acquire_wakelock_cb = bench_wakelock,
+    .release_wakelock_cb = bench_wakelock,
+    .create_thread_cb    = bench_create_thread,
+};
+
+
+static int64_t
+cpu_time_ns( clockid_t  clock )
+{
+    struct timespec  ts;
+
+    clock_gettime( clock, &ts );
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+static int
+compare_int32( const void*  a, const void*  b )
+{
+    int32_t  x = *(const int32_t*)a, y = *(const int32_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+
+static const GpsInterface*
+load_hal( const char*  path )
+{
+    struct hw_module_t*   module;
+    struct hw_device_t*   device;
+    void*                 handle;
+
+    handle = dlopen( path, RTLD_NOW );
+    if (handle == NULL) {
+        fprintf( stderr, "cannot load %s: %s\n", path, dlerror() );
+        return NULL;
+    }
+
+    module = dlsym( handle, HAL_MODULE_INFO_SYM_AS_STR );
+    if (module == NULL || module->methods->open( module, GPS_HARDWARE_MODULE_ID, &device ) != 0) {
+        fprintf( stderr, "%s is not a GPS HAL\n", path );
+        return NULL;
+    }
+
+    return ((struct gps_device_t*)device)->get_gps_interface( (struct gps_device_t*)device );
+}
+
+
+static void
+usage( void )
+{
+    fprintf( stderr, "usage: nmea_bench [-h hal.so] [-r] [-n loops] <log>\n" );
+    exit( 1 );
+}
+
+
+int
+main( int  argc, char**  argv )
+{
+    const char*          hal_path = DEFAULT_HAL;
+    const GpsInterface*  gps;
+    NmeaLog              log;
+    char                 slave[64];
+    int                  slave_fd, master;
+    int                  realtime = 0, loops = 1, n;
+    long                 epochs = 0;
+    int64_t              cpu_start, writer_start, cpu_used, elapsed;
+
+    while ((n = getopt( argc, argv, "h:rn:" )) != -1) {
+        switch (n) {
+            case 'h': hal_path = optarg; break;
+            case 'r': realtime = 1; break;
+            case 'n': loops = atoi( optarg ); break;
+            default:  usage();
+        }
+    }
+    if (optind >= argc || loops <= 0)
+        usage();
+
+    if (nmea_log_load( &log, argv[optind] ) < 0)
+        return 1;
+
+    master = nmea_pty_open( slave, sizeof(slave), &slave_fd );
+    if (master < 0)
+        return 1;
+
+    // the HAL opens its port in init, the environment beats the property
+    setenv( "GPS_NMEA_DEVICE", slave, 1 );
+
+    gps = load_hal( hal_path );
+    if (gps == NULL)
+        return 1;
+
+    cpu_start = cpu_time_ns( CLOCK_PROCESS_CPUTIME_ID );
+
+    if (gps->init( &bench_callbacks ) != 0 || gps->start() != 0) {
+        fprintf( stderr, "the HAL failed to start on %s\n", slave );
+        return 1;
+    }
+
+    // the writer runs on this thread, its CPU time is not the HAL's
+    writer_start = cpu_time_ns( CLOCK_THREAD_CPUTIME_ID );
+    for (n = 0; n < loops; n++) {
+        int  ret = nmea_log_replay( &log, master, realtime, bench_epoch, NULL );
+
+        if (ret < 0)
+            break;
+        epochs += ret;
+    }
+    writer_start = cpu_time_ns( CLOCK_THREAD_CPUTIME_ID ) - writer_start;
+
+    // wait for the HAL to drain the pty
+    for (;;) {
+        int64_t  idle;
+
+        usleep( 100000 );
+        pthread_mutex_lock( &bench_lock );
+        idle = nmea_now_ns() - (last_event ? last_event : first_write);
+        pthread_mutex_unlock( &bench_lock );
+        if (idle > IDLE_NS)
+            break;
+    }
+
+    cpu_used = cpu_time_ns( CLOCK_PROCESS_CPUTIME_ID ) - cpu_start - writer_start;
+    elapsed  = last_event - first_write;
+
+    gps->stop();
+    gps->cleanup();
+
+    printf( "epochs written     %ld\n", epochs );
+    printf( "sentences          %ld (%.0f/s)\n", sentences,
+            elapsed > 0 ? sentences * 1e9 / elapsed : 0.0 );
+    printf( "fixes              %ld (%ld unmatched)\n", fixes, unmatched );
+    printf( "sv reports         %ld\n", sv_reports );
+
+    if (latency_count > 0) {
+        int64_t  sum = 0;
+
+        qsort( latency_us, latency_count, sizeof(latency_us[0]), compare_int32 );
+        for (n = 0; n < latency_count; n++)
+            sum += latency_us[n];
+
+        printf( "latency us         avg %lld  p50 %d  p99 %d  max %d\n",
+                (long long)(sum / latency_count),
+                latency_us[latency_count / 2],
+                latency_us[(latency_count * 99) / 100],
+                latency_us[latency_count - 1] );
+    }
+    if (fixes > 0)
+        printf( "cpu per fix        %lld us\n", (long long)(cpu_used / 1000 / fixes) );
+
+    close( slave_fd );
+    close( master );
+    nmea_log_free( &log );
+    return 0;
+}
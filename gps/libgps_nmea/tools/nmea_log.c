@@ -0,0 +1,376 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "nmea_log.h"
+
+/* a pause longer than this in the log is not waited out */
+#define  NMEA_MAX_GAP_MS  10000
+
+#define  UBX_SYNC1          0xb5
+#define  UBX_SYNC2          0x62
+#define  UBX_FRAME_OVERHEAD 8
+#define  UBX_CLASS_NAV      0x01
+#define  UBX_NAV_PVT        0x07
+#define  UBX_NAV_PVT_SIZE   92
+
+typedef struct {
+    int                  fd;
+    int                  realtime;
+    int                  base_time;     /* time tag the schedule starts from */
+    int                  last_offset;
+    int64_t              start;         /* when base_time was written */
+    nmea_epoch_callback  cb;
+    void*                arg;
+} NmeaReplay;
+
+
+int64_t
+nmea_now_ns( void )
+{
+    struct timespec  ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+int
+nmea_log_load( NmeaLog*  log, const char*  path )
+{
+    struct stat  st;
+    size_t       done = 0;
+    int          fd;
+
+    log->data = NULL;
+    log->size = 0;
+
+    fd = open( path, O_RDONLY );
+    if (fd < 0 || fstat( fd, &st ) < 0) {
+        fprintf( stderr, "cannot open %s: %s\n", path, strerror(errno) );
+        if (fd >= 0)
+            close( fd );
+        return -1;
+    }
+
+    log->data = malloc( st.st_size + 1 );
+    if (log->data == NULL) {
+        close( fd );
+        return -1;
+    }
+
+    while (done < (size_t)st.st_size) {
+        ssize_t  ret = read( fd, log->data + done, st.st_size - done );
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        done += ret;
+    }
+    close( fd );
+
+    log->size = done;
+    log->data[done] = '\0';
+    return 0;
+}
+
+
+void
+nmea_log_free( NmeaLog*  log )
+{
+    free( log->data );
+    log->data = NULL;
+    log->size = 0;
+}
+
+
+/* "hhmmss[.sss]" at p as ms since midnight, -1 if malformed */
+static int
+nmea_parse_time( const char*  p, const char*  end )
+{
+    int  n, value = 0, millis = 0, scale = 100;
+
+    if (end - p < 6)
+        return -1;
+
+    for (n = 0; n < 6; n++) {
+        if (p[n] < '0' || p[n] > '9')
+            return -1;
+    }
+
+    value = (((p[0]-'0')*10 + (p[1]-'0')) * 60 + (p[2]-'0')*10 + (p[3]-'0')) * 60
+            + (p[4]-'0')*10 + (p[5]-'0');
+
+    p += 6;
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9' && scale > 0; p++, scale /= 10)
+            millis += (*p - '0') * scale;
+    }
+
+    return value * 1000 + millis;
+}
+
+
+/* the time tag of a GGA or RMC sentence, -1 for anything else */
+static int
+nmea_line_time( const char*  p, const char*  end )
+{
+    if (end - p < 13 || p[0] != '$' || p[6] != ',')
+        return -1;
+
+    if (memcmp( p + 3, "GGA", 3 ) && memcmp( p + 3, "RMC", 3 ))
+        return -1;
+
+    return nmea_parse_time( p + 7, end );
+}
+
+
+/* the UTC time of day of a NAV-PVT payload, rounded the way the HAL
+ * rounds it, -1 if the receiver had no valid time */
+static int
+ubx_pvt_time( const unsigned char*  m )
+{
+    int32_t  nano;
+    int      time_ms;
+
+    if ((m[11] & 0x03) != 0x03)
+        return -1;
+
+    nano    = (int32_t)(m[16] | (m[17] << 8) | (m[18] << 16) | ((uint32_t)m[19] << 24));
+    time_ms = ((m[8] * 60 + m[9]) * 60 + m[10]) * 1000 +
+              (nano >= 0 ? nano + 500000 : nano - 500000) / 1000000;
+
+    return (time_ms < 0) ? time_ms + 86400000 : time_ms;
+}
+
+
+/* the size of the UBX frame at p, 0 if there is none. the checksum is
+ * checked so that a frame cut short in the capture does not swallow the
+ * next one and its time tag */
+static size_t
+ubx_frame_size( const char*  p, const char*  end )
+{
+    const unsigned char*  f = (const unsigned char*) p;
+    unsigned char         a = 0, b = 0;
+    size_t                size, n;
+
+    if (end - p < UBX_FRAME_OVERHEAD || f[0] != UBX_SYNC1 || f[1] != UBX_SYNC2)
+        return 0;
+
+    size = UBX_FRAME_OVERHEAD + (f[4] | (f[5] << 8));
+    if (size > (size_t)(end - p))
+        return 0;
+
+    for (n = 2; n < size - 2; n++) {
+        a += f[n];
+        b += a;
+    }
+    return (a == f[size - 2] && b == f[size - 1]) ? size : 0;
+}
+
+
+/* end of the record starting at p: a sentence, a UBX frame, or stray bytes
+ * up to the next one of those, which go with the epoch they are in */
+static const char*
+nmea_record_end( const char*  p, const char*  end, int*  time_ms )
+{
+    const char*  q;
+    const char*  sync;
+    size_t       size;
+
+    *time_ms = -1;
+
+    if (*p == '$') {
+        q = memchr( p, '\n', end - p );
+        q = (q != NULL) ? q + 1 : end;
+        *time_ms = nmea_line_time( p, q );
+        return q;
+    }
+
+    size = ubx_frame_size( p, end );
+    if (size > 0) {
+        const unsigned char*  f = (const unsigned char*) p;
+
+        // NAV-PVT tags the epoch of a binary stream
+        if (f[2] == UBX_CLASS_NAV && f[3] == UBX_NAV_PVT &&
+            size >= UBX_FRAME_OVERHEAD + UBX_NAV_PVT_SIZE)
+            *time_ms = ubx_pvt_time( f + 6 );
+        return p + size;
+    }
+
+    q    = memchr( p + 1, '$', end - p - 1 );
+    sync = memchr( p + 1, UBX_SYNC1, (q != NULL ? q : end) - p - 1 );
+    if (sync != NULL)
+        return sync;
+    return (q != NULL) ? q : end;
+}
+
+
+static void
+nmea_replay_wait( NmeaReplay*  rp, int  time_ms )
+{
+    int      offset;
+    int64_t  delay;
+
+    if (rp->base_time < 0) {
+        rp->base_time   = time_ms;
+        rp->last_offset = 0;
+        rp->start       = nmea_now_ns();
+        return;
+    }
+
+    offset = time_ms - rp->base_time;
+    if (offset < 0)
+        offset += 86400000;     // crossed midnight
+
+    // a gap in the recording, or time going back: start the schedule over
+    if (offset < rp->last_offset || offset - rp->last_offset > NMEA_MAX_GAP_MS) {
+        rp->base_time   = time_ms;
+        rp->last_offset = 0;
+        rp->start       = nmea_now_ns();
+        return;
+    }
+    rp->last_offset = offset;
+
+    delay = rp->start + (int64_t)offset * 1000000LL - nmea_now_ns();
+    if (delay > 0) {
+        struct timespec  ts;
+
+        ts.tv_sec  = delay / 1000000000LL;
+        ts.tv_nsec = delay % 1000000000LL;
+        while (nanosleep( &ts, &ts ) < 0 && errno == EINTR)
+            ;
+    }
+}
+
+
+static int
+nmea_replay_epoch( NmeaReplay*  rp, const char*  p, size_t  size, int  time_ms )
+{
+    if (rp->realtime && time_ms >= 0)
+        nmea_replay_wait( rp, time_ms );
+
+    if (rp->cb)
+        rp->cb( time_ms, rp->arg );
+
+    while (size > 0) {
+        ssize_t  ret = write( rp->fd, p, size );
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf( stderr, "write error: %s\n", strerror(errno) );
+            return -1;
+        }
+        p    += ret;
+        size -= ret;
+    }
+    return 0;
+}
+
+
+int
+nmea_log_replay( NmeaLog*  log, int  fd, int  realtime,
+                 nmea_epoch_callback  cb, void*  arg )
+{
+    NmeaReplay   rp;
+    const char*  p     = log->data;
+    const char*  end   = log->data + log->size;
+    const char*  epoch = p;
+    int          epoch_time = -1;
+    int          epochs = 0;
+
+    rp.fd        = fd;
+    rp.realtime  = realtime;
+    rp.base_time = -1;
+    rp.last_offset = 0;
+    rp.start     = 0;
+    rp.cb        = cb;
+    rp.arg       = arg;
+
+    while (p < end) {
+        int          time_ms;
+        const char*  q = nmea_record_end( p, end, &time_ms );
+
+        // a new time tag starts the next epoch
+        if (time_ms >= 0 && time_ms != epoch_time) {
+            if (p > epoch) {
+                if (nmea_replay_epoch( &rp, epoch, p - epoch, epoch_time ) < 0)
+                    return -1;
+                epochs += 1;
+            }
+            epoch      = p;
+            epoch_time = time_ms;
+        }
+        p = q;
+    }
+
+    if (p > epoch) {
+        if (nmea_replay_epoch( &rp, epoch, p - epoch, epoch_time ) < 0)
+            return -1;
+        epochs += 1;
+    }
+
+    return epochs;
+}
+
+
+int
+nmea_pty_open( char*  slave_name, size_t  size, int*  slave_fd )
+{
+    struct termios  tio;
+    const char*     name;
+    int             master;
+
+    master = open( "/dev/ptmx", O_RDWR | O_NOCTTY );
+    if (master < 0) {
+        fprintf( stderr, "cannot open /dev/ptmx: %s\n", strerror(errno) );
+        return -1;
+    }
+
+    if (grantpt( master ) < 0 || unlockpt( master ) < 0 ||
+        (name = ptsname( master )) == NULL) {
+        fprintf( stderr, "cannot set up the pty: %s\n", strerror(errno) );
+        close( master );
+        return -1;
+    }
+
+    strncpy( slave_name, name, size - 1 );
+    slave_name[size - 1] = '\0';
+
+    // raw from the start, no echo back into the master or line editing
+    // before the reader sets its own attributes
+    *slave_fd = open( slave_name, O_RDWR | O_NOCTTY );
+    if (*slave_fd < 0 || tcgetattr( *slave_fd, &tio ) < 0) {
+        fprintf( stderr, "cannot open %s: %s\n", slave_name, strerror(errno) );
+        close( master );
+        return -1;
+    }
+    cfmakeraw( &tio );
+    tcsetattr( *slave_fd, TCSANOW, &tio );
+
+    return master;
+}
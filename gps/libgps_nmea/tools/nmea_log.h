@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NMEA_LOG_H
+#define NMEA_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* a receiver capture as recorded by "nmea_replay -R": the raw bytes of
+ * the serial port, NMEA and UBX, split into epochs by the time tags of
+ * GGA, RMC and NAV-PVT */
+typedef struct {
+    char*   data;
+    size_t  size;
+} NmeaLog;
+
+/* called before an epoch is written, time_ms is its UTC time of day */
+typedef void (*nmea_epoch_callback)( int  time_ms, void*  arg );
+
+int   nmea_log_load( NmeaLog*  log, const char*  path );
+void  nmea_log_free( NmeaLog*  log );
+
+/* writes the log to fd, an epoch per write. realtime paces the epochs by
+ * their time tags, otherwise they go as fast as fd takes them. returns
+ * the number of epochs written, -1 on a write error */
+int   nmea_log_replay( NmeaLog*  log, int  fd, int  realtime,
+                       nmea_epoch_callback  cb, void*  arg );
+
+/* opens a pty in raw mode and returns the master. the slave stays open
+ * in *slave_fd so that nothing is lost before the reader opens it */
+int   nmea_pty_open( char*  slave_name, size_t  size, int*  slave_fd );
+
+/* monotonic clock in ns */
+int64_t  nmea_now_ns( void );
+
+#endif /* NMEA_LOG_H */
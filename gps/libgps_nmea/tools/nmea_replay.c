@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* records the serial output of the receiver, and plays such a capture back
+ * through a pty so that the HAL reads it as if it came from the chip:
+ *
+ *   nmea_replay -R /dev/ttymxc1 drive.nmea      record until interrupted
+ *   nmea_replay [-m] [-l loops] drive.nmea      replay, -m at full speed
+ *
+ * point the HAL at the printed pty with "setprop gps.nmea.device <pty>"
+ * before the location provider starts it.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "nmea_log.h"
+
+static volatile sig_atomic_t  stop_requested;
+
+static void
+on_signal( int  sig )
+{
+    (void)sig;
+    stop_requested = 1;
+}
+
+
+static int
+record( const char*  device, const char*  path )
+{
+    struct termios  tio;
+    char            buf[4096];
+    long            total = 0;
+    int             in, out;
+
+    in = open( device, O_RDONLY | O_NOCTTY );
+    if (in < 0) {
+        fprintf( stderr, "cannot open %s: %s\n", device, strerror(errno) );
+        return 1;
+    }
+
+    // same line settings as the HAL, the bytes are kept as they come
+    if (tcgetattr( in, &tio ) == 0) {
+        cfmakeraw( &tio );
+        cfsetispeed( &tio, B115200 );
+        cfsetospeed( &tio, B115200 );
+        tio.c_cflag |= CLOCAL | CREAD;
+        tcsetattr( in, TCSANOW, &tio );
+    }
+
+    out = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if (out < 0) {
+        fprintf( stderr, "cannot create %s: %s\n", path, strerror(errno) );
+        close( in );
+        return 1;
+    }
+
+    signal( SIGINT, on_signal );
+    signal( SIGTERM, on_signal );
+
+    while (!stop_requested) {
+        ssize_t  ret = read( in, buf, sizeof(buf) );
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf( stderr, "read error: %s\n", strerror(errno) );
+            break;
+        }
+        if (ret == 0)
+            break;
+        if (write( out, buf, ret ) != ret) {
+            fprintf( stderr, "write error: %s\n", strerror(errno) );
+            break;
+        }
+        total += ret;
+    }
+
+    fprintf( stderr, "recorded %ld bytes to %s\n", total, path );
+    close( out );
+    close( in );
+    return 0;
+}
+
+
+static void
+usage( void )
+{
+    fprintf( stderr, "usage: nmea_replay [-m] [-l loops] <log>\n"
+                     "       nmea_replay -R <device> <log>\n" );
+    exit( 1 );
+}
+
+
+int
+main( int  argc, char**  argv )
+{
+    NmeaLog  log;
+    char     slave[64];
+    int      slave_fd, master;
+    int      realtime = 1, loops = 1, n;
+    int64_t  start;
+    long     epochs = 0;
+
+    while ((n = getopt( argc, argv, "ml:R:" )) != -1) {
+        switch (n) {
+            case 'm': realtime = 0; break;
+            case 'l': loops = atoi( optarg ); break;
+            case 'R':
+                if (optind >= argc)
+                    usage();
+                return record( optarg, argv[optind] );
+            default:  usage();
+        }
+    }
+    if (optind >= argc)
+        usage();
+
+    if (nmea_log_load( &log, argv[optind] ) < 0)
+        return 1;
+
+    master = nmea_pty_open( slave, sizeof(slave), &slave_fd );
+    if (master < 0)
+        return 1;
+
+    printf( "%s\n", slave );
+    fflush( stdout );
+
+    // give the HAL time to be pointed at the pty and started
+    fprintf( stderr, "press enter to start\n" );
+    getchar();
+
+    start = nmea_now_ns();
+    for (n = 0; n < loops || loops <= 0; n++) {
+        int  ret = nmea_log_replay( &log, master, realtime, NULL, NULL );
+
+        if (ret < 0)
+            break;
+        epochs += ret;
+    }
+
+    fprintf( stderr, "%ld epochs in %.3f s\n", epochs,
+             (nmea_now_ns() - start) / 1e9 );
+
+    close( slave_fd );
+    close( master );
+    nmea_log_free( &log );
+    return 0;
+}
@@ -28,3 +28,29 @@ LOCAL_CFLAGS += \
         -fno-short-enums
 
 include $(BUILD_STATIC_LIBRARY)
+
+# Host routing benchmark, HWA runs against the recording mock component
+ifeq ($(HOST_OS),linux)
+include $(CLEAR_VARS)
+LOCAL_MODULE := hwa_route_bench
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES:= \
+        src/hwa_control.c \
+        src/audionull.c \
+        src/audiomock.c \
+        tools/hwa_route_bench.c
+
+LOCAL_STATIC_LIBRARIES := \
+        liblog
+
+LOCAL_C_INCLUDES += \
+        $(HARDWARE_ADAPTER)
+
+LOCAL_CFLAGS += \
+        -DHWA_MOCK_COMPONENTS
+
+LOCAL_LDLIBS += -lpthread -lrt
+
+include $(BUILD_HOST_EXECUTABLE)
+endif
@@ -54,6 +54,32 @@ typedef enum
     AEC_INVALID
 } AEC_SLEEP_MODE;
 
+/* Nodes kept open by the GPO component */
+typedef enum
+{
+    GPO_NODE_AUDIO_PA_EN = 0,
+    GPO_NODE_EAR_POP,
+    GPO_NODE_HP_AMP_SD,
+    GPO_NODE_FM2010,
+    GPO_NODE_MAX
+} GPO_NODE_ID;
+
+typedef struct
+{
+    const char *name;
+    int fd;
+    char value;             /* last value written, 0 when unknown */
+    char offPending;        /* delayed power down armed */
+    long long offDeadline;  /* CLOCK_MONOTONIC ms of the delayed power down */
+} GPO_NODE;
+
+typedef struct
+{
+    GPO_NODE node[GPO_NODE_MAX];
+    pthread_mutex_t lock;
+    unsigned int holdOffMs;
+} GPO_CONTEXT;
+
 /*---------------------------------------------------------------------------*/
 
 #ifdef __cplusplus
@@ -0,0 +1,67 @@
+/* Copyright © 2010, Letou Tech Co., Ltd. All rights reserved.
+   Letou Tech Co., Ltd. Confidential Proprietary
+   Contains confidential proprietary information of Letou Tech Co., Ltd.
+   Reverse engineering is prohibited.
+   The copyright notice does not imply publication. */
+/*******************************************************************************
+* Title: audioMockApi
+*
+* Filename: audiomockapi.h
+*
+* Target, platform: Host, SW platform
+*
+* Authors:
+*
+* Description: Recording component standing in for the platform components
+*              when HWA is built with HWA_MOCK_COMPONENTS.
+*
+* Last Updated:
+*
+* Notes:
+*******************************************************************************/
+#ifndef AUDIO_MOCK_API_H
+#define AUDIO_MOCK_API_H
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/*----------- Local include files --------------------------------------------*/
+
+#include "hwatypes.h"
+#include "hwaplatformcomp.h"
+
+extern HWA_ComponentHandle HWMockGpoHandle;
+extern HWA_ComponentHandle HWMockSGTL5000Handle;
+
+#define HWA_MOCK_MAX_RECORDS 4096
+
+typedef enum
+{
+	MOCK_OP_INIT = 0,
+	MOCK_OP_ENABLE,
+	MOCK_OP_DISABLE,
+	MOCK_OP_VOLUME,
+	MOCK_OP_MUTE,
+	MOCK_OP_POWER,
+	MOCK_OP_MAX
+} HWA_MockOp;
+
+typedef struct
+{
+	HWA_Component component;
+	HWA_MockOp op;
+	unsigned char path;
+	int value;			/* volume, mute, reinit or power mode */
+	long long timestamp;		/* CLOCK_MONOTONIC ns */
+} HWA_MockRecord;
+
+void HWAMock_Reset(void);
+int HWAMock_GetRecords(const HWA_MockRecord **records);
+int HWAMock_Count(HWA_MockOp op);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* AUDIO_MOCK_API_H */
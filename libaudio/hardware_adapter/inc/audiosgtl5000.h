@@ -68,6 +68,26 @@ typedef enum
 	CHIP_MAX_NUMID
 }SGTL5000_REGISTER;
 
+/* CHIP_DIG_POWER bits */
+#define DIG_POWER_ADC_POWERUP		(1 << 6)
+#define DIG_POWER_DAC_POWERUP		(1 << 5)
+#define DIG_POWER_DAP_POWERUP		(1 << 4)
+#define DIG_POWER_I2S_OUT_POWERUP	(1 << 1)
+#define DIG_POWER_I2S_IN_POWERUP	(1 << 0)
+#define DIG_POWER_GATEABLE		(DIG_POWER_ADC_POWERUP | DIG_POWER_DAC_POWERUP | DIG_POWER_DAP_POWERUP | \
+					 DIG_POWER_I2S_OUT_POWERUP | DIG_POWER_I2S_IN_POWERUP)
+
+/* CHIP_ANA_POWER bits */
+#define ANA_POWER_VAG_POWERUP		(1 << 7)
+#define ANA_POWER_HEADPHONE_POWERUP	(1 << 4)
+#define ANA_POWER_DAC_POWERUP		(1 << 3)
+#define ANA_POWER_CAPLESS_HP_POWERUP	(1 << 2)
+#define ANA_POWER_ADC_POWERUP		(1 << 1)
+#define ANA_POWER_LINEOUT_POWERUP	(1 << 0)
+/* Blocks gated in standby, references and clocks stay up for a fast wake */
+#define ANA_POWER_GATEABLE		(ANA_POWER_HEADPHONE_POWERUP | ANA_POWER_DAC_POWERUP | \
+					 ANA_POWER_CAPLESS_HP_POWERUP | ANA_POWER_ADC_POWERUP | ANA_POWER_LINEOUT_POWERUP)
+
 typedef struct
 {
    const char *function_name;
@@ -41,8 +41,15 @@ extern "C"{
 /*----------- Global constant definitions ------------------------------------*/
 #define HWA_INDEX_MODULE_OFF 0x0FFL
 
+/* Seconds an amplifier stays powered after its path is disabled, 0 turns it
+ * off immediately */
+#define HWA_AMP_HOLDOFF_PROPERTY "audio.amp_holdoff"
+#define HWA_AMP_HOLDOFF_DEFAULT  "3"
+
 /*----------- Global API function definition ---------------------------------*/
 HWA_ReturnCode HWA_Init(void);
+HWA_ReturnCode HWA_InitAsync(void);
+HWA_ReturnCode HWA_WaitReady(void);
 HWA_ReturnCode HWA_Reset(void);
 HWA_ReturnCode HWA_Deinit(void);
 HWA_ReturnCode HWA_AudioDeviceEnable(HWA_AudioDevice device, HWA_AudioRoute route, HWA_AudioVolume volume);
@@ -51,6 +58,12 @@ HWA_RouteSupported HWA_AudioRouteSupported(HWA_AudioDevice device, HWA_AudioRout
 HWA_ReturnCode HWA_AudioDeviceVolumeSet(HWA_AudioDevice device, HWA_AudioRoute route, HWA_AudioVolume volume);
 HWA_ReturnCode HWA_AudioDeviceMute(HWA_AudioDevice device, HWA_AudioRoute route, HWA_AudioMute mute);
 HWA_ReturnCode HWA_SetPowerMode(HWA_Component component, HWA_PowerMode mode);
+HWA_ReturnCode HWA_Begin(void);
+HWA_ReturnCode HWA_Commit(void);
+
+/* One shot timer per component, the callback runs on the HWA timer thread */
+HWA_ReturnCode HWA_TimerArm(HWA_Component component, UINT32 delayMs, HWATimerCallback_t callback);
+HWA_ReturnCode HWA_TimerCancel(HWA_Component component);
 
 #ifdef __cplusplus
 }
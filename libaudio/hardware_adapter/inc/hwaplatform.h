@@ -37,6 +37,11 @@ extern "C"{
 //Null component
 #include "audionullapi.h"
 
+//Recording component for off-target builds
+#ifdef HWA_MOCK_COMPONENTS
+#include "audiomockapi.h"
+#endif
+
 /*----------- Global defines -------------------------------------------------*/
 
 
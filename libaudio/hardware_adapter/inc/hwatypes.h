@@ -47,6 +47,7 @@ typedef enum
     HWA_RC_INVALID_VOLUME_CHANGE,
     HWA_RC_DEVICE_ROUTE_NOT_FOUND,
     HWA_RC_INVALID_COMPONENT_INDEX,
+    HWA_RC_NO_TRANSACTION,
 
     HWA_RC_ENUM_32_BIT = 0x7FFFFFFF //32bit enum compiling enforcement
 } HWA_ReturnCode;
@@ -168,6 +169,7 @@ typedef    HWA_DigitalGain (*HWAMutePath_t)       (unsigned char path, HWA_Audio
 typedef    short (*HWAGetPathsStatus_t) (char* data, short length);
 typedef    HWA_AnalogGain (*HWAGetPathAnalogGain_t)    (unsigned char path);
 typedef    HWA_ReturnCode (*HWASetPowerMode_t)     (HWA_PowerMode mode);
+typedef    void            (*HWATimerCallback_t)   (void);
 
 
 typedef struct
@@ -199,6 +201,9 @@ typedef struct
     HWA_DigitalGain         deviceDigitalGain;
     HWA_AnalogGain          deviceAnalogGain;
     HWA_AudioVolume         deviceVolume;
+    HWA_DeviceEnableDisable pendingEnableDisable; /* requested state inside HWA_Begin/HWA_Commit */
+    HWA_AudioVolume         pendingVolume;
+    HWA_AudioMute           pendingMute;
 }HWA_DeviceRouteConfig;
 /*----------- Extern definition ----------------------------------------------*/
 
@@ -16,15 +16,22 @@
 *
 * Last Updated:
 *
-* Notes:
+* Notes: Only boards whose device table routes paths through GPO_COMPONENT
+*        reach the nodes below. The ASTER table switches its amplifiers
+*        through the SGTL5000 power functions instead.
 ******************************************************************************/
 
 #include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <sys/select.h>
 #include <sys/time.h>
 #include <pthread.h>
+#include <time.h>
+#include <cutils/properties.h>
 #include "hwa.h"
 #include "audiogpoapi.h"
 #include "audiogpo.h"
@@ -44,10 +51,30 @@ static short GPOGetPathsStatus(char* data, short length);
 static HWA_AnalogGain GPOGetPathAnalogGain(unsigned char path);
 static HWA_ReturnCode GPOSetPowerMode(HWA_PowerMode mode);
 //GPIO SET AND GET
-static int GPOSet(const char *gpio_name, char value);
-static char GPOGetSpeaker(const char *gpio_name);
+static int GPOOpen(GPO_NODE_ID id);
+static void GPOClose(GPO_NODE_ID id);
+static int GPOSet(GPO_NODE_ID id, char value);
+static char GPOGet(GPO_NODE_ID id);
 //IOCtl function
-static void GPOIOCtlHandle(const char *device_name, int cmd ,int val);
+static void GPOIOCtlHandle(GPO_NODE_ID id, int cmd ,int val);
+//Amplifier power policy
+static long long GPONowMs(void);
+static void GPOAmpOn(GPO_NODE_ID id);
+static void GPOAmpOff(GPO_NODE_ID id);
+static long long GPOAmpOffNext(void);
+static void GPOAmpOffTimeout(void);
+
+static GPO_CONTEXT gpoContext =
+{
+    {
+        {AUDIO_PA_EN,   -1, 0, FALSE, 0},
+        {EAR_POP,       -1, 0, FALSE, 0},
+        {HP_AMP_SD,     -1, 0, FALSE, 0},
+        {FM2010,        -1, 0, FALSE, 0},
+    },
+    PTHREAD_MUTEX_INITIALIZER,
+    0
+};
 
 HWA_ComponentHandle HWGpoHandle  =
 {
@@ -63,27 +90,25 @@ HWA_ComponentHandle HWGpoHandle  =
 
 void GPOInit(unsigned char reinit)
 {
-	int fd = -1;
+	int id;
+	char holdoff[PROPERTY_VALUE_MAX];
 
-	if(reinit == 0)
-	{
-		fd = open (AUDIO_PA_EN, O_RDONLY);
-		if (fd == (-1))
-        	{
-			LOGE("GPOInit: can not open %s", AUDIO_PA_EN);
-            		return;
-        	}
-        	close(fd);
+	property_get(HWA_AMP_HOLDOFF_PROPERTY, holdoff, HWA_AMP_HOLDOFF_DEFAULT);
+	gpoContext.holdOffMs = (unsigned int)atoi(holdoff) * 1000;
 
-		fd = open (EAR_POP, O_RDONLY);
-		if (fd == (-1))
-        	{
-			LOGE("GPOInit: can not open %s", EAR_POP);
-            		return;
-        	}
-        	close(fd);
+	/* Keep the nodes open for the life of the component, a reinit only
+	 * retries the ones which failed before */
+	for (id = 0; id < GPO_NODE_MAX; id++)
+	{
+		if (gpoContext.node[id].fd < 0)
+		{
+			GPOOpen((GPO_NODE_ID)id);
+		}
+	}
 
-        	LOGI("GPOInit: GPO init is successful!");
+	if(reinit == 0)
+	{
+        	LOGI("GPOInit: GPO init is successful, amp hold-off %u ms", gpoContext.holdOffMs);
 	}
 } /* End of GPOInit */
 
@@ -95,31 +120,31 @@ static HWA_DigitalGain GPOPathEnable(unsigned char path, HWA_AudioVolume volume)
 	{
 		case GPO_EXT_HEADSET_AMP_CTRL:
             	{
-                	GPOSet(HP_AMP_SD, GPIO_ON);
+                	GPOAmpOn(GPO_NODE_HP_AMP_SD);
             	}
 		break;
 
 		case GPO_EXT_HEADSET_EAR_POP_CTRL:
             	{
-                	GPOSet(EAR_POP, GPIO_ON);
+                	GPOSet(GPO_NODE_EAR_POP, GPIO_ON);
             	}
 		break;
 
 		case GPO_EXT_SPEAKER_AMP_CTRL:
             	{
-                	GPOSet(AUDIO_PA_EN, GPIO_ON);
+                	GPOAmpOn(GPO_NODE_AUDIO_PA_EN);
             	}
 		break;
 
         	case GPO_EXT_AEC_POWER_CTRL:
             	{
-                	GPOIOCtlHandle(FM2010, AEC_IOC_SLEEP, AEC_WAKE_UP);
+                	GPOIOCtlHandle(GPO_NODE_FM2010, AEC_IOC_SLEEP, AEC_WAKE_UP);
             	}
             	break;
 
         	case GPO_EXT_AEC_MODE_CTRL:
             	{
-                	GPOIOCtlHandle(FM2010, AEC_IOC_SET_MODE, volume);
+                	GPOIOCtlHandle(GPO_NODE_FM2010, AEC_IOC_SET_MODE, volume);
             	}
             	break;
 
@@ -138,25 +163,25 @@ static HWA_DigitalGain GPOPathDisable(unsigned char path)
 	{
 		case GPO_EXT_HEADSET_AMP_CTRL:
         	{
-                	GPOSet(HP_AMP_SD, GPIO_OFF);
+                	GPOAmpOff(GPO_NODE_HP_AMP_SD);
             	}
 		break;
 
 		case GPO_EXT_HEADSET_EAR_POP_CTRL:
             	{
-                	GPOSet(EAR_POP, GPIO_OFF);
+                	GPOSet(GPO_NODE_EAR_POP, GPIO_OFF);
             	}
 		break;
 
 		case GPO_EXT_SPEAKER_AMP_CTRL:
             	{
-                	GPOSet(AUDIO_PA_EN, GPIO_OFF);
+                	GPOAmpOff(GPO_NODE_AUDIO_PA_EN);
             	}
 		break;
 
         	case GPO_EXT_AEC_POWER_CTRL:
             	{
-                	GPOIOCtlHandle(FM2010, AEC_IOC_SLEEP, AEC_SLEEP);
+                	GPOIOCtlHandle(GPO_NODE_FM2010, AEC_IOC_SLEEP, AEC_SLEEP);
             	}
             	break;
 
@@ -195,10 +220,68 @@ static HWA_AnalogGain GPOGetPathAnalogGain(unsigned char path)
 
 static HWA_ReturnCode GPOSetPowerMode(HWA_PowerMode mode)
 {
-    return 0;
+	int id;
+
+	/* Standby keeps the amp hold-off, only power off flushes it */
+	if (mode != HWA_POWER_OFF)
+	{
+		return HWA_RC_OK;
+	}
+
+	pthread_mutex_lock(&gpoContext.lock);
+
+	HWA_TimerCancel(GPO_COMPONENT);
+	for (id = 0; id < GPO_NODE_MAX; id++)
+	{
+		if (gpoContext.node[id].offPending)
+		{
+			gpoContext.node[id].offPending = FALSE;
+			GPOSet((GPO_NODE_ID)id, GPIO_OFF);
+		}
+	}
+
+	pthread_mutex_unlock(&gpoContext.lock);
+
+	return HWA_RC_OK;
 } /* End of GPOSetPowerMode*/
 
 
+/************************************************
+ *Open gpo node
+ ************************************************
+ * Opens the node into the component context.
+ * return the fd, negative for fail.
+ ************************************************/
+static int GPOOpen(GPO_NODE_ID id)
+{
+    GPO_NODE *node = &gpoContext.node[id];
+
+    node->fd = open(node->name, O_RDWR);
+    if (node->fd < 0)
+    {
+        LOGE("GPOOpen: Can't open %s, errno: %d", node->name, errno);
+    }
+
+    return node->fd;
+}
+
+/************************************************
+ *Close gpo node
+ ************************************************
+ * Drops a node which failed, the next access
+ * opens it again.
+ ************************************************/
+static void GPOClose(GPO_NODE_ID id)
+{
+    GPO_NODE *node = &gpoContext.node[id];
+
+    if (node->fd >= 0)
+    {
+        close(node->fd);
+        node->fd = -1;
+    }
+}
+
 // This function is to set gpio
 
 /************************************************
@@ -208,24 +291,31 @@ static HWA_ReturnCode GPOSetPowerMode(HWA_PowerMode mode)
  * char '0' is disable.
  * return 0 for ok else for fail.
  ************************************************/
-static int GPOSet(const char *gpio_name, char value)
+static int GPOSet(GPO_NODE_ID id, char value)
 {
-    int gpio_fd = -1;
+    GPO_NODE *node = &gpoContext.node[id];
+
+    if ((node->fd >= 0) && (pwrite(node->fd, &value, sizeof(char), 0) == sizeof(char)))
+    {
+        node->value = value;
+        return 0;
+    }
 
-    if ((gpio_fd = open(gpio_name, O_RDWR)) < 0)
+    /* Stale or never opened, retry once on a fresh fd */
+    GPOClose(id);
+    if (GPOOpen(id) < 0)
     {
-        LOGE("GPOSet: Can't open %s, gpio_fd: %d", gpio_name, gpio_fd);
         return -1;
     }
 
-    if ((write(gpio_fd, &value, sizeof(char))) < 0)
+    if (pwrite(node->fd, &value, sizeof(char), 0) != sizeof(char))
     {
-        LOGE("GPOSet: Can't write %s", gpio_name);
+        LOGE("GPOSet: Can't write %s, errno: %d", node->name, errno);
+        GPOClose(id);
         return -1; 
     }
 
-    close(gpio_fd);
-
+    node->value = value;
     return 0;
 }
 
@@ -236,25 +326,29 @@ static int GPOSet(const char *gpio_name, char value)
  * return '0' is disable status.
  * return else for fail.
  ************************************************/
-static char GPOGet(const char *gpio_name)
+static char GPOGet(GPO_NODE_ID id)
 {
     char value;
-    int gpio_fd = -1;
+    GPO_NODE *node = &gpoContext.node[id];
 
-    if ((gpio_fd = open(gpio_name, O_RDWR)) < 0)
+    if ((node->fd >= 0) && (pread(node->fd, &value, sizeof(char), 0) == sizeof(char)))
+    {
+        return value;
+    }
+
+    GPOClose(id);
+    if (GPOOpen(id) < 0)
     {
-        LOGE("GPOGet: Can't open %s, gpio_fd: %d", gpio_name, gpio_fd);
         return -1;
     }
 
-    if ((read(gpio_fd, &value, sizeof(char))) < 0)
+    if (pread(node->fd, &value, sizeof(char), 0) != sizeof(char))
     {
-        LOGE("GPOGet: Can't read %s", gpio_name);
+        LOGE("GPOGet: Can't read %s, errno: %d", node->name, errno);
+        GPOClose(id);
         return -1; 
     }
 
-    close(gpio_fd);
-
     return value;
 }
 
@@ -263,27 +357,166 @@ static char GPOGet(const char *gpio_name)
  ************************************************
  * cmd: set IOCtl command
  * val: set IOCrl value
- * return true for ok, false for fail.
+ * A failed ioctl drops the fd so the next call
+ * reopens the device.
  ************************************************/
-static void GPOIOCtlHandle(const char *device_name, int cmd, int val)
+static void GPOIOCtlHandle(GPO_NODE_ID id, int cmd, int val)
 { 
-    int device_fd = -1;
+    GPO_NODE *node = &gpoContext.node[id];
     int err;
 
-    device_fd = open(device_name, O_RDWR);
-    if (device_fd < 0)
-	{
-		LOGE("GPOIOCtlHandle: Open %s fail, device_fd: %d", device_name, device_fd);
+    if ((node->fd < 0) && (GPOOpen(id) < 0))
+    {
         return;
-	}
+    }
 	
-    err = ioctl(device_fd, cmd, val);
-	if (err < 0)
+    err = ioctl(node->fd, cmd, val);
+    if (err < 0)
     {
-        LOGE("GPOIOCtlHandle: Can't do ioctl, err = %d", err);   
-        close(device_fd);      
+        LOGE("GPOIOCtlHandle: Can't do ioctl on %s, errno = %d", node->name, errno);   
+        GPOClose(id);
+    }
+}
+
+/************************************************
+ *Monotonic time
+ ************************************************
+ * return CLOCK_MONOTONIC in ms.
+ ************************************************/
+static long long GPONowMs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/************************************************
+ *Amplifier on
+ ************************************************
+ * Cancels a pending delayed power down, the
+ * gpio is only written when the amp is off.
+ ************************************************/
+static void GPOAmpOn(GPO_NODE_ID id)
+{
+    GPO_NODE *node = &gpoContext.node[id];
+
+    pthread_mutex_lock(&gpoContext.lock);
+
+    node->offPending = FALSE;
+    if (node->value != GPIO_ON)
+    {
+        GPOSet(id, GPIO_ON);
+    }
+
+    pthread_mutex_unlock(&gpoContext.lock);
+}
+
+/************************************************
+ *Amplifier off
+ ************************************************
+ * Keeps the amp powered for holdOffMs so short
+ * sounds do not toggle it, GPOAmpOffTimeout
+ * powers it down. The timer is shared by all
+ * amps and always runs to the earliest deadline.
+ ************************************************/
+static void GPOAmpOff(GPO_NODE_ID id)
+{
+    GPO_NODE *node = &gpoContext.node[id];
+    long long now, next;
+
+    pthread_mutex_lock(&gpoContext.lock);
+
+    if (gpoContext.holdOffMs == 0)
+    {
+        node->offPending = FALSE;
+        GPOSet(id, GPIO_OFF);
+        pthread_mutex_unlock(&gpoContext.lock);
         return;
     }
 
-    close(device_fd);
+    now = GPONowMs();
+    if (!node->offPending)
+    {
+        node->offPending = TRUE;
+        node->offDeadline = now + gpoContext.holdOffMs;
+    }
+
+    next = GPOAmpOffNext();
+    if (HWA_TimerArm(GPO_COMPONENT, (next > now) ? (UINT32)(next - now) : 0, GPOAmpOffTimeout) != HWA_RC_OK)
+    {
+        node->offPending = FALSE;
+        GPOSet(id, GPIO_OFF);
+    }
+
+    pthread_mutex_unlock(&gpoContext.lock);
+}
+
+/************************************************
+ *Next delayed power down
+ ************************************************
+ * return the earliest deadline of the pending
+ * amps, 0 if none is pending.
+ ************************************************/
+static long long GPOAmpOffNext(void)
+{
+    long long next = 0;
+    int id;
+
+    for (id = 0; id < GPO_NODE_MAX; id++)
+    {
+        GPO_NODE *node = &gpoContext.node[id];
+
+        if (node->offPending && ((next == 0) || (node->offDeadline < next)))
+        {
+            next = node->offDeadline;
+        }
+    }
+
+    return next;
+}
+
+/************************************************
+ *Delayed power down
+ ************************************************
+ * Runs on the HWA timer thread. Powers down the
+ * amps whose hold-off elapsed and re-arms the
+ * timer for the ones still pending.
+ ************************************************/
+static void GPOAmpOffTimeout(void)
+{
+    long long now, next;
+    int id;
+
+    pthread_mutex_lock(&gpoContext.lock);
+
+    now = GPONowMs();
+    for (id = 0; id < GPO_NODE_MAX; id++)
+    {
+        GPO_NODE *node = &gpoContext.node[id];
+        char value = node->value;
+
+        if (!node->offPending || (node->offDeadline > now))
+            continue;
+
+        LOGI("GPOAmpOffTimeout: power down %s", node->name);
+        if (GPOSet((GPO_NODE_ID)id, GPIO_OFF) < 0)
+        {
+            /* still powered as far as we know, retry after another hold-off */
+            node->value = value;
+            node->offDeadline = now + gpoContext.holdOffMs;
+        }
+        else
+        {
+            node->offPending = FALSE;
+        }
+    }
+
+    next = GPOAmpOffNext();
+    if (next != 0)
+    {
+        HWA_TimerArm(GPO_COMPONENT, (next > now) ? (UINT32)(next - now) : 0, GPOAmpOffTimeout);
+    }
+
+    pthread_mutex_unlock(&gpoContext.lock);
 }
@@ -0,0 +1,109 @@
+/* Copyright © 2010, Letou Tech Co., Ltd. All rights reserved.
+   Letou Tech Co., Ltd. Confidential Proprietary
+   Contains confidential proprietary information of Letou Tech Co., Ltd.
+   Reverse engineering is prohibited.
+   The copyright notice does not imply publication. */
+/******************************************************************************
+* Title: audioMock
+*
+* Filename: audiomock.c
+*
+* Target, platform: Host, SW platform
+*
+* Authors:
+*
+* Description: Recording component. Every call HWA makes into a component is
+*              appended with a timestamp to a fixed size log, nothing touches
+*              hardware.
+*
+* Last Updated:
+*
+* Notes:
+******************************************************************************/
+#include <string.h>
+#include <time.h>
+#include "hwa.h"
+#include "audiomockapi.h"
+
+/*----------- Local definitions ------------------------------------*/
+static HWA_MockRecord mockRecords[HWA_MOCK_MAX_RECORDS];
+static int mockRecordCount = 0;
+
+static void MockRecord(HWA_Component component, HWA_MockOp op, unsigned char path, int value)
+{
+	struct timespec ts;
+	HWA_MockRecord *record;
+
+	if (mockRecordCount >= HWA_MOCK_MAX_RECORDS)
+	{
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	record = &mockRecords[mockRecordCount++];
+	record->component = component;
+	record->op = op;
+	record->path = path;
+	record->value = value;
+	record->timestamp = (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* One set of handle functions per mocked component */
+#define MOCK_COMPONENT(name, component) \
+static void name##Init(unsigned char reinit) \
+{ MockRecord(component, MOCK_OP_INIT, 0, reinit); } \
+static HWA_DigitalGain name##PathEnable(unsigned char path, HWA_AudioVolume volume) \
+{ MockRecord(component, MOCK_OP_ENABLE, path, volume); return 0; } \
+static HWA_DigitalGain name##PathDisable(unsigned char path) \
+{ MockRecord(component, MOCK_OP_DISABLE, path, 0); return 0; } \
+static HWA_DigitalGain name##PathVolumeSet(unsigned char path, HWA_AudioVolume volume) \
+{ MockRecord(component, MOCK_OP_VOLUME, path, volume); return 0; } \
+static HWA_DigitalGain name##PathMute(unsigned char path, HWA_AudioMute mute) \
+{ MockRecord(component, MOCK_OP_MUTE, path, mute); return 0; } \
+static short name##GetPathsStatus(char* data, short length) \
+{ return 0; } \
+static HWA_AnalogGain name##GetPathAnalogGain(unsigned char path) \
+{ return 0; } \
+static HWA_ReturnCode name##SetPowerMode(HWA_PowerMode mode) \
+{ MockRecord(component, MOCK_OP_POWER, 0, mode); return HWA_RC_OK; } \
+HWA_ComponentHandle HW##name##Handle = \
+{ \
+    name##Init, \
+    name##PathEnable, \
+    name##PathDisable, \
+    name##PathVolumeSet, \
+    name##PathMute, \
+    name##GetPathsStatus, \
+    name##GetPathAnalogGain, \
+    name##SetPowerMode \
+};
+
+MOCK_COMPONENT(MockGpo, GPO_COMPONENT)
+MOCK_COMPONENT(MockSGTL5000, SGTL5000_COMPONENT)
+
+void HWAMock_Reset(void)
+{
+	mockRecordCount = 0;
+}
+
+int HWAMock_GetRecords(const HWA_MockRecord **records)
+{
+	*records = mockRecords;
+	return mockRecordCount;
+}
+
+int HWAMock_Count(HWA_MockOp op)
+{
+	int i, count = 0;
+
+	for (i = 0; i < mockRecordCount; i++)
+	{
+		if (mockRecords[i].op == op)
+		{
+			count++;
+		}
+	}
+
+	return count;
+}
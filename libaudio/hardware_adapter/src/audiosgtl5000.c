@@ -25,6 +25,9 @@
 #include <sys/select.h>
 #include <sys/time.h>
 #include <pthread.h>
+#include <time.h>
+#include <stdlib.h>
+#include <cutils/properties.h>
 #include <asoundlib.h>
 
 #include "hwa.h"
@@ -48,6 +51,19 @@ static char sgtl5000_ctl[64] = "default";
 
 static SGTL5000_REGISTER_DESCRIPTION calibration_register_description[CHIP_MAX_NUMID + 1];
 
+static HWA_PowerMode sgtl5000_power_mode = HWA_POWER_AWAKE;
+static unsigned int sgtl5000_active_paths = 0;		/* bit per SGTL5000Paths */
+static unsigned short sgtl5000_saved_ana_power = 0;	/* power registers before entering standby/off */
+static unsigned short sgtl5000_saved_dig_power = 0;
+
+/* Amplifier power down hold-off, see HWA_AMP_HOLDOFF_PROPERTY */
+#define SGTL5000_AMP_PATHS	((1 << SGTL5000_LOUDSPEAKER_AMP) | (1 << SGTL5000_HEADSET_AMP) | (1 << SGTL5000_HEADPHONE_AMP))
+static pthread_mutex_t sgtl5000_amp_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int sgtl5000_amp_holdoff_ms = 0;
+static unsigned int sgtl5000_amps_on = 0;		/* bit per *_AMP path whose amp is powered */
+static unsigned int sgtl5000_amps_off_pending = 0;	/* bit per *_AMP path with a delayed power down */
+static long long sgtl5000_amp_off_deadline[SGTL5000_PATH_MAX_ID];	/* CLOCK_MONOTONIC ms */
+
 static SGTL5000_REGISTER_DESCRIPTION default_register_description[CHIP_MAX_NUMID + 1] = {
         {CHIP_DIG_POWER,	-1},
         {CHIP_CLK_CTRL,		-1},
@@ -122,6 +138,13 @@ static int SGTL5000ReadRegisters(unsigned short sgtl5000RegNumid, unsigned short
 static void SGTL5000ReadCalibrationFile(void);
 static void SGTL5000ReadDefaultConfigParameters(void);
 static void SGTL5000ReadConfigParameters(FILE *sgtl5000_config_fd);
+static void SGTL5000RequiredPower(unsigned short *ana_power, unsigned short *dig_power);
+//Amplifier power policy
+static long long SGTL5000NowMs(void);
+static int SGTL5000AmpOn(unsigned char path);
+static int SGTL5000AmpOff(unsigned char path);
+static long long SGTL5000AmpOffNext(void);
+static void SGTL5000AmpOffTimeout(void);
 
 HWA_ComponentHandle HWSGTL5000Handle  =
 {
@@ -137,12 +160,24 @@ HWA_ComponentHandle HWSGTL5000Handle  =
 
 void SGTL5000Init(unsigned char reinit)
 {
+	char holdoff[PROPERTY_VALUE_MAX];
+
+	property_get(HWA_AMP_HOLDOFF_PROPERTY, holdoff, HWA_AMP_HOLDOFF_DEFAULT);
+
+	pthread_mutex_lock(&sgtl5000_amp_lock);
+	sgtl5000_amp_holdoff_ms = (unsigned int)atoi(holdoff) * 1000;
+	HWA_TimerCancel(SGTL5000_COMPONENT);
+	sgtl5000_amps_off_pending = 0;
+	sgtl5000_amps_on = 0;
+	pthread_mutex_unlock(&sgtl5000_amp_lock);
+
 	SGTL5000SetFunction(&sgtl5000_funcs_off[SGTL5000_LOUDSPEAKER]);
 	SGTL5000SetFunction(&sgtl5000_funcs_off[SGTL5000_HEADSET]);
 	SGTL5000SetFunction(&sgtl5000_funcs_off[SGTL5000_PAD_EXTERNAL_MIC]);
 	SGTL5000SetFunction(&sgtl5000_funcs_off[SGTL5000_PAD_EXTERNAL_MIC_SWITCH]);
+	sgtl5000_active_paths = 0;
 	SGTL5000ReadCalibrationFile();
-	HWA_SGTL5000_LOG("SGTL5000Init:init is successful!");
+	HWA_SGTL5000_LOG("SGTL5000Init:init is successful, amp hold-off %u ms", sgtl5000_amp_holdoff_ms);
 } /* End of SGTL5000Init */
 
 static HWA_DigitalGain SGTL5000PathEnable(unsigned char path, HWA_AudioVolume volume)
@@ -154,8 +189,25 @@ static HWA_DigitalGain SGTL5000PathEnable(unsigned char path, HWA_AudioVolume vo
 		return -1;
 	}
 
-        if(SGTL5000SetFunction(&sgtl5000_funcs_on[path]) < 0)
+	sgtl5000_active_paths |= (1 << path);
+
+	/* Enabling a path while gated wakes the codec first */
+	if (sgtl5000_power_mode != HWA_POWER_AWAKE)
+	{
+		SGTL5000SetPowerMode(HWA_POWER_AWAKE);
+	}
+
+	if (SGTL5000_AMP_PATHS & (1 << path))
+	{
+		if (SGTL5000AmpOn(path) < 0)
+		{
+			sgtl5000_active_paths &= ~(1 << path);
+			return -1;
+		}
+	}
+        else if(SGTL5000SetFunction(&sgtl5000_funcs_on[path]) < 0)
 	{
+		sgtl5000_active_paths &= ~(1 << path);
 		return -1;
 	}
 	
@@ -171,6 +223,13 @@ static HWA_DigitalGain SGTL5000PathDisable(unsigned char path)
                 return -1;
         }
 
+	sgtl5000_active_paths &= ~(1 << path);
+
+	if (SGTL5000_AMP_PATHS & (1 << path))
+	{
+		return (SGTL5000AmpOff(path) < 0) ? -1 : 0;
+	}
+
         if(SGTL5000SetFunction(&sgtl5000_funcs_off[path]) < 0)
 	{
 		return -1;
@@ -202,11 +261,281 @@ static HWA_AnalogGain SGTL5000GetPathAnalogGain(unsigned char path)
 	return 0;
 } /* End of SGTL5000GetPathAnalogGain */
 
+/*
+ * HWA_POWER_AWAKE:  blocks of the enabled paths are powered.
+ * HWA_POWER_ASLEEP: DAC/ADC/output drivers not used by an enabled path are
+ *                   gated, VAG, references and PLL stay up so waking is a
+ *                   single write per register.
+ * HWA_POWER_OFF:    all gateable blocks and VAG are powered down.
+ */
 static HWA_ReturnCode SGTL5000SetPowerMode(HWA_PowerMode mode)
 {
-    	return 0;
+	unsigned short ana_power, dig_power;
+	unsigned short need_ana, need_dig;
+	int path;
+
+	/* Power off does not wait for the amp hold-off */
+	if (mode == HWA_POWER_OFF)
+	{
+		pthread_mutex_lock(&sgtl5000_amp_lock);
+		HWA_TimerCancel(SGTL5000_COMPONENT);
+		for (path = 0; path < SGTL5000_PATH_MAX_ID; path++)
+		{
+			if ((sgtl5000_amps_off_pending & (1 << path)) &&
+			    (SGTL5000SetFunction(&sgtl5000_funcs_off[path]) >= 0))
+			{
+				sgtl5000_amps_on &= ~(1 << path);
+			}
+		}
+		sgtl5000_amps_off_pending = 0;
+		pthread_mutex_unlock(&sgtl5000_amp_lock);
+	}
+
+	if (mode == sgtl5000_power_mode)
+	{
+		return HWA_RC_OK;
+	}
+
+	HWA_SGTL5000_LOG("SGTL5000SetPowerMode: %d -> %d, active paths 0x%x", sgtl5000_power_mode, mode, sgtl5000_active_paths);
+
+	SGTL5000RequiredPower(&need_ana, &need_dig);
+
+	if (mode == HWA_POWER_AWAKE)
+	{
+		/* Fast wake: no register read, power the blocks the paths enabled
+		 * now need, paths disabled while gated stay down */
+		ana_power = (sgtl5000_saved_ana_power & ~ANA_POWER_GATEABLE) | need_ana;
+		dig_power = (sgtl5000_saved_dig_power & ~DIG_POWER_GATEABLE) | need_dig;
+	}
+	else
+	{
+		if (sgtl5000_power_mode == HWA_POWER_AWAKE)
+		{
+			if ((SGTL5000ReadRegisters(CHIP_ANA_POWER, &sgtl5000_saved_ana_power) < 0) ||
+			    (SGTL5000ReadRegisters(CHIP_DIG_POWER, &sgtl5000_saved_dig_power) < 0))
+			{
+				return HWA_RC_ERROR;
+			}
+		}
+
+		if (mode == HWA_POWER_OFF)
+		{
+			ana_power = sgtl5000_saved_ana_power & ~(ANA_POWER_GATEABLE | ANA_POWER_VAG_POWERUP);
+			dig_power = sgtl5000_saved_dig_power & ~DIG_POWER_GATEABLE;
+		}
+		else
+		{
+			ana_power = sgtl5000_saved_ana_power & ~(ANA_POWER_GATEABLE & ~need_ana);
+			dig_power = sgtl5000_saved_dig_power & ~(DIG_POWER_GATEABLE & ~need_dig);
+		}
+	}
+
+	/* Digital blocks stop before and start after the analog ones */
+	if (mode == HWA_POWER_AWAKE)
+	{
+		if ((SGTL5000WriteRegisters(CHIP_ANA_POWER, ana_power) < 0) ||
+		    (SGTL5000WriteRegisters(CHIP_DIG_POWER, dig_power) < 0))
+		{
+			return HWA_RC_ERROR;
+		}
+	}
+	else
+	{
+		if ((SGTL5000WriteRegisters(CHIP_DIG_POWER, dig_power) < 0) ||
+		    (SGTL5000WriteRegisters(CHIP_ANA_POWER, ana_power) < 0))
+		{
+			return HWA_RC_ERROR;
+		}
+	}
+
+	sgtl5000_power_mode = mode;
+
+    	return HWA_RC_OK;
 } /* End of SGTL5000SetPowerMode*/
 
+static void SGTL5000RequiredPower(unsigned short *ana_power, unsigned short *dig_power)
+{
+	const unsigned int lineout_paths = (1 << SGTL5000_LOUDSPEAKER) | (1 << SGTL5000_LOUDSPEAKER_AMP);
+	const unsigned int hp_paths = (1 << SGTL5000_HEADSET) | (1 << SGTL5000_HEADSET_AMP) |
+				      (1 << SGTL5000_HEADPHONE) | (1 << SGTL5000_HEADPHONE_AMP);
+	const unsigned int mic_paths = (1 << SGTL5000_PAD_INTERNAL_MIC) | (1 << SGTL5000_PAD_INTERNAL_MIC_BIAS) |
+				       (1 << SGTL5000_PAD_INTERNAL_MIC_GAIN) | (1 << SGTL5000_PAD_EXTERNAL_MIC) |
+				       (1 << SGTL5000_PAD_EXTERNAL_MIC_BIAS) | (1 << SGTL5000_PAD_EXTERNAL_MIC_GAIN);
+
+	*ana_power = 0;
+	*dig_power = 0;
+
+	if (sgtl5000_active_paths & (lineout_paths | hp_paths))
+	{
+		*ana_power |= ANA_POWER_DAC_POWERUP;
+		*dig_power |= DIG_POWER_DAC_POWERUP | DIG_POWER_DAP_POWERUP | DIG_POWER_I2S_IN_POWERUP;
+	}
+
+	if (sgtl5000_active_paths & lineout_paths)
+	{
+		*ana_power |= ANA_POWER_LINEOUT_POWERUP;
+	}
+
+	if (sgtl5000_active_paths & hp_paths)
+	{
+		*ana_power |= ANA_POWER_HEADPHONE_POWERUP | ANA_POWER_CAPLESS_HP_POWERUP;
+	}
+
+	if (sgtl5000_active_paths & mic_paths)
+	{
+		*ana_power |= ANA_POWER_ADC_POWERUP;
+		*dig_power |= DIG_POWER_ADC_POWERUP | DIG_POWER_DAP_POWERUP | DIG_POWER_I2S_OUT_POWERUP;
+	}
+}
+
+/************************************************
+ *Monotonic time
+ ************************************************
+ * return CLOCK_MONOTONIC in ms.
+ ************************************************/
+static long long SGTL5000NowMs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/************************************************
+ *Amplifier on
+ ************************************************
+ * Cancels a pending delayed power down, the
+ * control is only written when the amp is off.
+ ************************************************/
+static int SGTL5000AmpOn(unsigned char path)
+{
+	int err = 0;
+
+	pthread_mutex_lock(&sgtl5000_amp_lock);
+
+	sgtl5000_amps_off_pending &= ~(1 << path);
+	if (!(sgtl5000_amps_on & (1 << path)))
+	{
+		err = SGTL5000SetFunction(&sgtl5000_funcs_on[path]);
+		if (err >= 0)
+		{
+			sgtl5000_amps_on |= (1 << path);
+		}
+	}
+
+	pthread_mutex_unlock(&sgtl5000_amp_lock);
+	return err;
+}
+
+/************************************************
+ *Amplifier off
+ ************************************************
+ * Keeps the amp powered for the hold-off so
+ * short sounds do not toggle it,
+ * SGTL5000AmpOffTimeout powers it down. The
+ * timer is shared by all amps and always runs
+ * to the earliest deadline.
+ ************************************************/
+static int SGTL5000AmpOff(unsigned char path)
+{
+	long long now, next;
+	int err = 0;
+
+	pthread_mutex_lock(&sgtl5000_amp_lock);
+
+	if ((sgtl5000_amp_holdoff_ms != 0) && (sgtl5000_amps_on & (1 << path)))
+	{
+		now = SGTL5000NowMs();
+		if (!(sgtl5000_amps_off_pending & (1 << path)))
+		{
+			sgtl5000_amps_off_pending |= (1 << path);
+			sgtl5000_amp_off_deadline[path] = now + sgtl5000_amp_holdoff_ms;
+		}
+
+		next = SGTL5000AmpOffNext();
+		if (HWA_TimerArm(SGTL5000_COMPONENT, (next > now) ? (UINT32)(next - now) : 0, SGTL5000AmpOffTimeout) == HWA_RC_OK)
+		{
+			pthread_mutex_unlock(&sgtl5000_amp_lock);
+			return 0;
+		}
+	}
+
+	sgtl5000_amps_off_pending &= ~(1 << path);
+	err = SGTL5000SetFunction(&sgtl5000_funcs_off[path]);
+	if (err >= 0)
+	{
+		sgtl5000_amps_on &= ~(1 << path);
+	}
+
+	pthread_mutex_unlock(&sgtl5000_amp_lock);
+	return err;
+}
+
+/************************************************
+ *Next delayed power down
+ ************************************************
+ * return the earliest deadline of the pending
+ * amps, 0 if none is pending.
+ ************************************************/
+static long long SGTL5000AmpOffNext(void)
+{
+	long long next = 0;
+	int path;
+
+	for (path = 0; path < SGTL5000_PATH_MAX_ID; path++)
+	{
+		if ((sgtl5000_amps_off_pending & (1 << path)) &&
+		    ((next == 0) || (sgtl5000_amp_off_deadline[path] < next)))
+		{
+			next = sgtl5000_amp_off_deadline[path];
+		}
+	}
+
+	return next;
+}
+
+/************************************************
+ *Delayed power down
+ ************************************************
+ * Runs on the HWA timer thread. Powers down the
+ * amps whose hold-off elapsed and re-arms the
+ * timer for the ones still pending.
+ ************************************************/
+static void SGTL5000AmpOffTimeout(void)
+{
+	long long now, next;
+	int path;
+
+	pthread_mutex_lock(&sgtl5000_amp_lock);
+
+	now = SGTL5000NowMs();
+	for (path = 0; path < SGTL5000_PATH_MAX_ID; path++)
+	{
+		if (!(sgtl5000_amps_off_pending & (1 << path)) || (sgtl5000_amp_off_deadline[path] > now))
+			continue;
+
+		HWA_SGTL5000_LOG("SGTL5000AmpOffTimeout: power down path %d", path);
+		if (SGTL5000SetFunction(&sgtl5000_funcs_off[path]) < 0)
+		{
+			/* still powered, retry after another hold-off */
+			sgtl5000_amp_off_deadline[path] = now + sgtl5000_amp_holdoff_ms;
+		}
+		else
+		{
+			sgtl5000_amps_off_pending &= ~(1 << path);
+			sgtl5000_amps_on &= ~(1 << path);
+		}
+	}
+
+	next = SGTL5000AmpOffNext();
+	if (next != 0)
+	{
+		HWA_TimerArm(SGTL5000_COMPONENT, (next > now) ? (UINT32)(next - now) : 0, SGTL5000AmpOffTimeout);
+	}
+
+	pthread_mutex_unlock(&sgtl5000_amp_lock);
+}
+
 static int SGTL5000SetFunction(SGTL5000_FUNCTION *func)
 {
 	int err, i, items;
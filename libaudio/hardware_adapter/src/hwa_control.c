@@ -20,25 +20,73 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
 
 #include "hwa.h"
 #include "hwaplatform.h"
 #include "hwa_config.h"
 
+#define LOG_TAG "HWA"
+#include <utils/Log.h>
+
 /*----------- Local macro definitions ----------------------------------------*/
 #define MASK8(a)	((unsigned char)((a) & 0x000000FF))
 
+/* Row filters for HWAFindPathUser */
+#define HWA_PATH_ANY_ROW        0
+#define HWA_PATH_ENABLED_ROW    1
+#define HWA_PATH_PENDING_ROW    2
+
 /*----------- Local type definitions -----------------------------------------*/
+typedef enum
+{
+    HWA_INIT_IDLE = 0,
+    HWA_INIT_RUNNING,
+    HWA_INIT_DONE
+} HWA_InitState;
+
+typedef struct
+{
+    HWA_Component   component;
+    unsigned char   reinit;
+} HWA_ComponentInitJob;
+typedef struct
+{
+    int                 fd;
+    HWATimerCallback_t  callback;
+} HWA_ComponentTimer;
 
 /*----------- Local variable definitions -------------------------------------*/
 static HWA_DeviceRouteConfig* _deviceRouteConfigTable;
 static HWA_DeviceRoute*       _deviceRouteTable;
 static UINT32                 _deviceRouteTableSize;
+static UINT32                 _transactionDepth;
+static HWA_ComponentTimer     _componentTimers[NULL_COMPONENT];
+static pthread_mutex_t        _timerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t              _timerThread;
+static int                    _timerWakeFd[2] = {-1, -1};
+static BOOL                   _timerRunning = FALSE;
+static pthread_mutex_t        _initLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t         _initCond = PTHREAD_COND_INITIALIZER;
+static volatile int           _initState = HWA_INIT_IDLE;
+static HWA_ReturnCode         _initResult = HWA_RC_OK;
+static pthread_t              _initThread;
+static pthread_mutex_t        _tableLock;
+static pthread_once_t         _tableLockOnce = PTHREAD_ONCE_INIT;
 const HWA_ComponentHandle*    componentHandles[] =
 {
+#ifdef HWA_MOCK_COMPONENTS
+    &HWMockGpoHandle,// Gpo component, recorded
+    &HWMockSGTL5000Handle,// SGTL5000 component, recorded
+#else
     &HWGpoHandle,// Gpo component
     &HWSGTL5000Handle,// SGTL5000 component
+#endif
     &HWNullHandle, // NULLHW
 };
 
@@ -59,6 +107,409 @@ static void HWABspGetBoardTables(void)
     _deviceRouteTableSize = sizeof(deviceTable_Borad)/sizeof(HWA_DeviceRoute);
 }
 
+/*******************************************************************************
+* Function: HWATimerThread
+*******************************************************************************
+* Description: Waits on the component timerfds and runs the callback of the
+*               component whose timer expired.
+*
+* Parameters: void *arg - unused
+*
+* Return value: void*
+*
+* Notes: HWATimerStop wakes the thread through _timerWakeFd.
+*******************************************************************************/
+static void* HWATimerThread(void *arg)
+{
+    struct pollfd      fds[NULL_COMPONENT + 1];
+    HWATimerCallback_t callback;
+    uint64_t           expirations;
+    int                i;
+
+    for (i = 0; i < NULL_COMPONENT; i++)
+    {
+        fds[i].fd = _componentTimers[i].fd;
+        fds[i].events = POLLIN;
+    }
+    fds[NULL_COMPONENT].fd = _timerWakeFd[0];
+    fds[NULL_COMPONENT].events = POLLIN;
+
+    for (;;)
+    {
+        if (poll(fds, NULL_COMPONENT + 1, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            LOGE("HWATimerThread: poll error %d", errno);
+            break;
+        }
+
+        if (fds[NULL_COMPONENT].revents)
+            break;
+
+        for (i = 0; i < NULL_COMPONENT; i++)
+        {
+            if (!(fds[i].revents & POLLIN))
+                continue;
+
+            if (read(fds[i].fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+                continue;
+
+            pthread_mutex_lock(&_timerLock);
+            callback = _componentTimers[i].callback;
+            pthread_mutex_unlock(&_timerLock);
+
+            if (callback != NULL)
+                callback();
+        }
+    }
+
+    return NULL;
+}
+
+/*******************************************************************************
+* Function: HWATimerStart
+*******************************************************************************
+* Description: Creates one timerfd per component and the thread serving them.
+*
+* Parameters: none
+*
+* Return value: HWA_ReturnCode
+*
+* Notes:
+*******************************************************************************/
+static HWA_ReturnCode HWATimerStart(void)
+{
+    int i;
+
+    if (_timerRunning)
+        return HWA_RC_OK;
+
+    if (pipe(_timerWakeFd) < 0)
+    {
+        LOGE("HWATimerStart: pipe error %d", errno);
+        return HWA_RC_ERROR;
+    }
+
+    for (i = 0; i < NULL_COMPONENT; i++)
+    {
+        _componentTimers[i].fd = timerfd_create(CLOCK_MONOTONIC, 0);
+        _componentTimers[i].callback = NULL;
+        if (_componentTimers[i].fd < 0)
+            LOGE("HWATimerStart: timerfd_create error %d for component %d", errno, i);
+    }
+
+    if (pthread_create(&_timerThread, NULL, HWATimerThread, NULL) != 0)
+    {
+        LOGE("HWATimerStart: can not create timer thread");
+        for (i = 0; i < NULL_COMPONENT; i++)
+        {
+            if (_componentTimers[i].fd >= 0)
+                close(_componentTimers[i].fd);
+            _componentTimers[i].fd = -1;
+        }
+        close(_timerWakeFd[0]);
+        close(_timerWakeFd[1]);
+        _timerWakeFd[0] = _timerWakeFd[1] = -1;
+        return HWA_RC_ERROR;
+    }
+
+    _timerRunning = TRUE;
+    return HWA_RC_OK;
+}
+
+/*******************************************************************************
+* Function: HWATimerStop
+*******************************************************************************
+* Description: Stops the timer thread and releases the component timerfds.
+*               Pending timers are dropped.
+*
+* Parameters: none
+*
+* Return value: void
+*
+* Notes:
+*******************************************************************************/
+static void HWATimerStop(void)
+{
+    char wake = 0;
+    int  i;
+
+    if (!_timerRunning)
+        return;
+
+    write(_timerWakeFd[1], &wake, sizeof(wake));
+    pthread_join(_timerThread, NULL);
+
+    for (i = 0; i < NULL_COMPONENT; i++)
+    {
+        if (_componentTimers[i].fd >= 0)
+            close(_componentTimers[i].fd);
+        _componentTimers[i].fd = -1;
+        _componentTimers[i].callback = NULL;
+    }
+    close(_timerWakeFd[0]);
+    close(_timerWakeFd[1]);
+    _timerWakeFd[0] = _timerWakeFd[1] = -1;
+    _timerRunning = FALSE;
+}
+
+/*******************************************************************************
+* Function: HWAComponentInitThread
+*******************************************************************************
+* Description: Runs the init of one component.
+*
+* Parameters: void *arg - HWA_ComponentInitJob*
+*
+* Return value: void*
+*
+* Notes:
+*******************************************************************************/
+static void* HWAComponentInitThread(void *arg)
+{
+    HWA_ComponentInitJob *job = (HWA_ComponentInitJob *)arg;
+
+    componentHandles[job->component]->HWAComponentInit(job->reinit);
+    return NULL;
+}
+
+/*******************************************************************************
+* Function: HWAInitComponents
+*******************************************************************************
+* Description: Initializes every component used by the device table once.
+*               Components do not share state, so each one is initialized on
+*               its own thread and the calling thread waits for all of them.
+*
+* Parameters: unsigned char reinit
+*
+* Return value: void
+*
+* Notes: Falls back to initializing inline if a thread can not be created.
+*******************************************************************************/
+static void HWAInitComponents(unsigned char reinit)
+{
+    HWA_DeviceRouteConfig *pDeviceRouteConfig;
+    HWA_ComponentInitJob   jobs[NULL_COMPONENT];
+    pthread_t              threads[NULL_COMPONENT];
+    BOOL                   threadStarted[NULL_COMPONENT];
+    BOOL                   initLocalComponent[NULL_COMPONENT];
+    int                    i;
+
+    /* Reset the component init flag array */
+    memset(initLocalComponent, FALSE, (NULL_COMPONENT * sizeof(BOOL)));
+    memset(threadStarted, FALSE, (NULL_COMPONENT * sizeof(BOOL)));
+
+    pDeviceRouteConfig = _deviceRouteConfigTable;
+    while ( (pDeviceRouteConfig->deviceRoute.component != NULL_COMPONENT) )
+    {
+        i = pDeviceRouteConfig->deviceRoute.component;
+        if(initLocalComponent[i] == FALSE )
+        {
+            jobs[i].component = (HWA_Component)i;
+            jobs[i].reinit = reinit;
+            if (pthread_create(&threads[i], NULL, HWAComponentInitThread, &jobs[i]) == 0)
+            {
+                threadStarted[i] = TRUE;
+            }
+            else
+            {
+                HWAComponentInitThread(&jobs[i]);
+            }
+            initLocalComponent[i] = TRUE;
+        }
+        pDeviceRouteConfig++;
+    }
+
+    for (i = 0; i < NULL_COMPONENT; i++)
+    {
+        if (threadStarted[i])
+            pthread_join(threads[i], NULL);
+    }
+}
+
+/*******************************************************************************
+* Function: HWAInitThread
+*******************************************************************************
+* Description: Body of HWA_InitAsync, releases the readiness latch when done.
+*
+* Parameters: void *arg - unused
+*
+* Return value: void*
+*
+* Notes:
+*******************************************************************************/
+static void* HWAInitThread(void *arg)
+{
+    HWA_ReturnCode result = HWA_Init();
+
+    pthread_mutex_lock(&_initLock);
+    _initResult = result;
+    _initState = HWA_INIT_DONE;
+    pthread_cond_broadcast(&_initCond);
+    pthread_mutex_unlock(&_initLock);
+
+    return NULL;
+}
+
+/*******************************************************************************
+* Function: HWATableLockInit
+*******************************************************************************
+* Description: Creates the device table lock. The lock is recursive because
+*               HWA_AudioDeviceEnable calls HWA_AudioDeviceVolumeSet and an
+*               open transaction holds it from HWA_Begin to HWA_Commit.
+*
+* Parameters: none
+*
+* Return value: void
+*
+* Notes:
+*******************************************************************************/
+static void HWATableLockInit(void)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&_tableLock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+/*******************************************************************************
+* Function: HWATableLock, HWATableUnlock
+*******************************************************************************
+* Description: Serializes access to the device table and the transaction
+*               state.
+*
+* Parameters: none
+*
+* Return value: void
+*
+* Notes:
+*******************************************************************************/
+static void HWATableLock(void)
+{
+    pthread_once(&_tableLockOnce, HWATableLockInit);
+    pthread_mutex_lock(&_tableLock);
+}
+
+static void HWATableUnlock(void)
+{
+    pthread_mutex_unlock(&_tableLock);
+}
+
+/*******************************************************************************
+* Function: HWAEndTransactions
+*******************************************************************************
+* Description: Drops any open transaction without applying it and releases
+*               the lock counts HWA_Begin took for it.
+*
+* Parameters: none
+*
+* Return value: void
+*
+* Notes: Called with the table lock held.
+*******************************************************************************/
+static void HWAEndTransactions(void)
+{
+    while (_transactionDepth > 0)
+    {
+        _transactionDepth--;
+        HWATableUnlock();
+    }
+}
+
+/*******************************************************************************
+* Function: HWAFindPathUser
+*******************************************************************************
+* Description: Finds the first table row sharing the component path of path_p.
+*
+* Parameters: const HWA_DeviceRouteConfig *path_p
+*             int filter - HWA_PATH_ANY_ROW, HWA_PATH_ENABLED_ROW (currently
+*                          enabled rows) or HWA_PATH_PENDING_ROW (rows
+*                          requested enabled in the open transaction)
+*
+* Return value: HWA_DeviceRouteConfig*, NULL if no row matches
+*
+* Notes:
+*******************************************************************************/
+static HWA_DeviceRouteConfig* HWAFindPathUser(const HWA_DeviceRouteConfig *path_p, int filter)
+{
+    HWA_DeviceRouteConfig *handle_p = _deviceRouteConfigTable;
+
+    while (handle_p->deviceRoute.device != HWA_NOT_CONNECTED)
+    {
+        if ( (handle_p->deviceRoute.component == path_p->deviceRoute.component) &&
+             (handle_p->deviceRoute.path == path_p->deviceRoute.path) )
+        {
+            if ( (filter == HWA_PATH_ANY_ROW) ||
+                 ((filter == HWA_PATH_ENABLED_ROW) && (handle_p->deviceEnableDisable == HWA_DEVICE_ENABLE)) ||
+                 ((filter == HWA_PATH_PENDING_ROW) && (handle_p->pendingEnableDisable == HWA_DEVICE_ENABLE)) )
+            {
+                return handle_p;
+            }
+        }
+        handle_p++;
+    }
+
+    return NULL;
+}
+
+/*******************************************************************************
+* Function: HWAQueueDeviceState
+*******************************************************************************
+* Description: Records the requested state of the device/route pair inside an
+*               open transaction. Nothing reaches the components until
+*               HWA_Commit.
+*
+* Parameters: HWA_AudioDevice device
+*             HWA_AudioRoute route
+*             HWA_DeviceEnableDisable state
+*             HWA_AudioVolume volume
+*
+* Return value: HWA_ReturnCode
+*
+* Notes:
+*******************************************************************************/
+static HWA_ReturnCode HWAQueueDeviceState(HWA_AudioDevice device,
+                                          HWA_AudioRoute route,
+                                          HWA_DeviceEnableDisable state,
+                                          HWA_AudioVolume volume)
+{
+    HWA_DeviceRouteConfig *handle_p;
+    HWA_ReturnCode acmReturnCode = HWA_RC_DEVICE_ROUTE_NOT_FOUND;
+
+    handle_p = _deviceRouteConfigTable;
+
+    while (handle_p->deviceRoute.device != HWA_NOT_CONNECTED)
+    {
+        if ( (handle_p->deviceRoute.device == device) && (handle_p->deviceRoute.route == route) )
+        {
+            if (handle_p->pendingEnableDisable != state)
+            {
+                acmReturnCode = HWA_RC_OK;
+            }
+            else if (acmReturnCode != HWA_RC_OK)
+            {
+                acmReturnCode = (state == HWA_DEVICE_ENABLE) ? HWA_RC_DEVICE_ALREADY_ENABLED : HWA_RC_DEVICE_ALREADY_DISABLED;
+            }
+
+            if (state == HWA_DEVICE_ENABLE)
+            {
+                handle_p->pendingVolume = volume;
+            }
+            else if (handle_p->pendingEnableDisable == HWA_DEVICE_ENABLE)
+            {
+                handle_p->pendingMute = HWA_MUTE_OFF;  /* Mark it as un-muted */
+            }
+            handle_p->pendingEnableDisable = state;
+        }
+        handle_p++;
+    }
+
+    return acmReturnCode;
+} /* End of HWAQueueDeviceState */
+
 /*******************************************************************************
 * Function: HWA_Init
 *******************************************************************************
@@ -74,11 +525,13 @@ HWA_ReturnCode HWA_Init(void)
 {
     HWA_DeviceRouteConfig *pDeviceRouteConfig;
     HWA_DeviceRoute       *pDeviceRoute;
-    BOOL                   initLocalComponent[NULL_COMPONENT];
 
     //get specific board device mapping default tables
     HWABspGetBoardTables();
 
+    //components may arm their timer from HWAComponentInit
+    HWATimerStart();
+
     if (_deviceRouteTableSize == 0)
     {
         return HWA_RC_INIT_FAILED;
@@ -95,24 +548,15 @@ HWA_ReturnCode HWA_Init(void)
         pDeviceRouteConfig->deviceDigitalGain   = 0;
         pDeviceRouteConfig->deviceAnalogGain    = 0;
         pDeviceRouteConfig->deviceVolume        = 0;
+        pDeviceRouteConfig->pendingEnableDisable = HWA_DEVICE_DISABLE;
+        pDeviceRouteConfig->pendingVolume        = 0;
+        pDeviceRouteConfig->pendingMute          = HWA_MUTE_OFF;
         pDeviceRouteConfig++;
         pDeviceRoute++;
     }
     memcpy(pDeviceRouteConfig, pDeviceRoute, sizeof(HWA_DeviceRoute)); //For HWA_NOT_CONNECT
 
-    /* Reset the component init flag array */
-    memset(initLocalComponent, FALSE, (NULL_COMPONENT * sizeof(BOOL)));
-
-    pDeviceRouteConfig = _deviceRouteConfigTable;
-    while ( (pDeviceRouteConfig->deviceRoute.component != NULL_COMPONENT) )
-    {
-        if(initLocalComponent[pDeviceRouteConfig->deviceRoute.component] == FALSE )
-        {
-            componentHandles[pDeviceRouteConfig->deviceRoute.component]->HWAComponentInit(FALSE);
-            initLocalComponent[pDeviceRouteConfig->deviceRoute.component] = TRUE;
-        }
-        pDeviceRouteConfig++;
-    }
+    HWAInitComponents(FALSE);
     return HWA_RC_OK;
 } /* End of HWAInit */
 
@@ -131,12 +575,14 @@ HWA_ReturnCode HWA_Reset(void)
 {
     HWA_DeviceRouteConfig *pDeviceRouteConfig;
     HWA_DeviceRoute       *pDeviceRoute;
-    BOOL                   initLocalComponent[NULL_COMPONENT];
 
     if (_deviceRouteTableSize == 0)
     {
         return HWA_RC_RESET_FAILED;
     }
+
+    HWATableLock();
+    HWAEndTransactions();
     
     pDeviceRoute = _deviceRouteTable;
     pDeviceRouteConfig = _deviceRouteConfigTable;
@@ -149,24 +595,16 @@ HWA_ReturnCode HWA_Reset(void)
         pDeviceRouteConfig->deviceDigitalGain   = 0;
         pDeviceRouteConfig->deviceAnalogGain    = 0;
         pDeviceRouteConfig->deviceVolume        = 0;
+        pDeviceRouteConfig->pendingEnableDisable = HWA_DEVICE_DISABLE;
+        pDeviceRouteConfig->pendingVolume        = 0;
+        pDeviceRouteConfig->pendingMute          = HWA_MUTE_OFF;
         pDeviceRouteConfig++;
         pDeviceRoute++;
     }
     memcpy(pDeviceRouteConfig, pDeviceRoute, sizeof(HWA_DeviceRoute));
 
-    /* Reset the component init flag array */
-    memset(initLocalComponent, FALSE, (NULL_COMPONENT * sizeof(BOOL)));
-
-    pDeviceRouteConfig = _deviceRouteConfigTable;
-    while ( (pDeviceRouteConfig->deviceRoute.component != NULL_COMPONENT) )
-    {
-        if(initLocalComponent[pDeviceRouteConfig->deviceRoute.component] == FALSE )
-        {
-            componentHandles[pDeviceRouteConfig->deviceRoute.component]->HWAComponentInit(TRUE);
-            initLocalComponent[pDeviceRouteConfig->deviceRoute.component] = TRUE;
-        }
-        pDeviceRouteConfig++;
-    }
+    HWAInitComponents(TRUE);
+    HWATableUnlock();
     return HWA_RC_OK;
 } /* End of HWAInit */
 
@@ -183,7 +621,15 @@ HWA_ReturnCode HWA_Reset(void)
 *******************************************************************************/
 HWA_ReturnCode HWA_Deinit(void)
 {
+    HWATimerStop();
+    HWATableLock();
+    HWAEndTransactions();
     free(_deviceRouteConfigTable);
+    pthread_mutex_lock(&_initLock);
+    _initState = HWA_INIT_IDLE;
+    pthread_mutex_unlock(&_initLock);
+    _deviceRouteConfigTable = NULL;
+    HWATableUnlock();
     return HWA_RC_OK;
 }
 
@@ -210,6 +656,14 @@ HWA_ReturnCode HWA_AudioDeviceEnable(HWA_AudioDevice device,
     HWA_ReturnCode acmReturnCode = HWA_RC_DEVICE_ROUTE_NOT_FOUND;
     HWA_AnalogGain acmCumAnalogGain = 0;
 
+    HWATableLock();
+    if (_transactionDepth > 0)
+    {
+        acmReturnCode = HWAQueueDeviceState(device, route, HWA_DEVICE_ENABLE, volume);
+        HWATableUnlock();
+        return acmReturnCode;
+    }
+
     handle_p = _deviceRouteConfigTable;
 
     while (handle_p->deviceRoute.device != HWA_NOT_CONNECTED)
@@ -243,6 +697,7 @@ HWA_ReturnCode HWA_AudioDeviceEnable(HWA_AudioDevice device,
         handle_p++;
     }
 
+    HWATableUnlock();
     return acmReturnCode;
 } /* End of HWAAudioDeviceEnable */
 
@@ -264,6 +719,14 @@ HWA_ReturnCode HWA_AudioDeviceDisable(HWA_AudioDevice device,
     HWA_DeviceRouteConfig *handle_p, *handlePending_p;
     HWA_ReturnCode acmReturnCode = HWA_RC_DEVICE_ROUTE_NOT_FOUND;
 
+    HWATableLock();
+    if (_transactionDepth > 0)
+    {
+        acmReturnCode = HWAQueueDeviceState(device, route, HWA_DEVICE_DISABLE, 0);
+        HWATableUnlock();
+        return acmReturnCode;
+    }
+
     handle_p = _deviceRouteConfigTable;
 
     while (handle_p->deviceRoute.device != HWA_NOT_CONNECTED)
@@ -305,6 +768,7 @@ HWA_ReturnCode HWA_AudioDeviceDisable(HWA_AudioDevice device,
         handle_p++;
     }
 
+    HWATableUnlock();
     return acmReturnCode;
 } /* End of HWAAudioDeviceDisable */
 
@@ -329,13 +793,19 @@ HWA_ReturnCode HWA_AudioDeviceVolumeSet(HWA_AudioDevice device,
     HWA_ReturnCode  acmReturnCode = HWA_RC_DEVICE_ROUTE_NOT_FOUND;
     HWA_AnalogGain  acmCumAnalogGain = 0;
 
+    HWATableLock();
     handle_p = _deviceRouteConfigTable;
 
     while (handle_p->deviceRoute.device != HWA_NOT_CONNECTED)
     {
         if ( (handle_p->deviceRoute.device == device) && (handle_p->deviceRoute.route == route) )  /* path for this channel */
         {
-           if(handle_p->deviceVolume != volume)
+           if (_transactionDepth > 0)
+           {  /* applied by HWA_Commit */
+                acmReturnCode = HWA_RC_OK;
+                handle_p->pendingVolume = volume;
+           }
+           else if(handle_p->deviceVolume != volume)
            {
                 acmReturnCode = HWA_RC_OK;
                 handle_p->deviceVolume = volume;
@@ -357,6 +827,7 @@ HWA_ReturnCode HWA_AudioDeviceVolumeSet(HWA_AudioDevice device,
         handle_p++;
     }
 
+    HWATableUnlock();
     return acmReturnCode;
 } /* HWAAudioDeviceVolumeSet */
 
@@ -386,6 +857,7 @@ HWA_ReturnCode HWA_AudioDeviceMute(HWA_AudioDevice device,
     HWA_DeviceRouteConfig   *handle_p;
     HWA_ReturnCode          acmReturnCode = HWA_RC_DEVICE_ROUTE_NOT_FOUND;
 
+    HWATableLock();
     handle_p = _deviceRouteConfigTable;
 
     /* Mutes all the paths associated with this channel */
@@ -394,7 +866,17 @@ HWA_ReturnCode HWA_AudioDeviceMute(HWA_AudioDevice device,
     {
         if  ((handle_p->deviceRoute.device == device) && (handle_p->deviceRoute.route == route))
         {
-            if(handle_p->deviceMute != mute)
+            if (_transactionDepth > 0)
+            {  /* applied by HWA_Commit */
+                if (handle_p->pendingMute != mute)
+                {
+                    acmReturnCode = HWA_RC_OK;
+                    handle_p->pendingMute = mute;
+                }
+                else if( acmReturnCode != HWA_RC_OK )
+                    acmReturnCode = HWA_RC_NO_MUTE_CHANGE_NEEDED;
+            }
+            else if(handle_p->deviceMute != mute)
             {
                 acmReturnCode = HWA_RC_OK;
              	if( handle_p->deviceEnableDisable == HWA_DEVICE_ENABLE )
@@ -412,6 +894,7 @@ HWA_ReturnCode HWA_AudioDeviceMute(HWA_AudioDevice device,
         handle_p++;
     }
 
+    HWATableUnlock();
     return acmReturnCode;
 } /* End of HWAAudioDeviceMute */
 
@@ -431,7 +914,9 @@ HWA_ReturnCode HWA_AudioDeviceMute(HWA_AudioDevice device,
 HWA_RouteSupported HWA_AudioRouteSupported(HWA_AudioDevice device, HWA_AudioRoute route)
 {
     HWA_DeviceRouteConfig  *handle_p;
+    HWA_RouteSupported     supported;
 
+    HWATableLock();
     handle_p = _deviceRouteConfigTable;
     while ( (handle_p->deviceRoute.device != HWA_NOT_CONNECTED) &&
             ((handle_p->deviceRoute.device != device) || (handle_p->deviceRoute.route != route)) )
@@ -440,9 +925,12 @@ HWA_RouteSupported HWA_AudioRouteSupported(HWA_AudioDevice device, HWA_AudioRout
     }
 
     if(handle_p->deviceRoute.device != HWA_NOT_CONNECTED)
-        return HWA_ROUTE_SUPPORTED;
+        supported = HWA_ROUTE_SUPPORTED;
     else
-        return HWA_ROUTE_NOT_SUPPORTED;
+        supported = HWA_ROUTE_NOT_SUPPORTED;
+    HWATableUnlock();
+
+    return supported;
 } /* End of HWA_AudioRouteSupported */
 
 /*******************************************************************************
@@ -458,8 +946,311 @@ HWA_RouteSupported HWA_AudioRouteSupported(HWA_AudioDevice device, HWA_AudioRout
 *******************************************************************************/
 HWA_ReturnCode HWA_SetPowerMode(HWA_Component component, HWA_PowerMode mode)
 {
+    HWA_ReturnCode acmReturnCode;
+
     if (component >= NULL_COMPONENT )
         return HWA_RC_INVALID_COMPONENT_INDEX;
-    else
-        return componentHandles[component]->HWASetPowerMode(mode);
+
+    /* Components read their path state, which HWA_Commit may be changing */
+    HWATableLock();
+    acmReturnCode = componentHandles[component]->HWASetPowerMode(mode);
+    HWATableUnlock();
+
+    return acmReturnCode;
 }
+
+/*******************************************************************************
+* Function: HWA_Begin
+*******************************************************************************
+* Description: Opens a routing transaction. HWA_AudioDeviceEnable and
+*               HWA_AudioDeviceDisable, HWA_AudioDeviceVolumeSet and
+*               HWA_AudioDeviceMute only record the requested device state
+*               until the matching HWA_Commit. Transactions may be nested; the
+*               outermost HWA_Commit applies the changes.
+*
+* Parameters: none
+*
+* Return value: HWA_ReturnCode
+*
+* Notes: The table lock is held until the matching HWA_Commit, so calls from
+*        other threads wait for the transaction instead of joining it.
+*******************************************************************************/
+HWA_ReturnCode HWA_Begin(void)
+{
+    HWA_DeviceRouteConfig *handle_p;
+
+    HWATableLock();
+    if (_deviceRouteConfigTable == NULL)
+    {
+        HWATableUnlock();
+        return HWA_RC_ERROR;
+    }
+
+    if (_transactionDepth++ > 0)
+    {
+        return HWA_RC_OK;
+    }
+
+    handle_p = _deviceRouteConfigTable;
+    while (handle_p->deviceRoute.device != HWA_NOT_CONNECTED)
+    {
+        handle_p->pendingEnableDisable = handle_p->deviceEnableDisable;
+        handle_p->pendingVolume        = handle_p->deviceVolume;
+        handle_p->pendingMute          = handle_p->deviceMute;
+        handle_p++;
+    }
+
+    return HWA_RC_OK;
+} /* End of HWA_Begin */
+
+/*******************************************************************************
+* Function: HWA_Commit
+*******************************************************************************
+* Description: Closes a routing transaction and applies the net change of every
+*               component path in one pass. Paths that end up in the state
+*               they started in are not touched, so an off/on pair of the same
+*               path inside one transaction costs nothing. Paths are released
+*               before new ones are powered.
+*
+* Parameters: none
+*
+* Return value: HWA_ReturnCode
+*
+* Notes:
+*******************************************************************************/
+HWA_ReturnCode HWA_Commit(void)
+{
+    HWA_DeviceRouteConfig *handle_p, *user_p;
+
+    HWATableLock();
+    if (_transactionDepth == 0)
+    {
+        HWATableUnlock();
+        return HWA_RC_NO_TRANSACTION;
+    }
+
+    if (--_transactionDepth > 0)
+    {
+        HWATableUnlock();
+        HWATableUnlock();  /* taken by the matching HWA_Begin */
+        return HWA_RC_OK;
+    }
+
+    /* Pass 1: disable the paths no longer requested by any device */
+    handle_p = _deviceRouteConfigTable;
+    while (handle_p->deviceRoute.device != HWA_NOT_CONNECTED)
+    {
+        if ( (HWAFindPathUser(handle_p, HWA_PATH_ANY_ROW) == handle_p) &&
+             (HWAFindPathUser(handle_p, HWA_PATH_ENABLED_ROW) != NULL) &&
+             (HWAFindPathUser(handle_p, HWA_PATH_PENDING_ROW) == NULL) )
+        {
+            componentHandles[handle_p->deviceRoute.component]->HWADisablePath(MASK8(handle_p->deviceRoute.path));
+        }
+        handle_p++;
+    }
+
+    /* Pass 2: enable the paths which were off before the transaction */
+    handle_p = _deviceRouteConfigTable;
+    while (handle_p->deviceRoute.device != HWA_NOT_CONNECTED)
+    {
+        if ( (HWAFindPathUser(handle_p, HWA_PATH_ANY_ROW) == handle_p) &&
+             (HWAFindPathUser(handle_p, HWA_PATH_ENABLED_ROW) == NULL) &&
+             ((user_p = HWAFindPathUser(handle_p, HWA_PATH_PENDING_ROW)) != NULL) )
+        {
+            user_p->deviceDigitalGain = componentHandles[user_p->deviceRoute.component]->HWAEnablePath(MASK8(user_p->deviceRoute.path), user_p->pendingVolume);
+            user_p->deviceAnalogGain = componentHandles[user_p->deviceRoute.component]->HWAGetPathAnalogGain(MASK8(user_p->deviceRoute.path));
+            componentHandles[user_p->deviceRoute.component]->HWAMutePath(MASK8(user_p->deviceRoute.path), user_p->pendingMute);
+
+            /* user_p is up to date, pass 3 only handles the other rows */
+            user_p->deviceEnableDisable = HWA_DEVICE_ENABLE;
+            user_p->deviceVolume        = user_p->pendingVolume;
+            user_p->deviceMute          = user_p->pendingMute;
+        }
+        handle_p++;
+    }
+
+    /* Pass 3: update the device data base and apply the volume and mute of
+     * every row left enabled, as HWA_AudioDeviceEnable does per row */
+    handle_p = _deviceRouteConfigTable;
+    while (handle_p->deviceRoute.device != HWA_NOT_CONNECTED)
+    {
+        if (handle_p->pendingEnableDisable == HWA_DEVICE_ENABLE)
+        {
+            BOOL newlyEnabled = (handle_p->deviceEnableDisable != HWA_DEVICE_ENABLE);
+
+            if (newlyEnabled || (handle_p->deviceVolume != handle_p->pendingVolume))
+            {
+                handle_p->deviceDigitalGain = componentHandles[handle_p->deviceRoute.component]->HWAVolumeSetPath(MASK8(handle_p->deviceRoute.path), handle_p->pendingVolume);
+                handle_p->deviceAnalogGain = componentHandles[handle_p->deviceRoute.component]->HWAGetPathAnalogGain(MASK8(handle_p->deviceRoute.path));
+            }
+            if (newlyEnabled || (handle_p->deviceMute != handle_p->pendingMute))
+            {
+                componentHandles[handle_p->deviceRoute.component]->HWAMutePath(MASK8(handle_p->deviceRoute.path), handle_p->pendingMute);
+            }
+            handle_p->deviceEnableDisable = HWA_DEVICE_ENABLE;
+        }
+        else
+        {
+            /* HWAQueueDeviceState already un-muted the rows it disabled */
+            handle_p->deviceEnableDisable = HWA_DEVICE_DISABLE;
+        }
+        handle_p->deviceVolume = handle_p->pendingVolume;
+        handle_p->deviceMute   = handle_p->pendingMute;
+        handle_p++;
+    }
+
+    HWATableUnlock();
+    HWATableUnlock();  /* taken by the matching HWA_Begin */
+    return HWA_RC_OK;
+} /* End of HWA_Commit */
+
+/*******************************************************************************
+* Function: HWA_TimerArm
+*******************************************************************************
+* Description: Arms the one shot timer of the component. Re-arming replaces the
+*               previous expiry and callback.
+*
+* Parameters: HWA_Component component
+*             UINT32 delayMs
+*             HWATimerCallback_t callback - runs on the HWA timer thread
+*
+* Return value: HWA_ReturnCode
+*
+* Notes: The callback may still run once after HWA_TimerCancel if the timer
+*        had already expired, components must check their own state.
+*******************************************************************************/
+HWA_ReturnCode HWA_TimerArm(HWA_Component component, UINT32 delayMs, HWATimerCallback_t callback)
+{
+    struct itimerspec spec;
+
+    if (component >= NULL_COMPONENT)
+        return HWA_RC_INVALID_COMPONENT_INDEX;
+
+    if (!_timerRunning || (_componentTimers[component].fd < 0))
+        return HWA_RC_ERROR;
+
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec  = delayMs / 1000;
+    spec.it_value.tv_nsec = (delayMs % 1000) * 1000000;
+    if (delayMs == 0)
+        spec.it_value.tv_nsec = 1; /* a zero it_value disarms the timer */
+
+    pthread_mutex_lock(&_timerLock);
+    _componentTimers[component].callback = callback;
+    pthread_mutex_unlock(&_timerLock);
+
+    if (timerfd_settime(_componentTimers[component].fd, 0, &spec, NULL) < 0)
+    {
+        LOGE("HWA_TimerArm: timerfd_settime error %d", errno);
+        return HWA_RC_ERROR;
+    }
+
+    return HWA_RC_OK;
+} /* End of HWA_TimerArm */
+
+/*******************************************************************************
+* Function: HWA_TimerCancel
+*******************************************************************************
+* Description: Disarms the timer of the component.
+*
+* Parameters: HWA_Component component
+*
+* Return value: HWA_ReturnCode
+*
+* Notes:
+*******************************************************************************/
+HWA_ReturnCode HWA_TimerCancel(HWA_Component component)
+{
+    struct itimerspec spec;
+
+    if (component >= NULL_COMPONENT)
+        return HWA_RC_INVALID_COMPONENT_INDEX;
+
+    if (!_timerRunning || (_componentTimers[component].fd < 0))
+        return HWA_RC_ERROR;
+
+    memset(&spec, 0, sizeof(spec));
+    if (timerfd_settime(_componentTimers[component].fd, 0, &spec, NULL) < 0)
+        return HWA_RC_ERROR;
+
+    return HWA_RC_OK;
+} /* End of HWA_TimerCancel */
+
+/*******************************************************************************
+* Function: HWA_InitAsync
+*******************************************************************************
+* Description: Runs HWA_Init on a background thread so the caller is not held
+*               up by codec programming and calibration. Callers must go
+*               through HWA_WaitReady before using any other HWA function.
+*
+* Parameters: none
+*
+* Return value: HWA_ReturnCode
+*
+* Notes: Falls back to a synchronous HWA_Init if no thread can be created.
+*******************************************************************************/
+HWA_ReturnCode HWA_InitAsync(void)
+{
+    pthread_attr_t attr;
+    int err;
+
+    pthread_mutex_lock(&_initLock);
+    if (_initState != HWA_INIT_IDLE)
+    {
+        pthread_mutex_unlock(&_initLock);
+        return HWA_RC_OK;
+    }
+    _initState = HWA_INIT_RUNNING;
+    pthread_mutex_unlock(&_initLock);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create(&_initThread, &attr, HWAInitThread, NULL);
+    pthread_attr_destroy(&attr);
+
+    if (err != 0)
+    {
+        LOGE("HWA_InitAsync: can not create init thread, init inline");
+        HWAInitThread(NULL);
+    }
+
+    return HWA_RC_OK;
+} /* End of HWA_InitAsync */
+
+/*******************************************************************************
+* Function: HWA_WaitReady
+*******************************************************************************
+* Description: Readiness latch for HWA_InitAsync. Blocks until the background
+*               init finished, afterwards it returns at the cost of one load.
+*
+* Parameters: none
+*
+* Return value: HWA_ReturnCode - result of HWA_Init
+*
+* Notes: Returns HWA_RC_INIT_FAILED if HWA_InitAsync was never called.
+*******************************************************************************/
+HWA_ReturnCode HWA_WaitReady(void)
+{
+    HWA_ReturnCode result;
+
+    if (_initState == HWA_INIT_DONE)
+    {
+        __sync_synchronize(); /* pairs with the unlock in HWAInitThread */
+        return _initResult;
+    }
+
+    pthread_mutex_lock(&_initLock);
+    if (_initState == HWA_INIT_IDLE)
+    {
+        pthread_mutex_unlock(&_initLock);
+        return HWA_RC_INIT_FAILED;
+    }
+    while (_initState != HWA_INIT_DONE)
+    {
+        pthread_cond_wait(&_initCond, &_initLock);
+    }
+    result = _initResult;
+    pthread_mutex_unlock(&_initLock);
+
+    return result;
+} /* End of HWA_WaitReady */
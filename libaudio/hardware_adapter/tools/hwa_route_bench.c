@@ -0,0 +1,203 @@
+/* Copyright © 2010, Letou Tech Co., Ltd. All rights reserved.
+   Letou Tech Co., Ltd. Confidential Proprietary
+   Contains confidential proprietary information of Letou Tech Co., Ltd.
+   Reverse engineering is prohibited.
+   The copyright notice does not imply publication. */
+/******************************************************************************
+* Title: HWA routing benchmark
+*
+* Filename: hwa_route_bench.c
+*
+* Target, platform: Host
+*
+* Authors:
+*
+* Description: Replays the route transitions AudioHardware::updateAudioDevices
+*              issues and reports the component operations and time spent per
+*              transition. HWA is built with HWA_MOCK_COMPONENTS so every
+*              component call lands in the recording mock.
+*
+* Usage: hwa_route_bench [-n iterations] [-d] [-v]
+*           -d  issue the calls without HWA_Begin/HWA_Commit
+*           -v  print the recorded operations of each transition
+*
+* Notes: BenchSetDevices must follow AudioHardware::setModeAndDevices for
+*        MODE_NORMAL and MODE_RINGTONE.
+******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "hwa.h"
+#include "audiomockapi.h"
+
+/* Subset of the AudioSystem devices AudioHardware maps to HWA devices */
+#define BENCH_OUT_EARPIECE          0x01
+#define BENCH_OUT_SPEAKER           0x02
+#define BENCH_OUT_WIRED_HEADSET     0x04
+#define BENCH_IN_BUILTIN_MIC        0x10
+#define BENCH_IN_WIRED_HEADSET      0x20
+
+typedef struct
+{
+    const char   *name;
+    unsigned int from;
+    unsigned int to;
+} BENCH_TRANSITION;
+
+static const BENCH_TRANSITION benchTransitions[] =
+{
+    {"speaker -> headset",          BENCH_OUT_SPEAKER,                          BENCH_OUT_WIRED_HEADSET},
+    {"headset -> speaker",          BENCH_OUT_WIRED_HEADSET,                    BENCH_OUT_SPEAKER},
+    {"speaker, mic on",             BENCH_OUT_SPEAKER,                          BENCH_OUT_SPEAKER | BENCH_IN_BUILTIN_MIC},
+    {"speaker, mic off",            BENCH_OUT_SPEAKER | BENCH_IN_BUILTIN_MIC,   BENCH_OUT_SPEAKER},
+    {"headset, mic on",             BENCH_OUT_WIRED_HEADSET,                    BENCH_OUT_WIRED_HEADSET | BENCH_IN_WIRED_HEADSET},
+    {"ringtone start (headset)",    BENCH_OUT_WIRED_HEADSET,                    BENCH_OUT_WIRED_HEADSET | BENCH_OUT_SPEAKER},
+    {"ringtone end (headset)",      BENCH_OUT_WIRED_HEADSET | BENCH_OUT_SPEAKER, BENCH_OUT_WIRED_HEADSET},
+    {"earpiece -> speaker",         BENCH_OUT_EARPIECE,                         BENCH_OUT_SPEAKER},
+    {"speaker re-route",            BENCH_OUT_SPEAKER,                          BENCH_OUT_SPEAKER},
+};
+
+static int benchUseTransactions = 1;
+
+static const char *benchOpNames[MOCK_OP_MAX] =
+{
+    "init", "enable", "disable", "volume", "mute", "power"
+};
+
+static long long BenchNowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void BenchSetDevices(int on, unsigned int devices)
+{
+    if (devices == 0)
+        return;
+
+    if (benchUseTransactions)
+        HWA_Begin();
+
+    if (devices & BENCH_IN_BUILTIN_MIC)
+        on ? HWA_AudioDeviceEnable(HWA_LOUD_MIC, HWA_I2S, 100) : HWA_AudioDeviceDisable(HWA_LOUD_MIC, HWA_I2S);
+
+    if (devices & BENCH_OUT_EARPIECE)
+        on ? HWA_AudioDeviceEnable(HWA_LOUDSPEAKER, HWA_I2S, 100) : HWA_AudioDeviceDisable(HWA_LOUDSPEAKER, HWA_I2S);
+
+    if (devices & BENCH_OUT_SPEAKER)
+        on ? HWA_AudioDeviceEnable(HWA_LOUDSPEAKER, HWA_I2S, 100) : HWA_AudioDeviceDisable(HWA_LOUDSPEAKER, HWA_I2S);
+
+    if (devices & BENCH_IN_WIRED_HEADSET)
+        on ? HWA_AudioDeviceEnable(HWA_HP_MIC, HWA_I2S, 100) : HWA_AudioDeviceDisable(HWA_HP_MIC, HWA_I2S);
+
+    if (devices & BENCH_OUT_WIRED_HEADSET)
+        on ? HWA_AudioDeviceEnable(HWA_HP_SPEAKER, HWA_I2S, 100) : HWA_AudioDeviceDisable(HWA_HP_SPEAKER, HWA_I2S);
+
+    if (benchUseTransactions)
+        HWA_Commit();
+}
+
+static void BenchUpdateDevices(unsigned int from, unsigned int to)
+{
+    if (benchUseTransactions)
+        HWA_Begin();
+
+    BenchSetDevices(0, from);
+    BenchSetDevices(1, to);
+
+    if (benchUseTransactions)
+        HWA_Commit();
+}
+
+static void BenchDumpRecords(void)
+{
+    const HWA_MockRecord *records;
+    int i, count;
+
+    count = HWAMock_GetRecords(&records);
+    for (i = 0; i < count; i++)
+    {
+        printf("    +%6lld ns  component %d  %-7s path %2d value %d\n",
+               records[i].timestamp - records[0].timestamp, records[i].component,
+               benchOpNames[records[i].op], records[i].path, records[i].value);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const int transitions = sizeof(benchTransitions) / sizeof(benchTransitions[0]);
+    int iterations = 10000;
+    int verbose = 0;
+    int opt, t, i;
+
+    while ((opt = getopt(argc, argv, "n:dv")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                iterations = atoi(optarg);
+                break;
+            case 'd':
+                benchUseTransactions = 0;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n iterations] [-d] [-v]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (iterations <= 0)
+        iterations = 1;
+
+    if (HWA_Init() != HWA_RC_OK)
+    {
+        fprintf(stderr, "HWA_Init failed\n");
+        return 1;
+    }
+
+    printf("%s, %d iterations\n", benchUseTransactions ? "transactions" : "direct calls", iterations);
+    printf("%-28s %6s %7s %6s %6s %6s %10s\n", "transition", "enable", "disable", "mute", "volume", "total", "ns/trans");
+
+    for (t = 0; t < transitions; t++)
+    {
+        const BENCH_TRANSITION *transition = &benchTransitions[t];
+        long long elapsed = 0, start;
+        int ops[MOCK_OP_MAX];
+        int op;
+
+        for (i = 0; i < iterations; i++)
+        {
+            /* Start every iteration from the same routing */
+            HWA_Reset();
+            BenchUpdateDevices(0, transition->from);
+            HWAMock_Reset();
+
+            start = BenchNowNs();
+            BenchUpdateDevices(transition->from, transition->to);
+            elapsed += BenchNowNs() - start;
+        }
+
+        for (op = 0; op < MOCK_OP_MAX; op++)
+            ops[op] = HWAMock_Count((HWA_MockOp)op);
+
+        printf("%-28s %6d %7d %6d %6d %6d %10lld\n", transition->name,
+               ops[MOCK_OP_ENABLE], ops[MOCK_OP_DISABLE], ops[MOCK_OP_MUTE], ops[MOCK_OP_VOLUME],
+               ops[MOCK_OP_ENABLE] + ops[MOCK_OP_DISABLE] + ops[MOCK_OP_MUTE] + ops[MOCK_OP_VOLUME],
+               elapsed / iterations);
+
+        if (verbose)
+            BenchDumpRecords();
+    }
+
+    HWA_Deinit();
+
+    return 0;
+}
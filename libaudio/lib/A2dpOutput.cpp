@@ -0,0 +1,690 @@
+/*
+**
+** Copyright 2007, Google Inc.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <cutils/properties.h>
+
+#define LOG_TAG "A2dpOutput"
+#include <utils/Log.h>
+#include <utils/String8.h>
+#include "A2dpOutput.h"
+
+// "socket:<path>" or "file:<path>"
+#define A2DP_SINK_PROPERTY "audio.a2dp.sink"
+// largest packet the sink takes, 895 is the usual L2CAP MTU for A2DP
+#define A2DP_MTU_PROPERTY  "audio.a2dp.mtu"
+#define A2DP_DEFAULT_MTU   895
+
+// SBC high quality profile at 44.1 kHz joint/stereo tops out at 53, 18 is
+// still listenable and keeps a packet under 1/3 of the high quality size
+#define A2DP_MAX_BITPOOL   53
+#define A2DP_MIN_BITPOOL   18
+// bitpool drops this much on back-pressure and climbs by one after this
+// many packets went through without any
+#define A2DP_BITPOOL_STEP_DOWN     2
+#define A2DP_BITPOOL_RAISE_PACKETS 100
+
+#define A2DP_RING_FRAMES   4096
+#define A2DP_SBC_BLOCKS    16
+
+#define RTP_HEADER_SIZE    12
+#define RTP_PAYLOAD_TYPE   96
+#define RTP_SSRC           1
+
+// a sender more than this late starts over instead of bursting to catch up
+#define A2DP_RESYNC_NS     100000000LL
+
+namespace android {
+
+// ----------------------------------------------------------------------------
+static nsecs_t threadCpuTime()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+    return (nsecs_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+bool A2dpSender::threadLoop()
+{
+    return mStream->sendPacket();
+}
+
+// ----------------------------------------------------------------------------
+AudioStreamOutA2DP::AudioStreamOutA2DP()
+{
+    mDevices = 0;
+    mSampleRate = 44100;
+    mStandby = true;
+    mExiting = false;
+
+    mRingFrames = A2DP_RING_FRAMES;
+    mRing = new int16_t[mRingFrames * 2];
+    mRingRead = 0;
+    mRingFill = 0;
+
+    mSink = -1;
+    mSinkIsFile = false;
+    mMtu = A2DP_DEFAULT_MTU;
+    mPacket = NULL;
+    mSequence = 0;
+    mTimestamp = 0;
+
+    mStartTime = 0;
+    mFramesSent = 0;
+
+    mMinBitpool = A2DP_MIN_BITPOOL;
+    mMaxBitpool = A2DP_MAX_BITPOOL;
+    mCleanPackets = 0;
+
+    mPacketsSent = 0;
+    mPacketsDropped = 0;
+    mCongestions = 0;
+    mEncodeCpuNs = 0;
+    mEncodedFrames = 0;
+}
+
+AudioStreamOutA2DP::~AudioStreamOutA2DP()
+{
+    standby();
+
+    delete[] mRing;
+    delete[] mPacket;
+}
+
+bool AudioStreamOutA2DP::isSinkConfigured()
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get(A2DP_SINK_PROPERTY, value, "");
+
+    return !strncmp(value, "socket:", 7) || !strncmp(value, "file:", 5);
+}
+
+status_t AudioStreamOutA2DP::set(
+            uint32_t devices,
+            int *pFormat,
+            uint32_t *pChannels,
+            uint32_t *pRate)
+{
+    char value[PROPERTY_VALUE_MAX];
+    int lFormat = pFormat ? *pFormat : 0;
+    uint32_t lChannels = pChannels ? *pChannels : 0;
+    uint32_t lRate = pRate ? *pRate : 0;
+
+    LOGI("AudioStreamOutA2DP: set() devices = 0x%x , format = %d, channels = 0x%x , rate = %d",
+                                                     devices, lFormat, lChannels, lRate);
+
+    // the encoder runs stereo at 44.1 or 48 kHz, AudioFlinger mixes to that
+    if (lFormat == 0)
+    {
+        lFormat = format();
+    }
+
+    if (lChannels == 0)
+    {
+        lChannels = channels();
+    }
+
+    if (lRate == 48000)
+    {
+        mSampleRate = lRate;
+    }
+    else if (lRate == 0)
+    {
+        lRate = sampleRate();
+    }
+
+    if ((lFormat != format()) || (lChannels != channels()) || (lRate != sampleRate()))
+    {
+        if (pFormat)
+        {
+            *pFormat = format();
+        }
+
+        if (pChannels)
+        {
+            *pChannels = channels();
+        }
+
+        if (pRate)
+        {
+            *pRate = sampleRate();
+        }
+
+        return BAD_VALUE;
+    }
+
+    if (pFormat)
+    {
+        *pFormat = lFormat;
+    }
+
+    if (pChannels)
+    {
+        *pChannels = lChannels;
+    }
+
+    if (pRate)
+    {
+        *pRate = lRate;
+    }
+
+    property_get(A2DP_MTU_PROPERTY, value, "");
+    if (atoi(value) > RTP_HEADER_SIZE + 1 + 128)
+    {
+        mMtu = atoi(value);
+    }
+
+    if (mEncoder.configure(mSampleRate, 2, A2DP_SBC_BLOCKS, SbcEncoder::ALLOC_LOUDNESS, mMaxBitpool) < 0)
+    {
+        return BAD_VALUE;
+    }
+
+    delete[] mPacket;
+    mPacket = new uint8_t[mMtu];
+    mDevices = devices;
+
+    return NO_ERROR;
+}
+
+uint32_t AudioStreamOutA2DP::latency() const
+{
+    // PCM ring plus about one packet in flight
+    return (mRingFrames * 1000 / mSampleRate) + 20;
+}
+
+int AudioStreamOutA2DP::openSink()
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get(A2DP_SINK_PROPERTY, value, "");
+
+    if (!strncmp(value, "file:", 5))
+    {
+        mSinkIsFile = true;
+        mSink = open(value + 5, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    else if (!strncmp(value, "socket:", 7))
+    {
+        struct sockaddr_un addr;
+        int sndbuf = mMtu * 4;
+
+        mSinkIsFile = false;
+        mSink = socket(AF_UNIX, SOCK_DGRAM, 0);
+        if (mSink >= 0)
+        {
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, value + 7, sizeof(addr.sun_path) - 1);
+
+            // a few packets of socket buffer, like an L2CAP channel, so that a
+            // slow sink pushes back instead of queueing seconds of audio
+            setsockopt(mSink, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+            if (connect(mSink, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+            {
+                ::close(mSink);
+                mSink = -1;
+            }
+        }
+    }
+
+    if (mSink < 0)
+    {
+        LOGE("AudioStreamOutA2DP: cannot open sink \"%s\": %s", value, strerror(errno));
+        return -1;
+    }
+
+    LOGI("AudioStreamOutA2DP: sink %s, mtu %d, bitpool %d", value, mMtu, mEncoder.bitpool());
+
+    return 0;
+}
+
+void AudioStreamOutA2DP::closeSink()
+{
+    if (mSink >= 0)
+    {
+        ::close(mSink);
+        mSink = -1;
+    }
+}
+
+status_t AudioStreamOutA2DP::start_l()
+{
+    if (openSink() < 0)
+    {
+        return NO_INIT;
+    }
+
+    mRingRead = 0;
+    mRingFill = 0;
+    mExiting = false;
+    mStartTime = 0;
+    mCleanPackets = 0;
+    mEncoder.reset();
+
+    mSender = new A2dpSender(this);
+    if (mSender->run("A2dpSender", ANDROID_PRIORITY_URGENT_AUDIO) != NO_ERROR)
+    {
+        mSender.clear();
+        closeSink();
+        return NO_INIT;
+    }
+
+    mStandby = false;
+
+    return NO_ERROR;
+}
+
+ssize_t AudioStreamOutA2DP::write(const void* buffer, size_t bytes)
+{
+    AutoMutex lock(mLock);
+    const int16_t *pcm = (const int16_t *)buffer;
+    size_t frames = bytes / (2 * sizeof(int16_t));
+
+    if (mStandby && start_l() != NO_ERROR)
+    {
+        usleep(frames * 1000000LL / mSampleRate);
+        return bytes;
+    }
+
+    AutoMutex ringLock(mRingLock);
+
+    // the sender drains the ring in real time, a full ring paces the mixer
+    while (frames > 0)
+    {
+        while (mRingFill == mRingFrames && !mExiting)
+        {
+            mRingSpace.wait(mRingLock);
+        }
+
+        if (mExiting)
+        {
+            break;
+        }
+
+        size_t pos = (mRingRead + mRingFill) % mRingFrames;
+        size_t count = mRingFrames - mRingFill;
+
+        if (count > mRingFrames - pos)
+        {
+            count = mRingFrames - pos;
+        }
+        if (count > frames)
+        {
+            count = frames;
+        }
+
+        memcpy(mRing + pos * 2, pcm, count * 2 * sizeof(int16_t));
+        mRingFill += count;
+        pcm += count * 2;
+        frames -= count;
+
+        mRingData.signal();
+    }
+
+    return bytes;
+}
+
+ssize_t AudioStreamOutA2DP::sendBuffer(const uint8_t *buffer, size_t length)
+{
+    ssize_t ret;
+
+    if (mSinkIsFile)
+    {
+        ret = ::write(mSink, buffer, length);
+    }
+    else
+    {
+        ret = send(mSink, buffer, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+
+    return (ret < 0) ? -errno : ret;
+}
+
+void AudioStreamOutA2DP::adaptBitpool(bool pressure)
+{
+    unsigned int bitpool = mEncoder.bitpool();
+
+    if (pressure)
+    {
+        mCongestions++;
+        mCleanPackets = 0;
+
+        if (bitpool > mMinBitpool)
+        {
+            bitpool = (bitpool > mMinBitpool + A2DP_BITPOOL_STEP_DOWN) ? bitpool - A2DP_BITPOOL_STEP_DOWN : mMinBitpool;
+            mEncoder.setBitpool(bitpool);
+            LOGI("AudioStreamOutA2DP: sink congested, bitpool %d", bitpool);
+        }
+    }
+    else if (++mCleanPackets >= A2DP_BITPOOL_RAISE_PACKETS)
+    {
+        mCleanPackets = 0;
+
+        if (bitpool < mMaxBitpool)
+        {
+            mEncoder.setBitpool(bitpool + 1);
+        }
+    }
+}
+
+bool AudioStreamOutA2DP::sendPacket()
+{
+    int16_t pcm[SbcEncoder::MAX_BLOCKS * SbcEncoder::SUBBANDS * 2];
+    size_t codesize = mEncoder.codesize();
+    size_t frameLength = mEncoder.frameLength();
+    size_t header = mSinkIsFile ? 0 : RTP_HEADER_SIZE + 1;
+    size_t count = (mMtu - header) / frameLength;
+    size_t length = header;
+    bool pressure = false;
+
+    // the SBC payload header counts frames in 4 bits
+    if (count > 15)
+    {
+        count = 15;
+    }
+    if (count == 0)
+    {
+        count = 1;
+    }
+
+    {
+        AutoMutex lock(mRingLock);
+
+        while (mRingFill < count * codesize && !mExiting)
+        {
+            mRingData.wait(mRingLock);
+        }
+
+        if (mExiting)
+        {
+            return false;
+        }
+    }
+
+    // the filled part of the ring belongs to this thread until mRingRead moves
+    nsecs_t cpu = threadCpuTime();
+    size_t read = mRingRead;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t first = mRingFrames - read;
+
+        if (first >= codesize)
+        {
+            memcpy(pcm, mRing + read * 2, codesize * 2 * sizeof(int16_t));
+        }
+        else
+        {
+            memcpy(pcm, mRing + read * 2, first * 2 * sizeof(int16_t));
+            memcpy(pcm + first * 2, mRing, (codesize - first) * 2 * sizeof(int16_t));
+        }
+        read = (read + codesize) % mRingFrames;
+
+        length += mEncoder.encode(pcm, mPacket + length, mMtu - length);
+    }
+
+    cpu = threadCpuTime() - cpu;
+
+    {
+        AutoMutex lock(mRingLock);
+
+        mEncodeCpuNs += cpu;
+        mEncodedFrames += count * codesize;
+        mRingRead = read;
+        mRingFill -= count * codesize;
+        mRingSpace.signal();
+    }
+
+    if (!mSinkIsFile)
+    {
+        mPacket[0] = 0x80;
+        mPacket[1] = RTP_PAYLOAD_TYPE;
+        mPacket[2] = (uint8_t)(mSequence >> 8);
+        mPacket[3] = (uint8_t)mSequence;
+        mPacket[4] = (uint8_t)(mTimestamp >> 24);
+        mPacket[5] = (uint8_t)(mTimestamp >> 16);
+        mPacket[6] = (uint8_t)(mTimestamp >> 8);
+        mPacket[7] = (uint8_t)mTimestamp;
+        mPacket[8] = (uint8_t)(RTP_SSRC >> 24);
+        mPacket[9] = (uint8_t)(RTP_SSRC >> 16);
+        mPacket[10] = (uint8_t)(RTP_SSRC >> 8);
+        mPacket[11] = (uint8_t)RTP_SSRC;
+        mPacket[12] = (uint8_t)count;
+    }
+
+    // pace to real time, one packet ahead of the deadline
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    nsecs_t packetNs = (nsecs_t)(count * codesize) * 1000000000LL / mSampleRate;
+
+    if (mStartTime == 0 || now > mStartTime + (nsecs_t)(mFramesSent * 1000000000LL / mSampleRate) + A2DP_RESYNC_NS)
+    {
+        AutoMutex lock(mRingLock);
+
+        mStartTime = now;
+        mFramesSent = 0;
+    }
+
+    nsecs_t deadline = mStartTime + (nsecs_t)(mFramesSent * 1000000000LL / mSampleRate) - packetNs;
+    if (deadline > now)
+    {
+        usleep(ns2us(deadline - now));
+    }
+
+    ssize_t ret = sendBuffer(mPacket, length);
+
+    if (ret == -EAGAIN)
+    {
+        // the sink is behind: wait up to one packet for room, then drop
+        struct pollfd pfd;
+
+        pressure = true;
+        pfd.fd = mSink;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+
+        if (poll(&pfd, 1, ns2ms(packetNs)) > 0)
+        {
+            ret = sendBuffer(mPacket, length);
+        }
+    }
+
+    if (ret < 0)
+    {
+        mPacketsDropped++;
+    }
+    else
+    {
+        mPacketsSent++;
+    }
+
+    adaptBitpool(pressure);
+
+    mSequence++;
+    mTimestamp += count * codesize;
+
+    {
+        AutoMutex lock(mRingLock);
+
+        mFramesSent += count * codesize;
+    }
+
+    return true;
+}
+
+status_t AudioStreamOutA2DP::standby_l()
+{
+    if (mStandby)
+    {
+        return NO_ERROR;
+    }
+
+    {
+        AutoMutex lock(mRingLock);
+
+        mExiting = true;
+        mRingData.broadcast();
+        mRingSpace.broadcast();
+    }
+
+    mSender->requestExitAndWait();
+    mSender.clear();
+    closeSink();
+
+    mStandby = true;
+
+    LOGI("AudioStreamOutA2DP: standby, %d packets sent, %d dropped", mPacketsSent, mPacketsDropped);
+
+    return NO_ERROR;
+}
+
+status_t AudioStreamOutA2DP::standby()
+{
+    AutoMutex lock(mLock);
+
+    return standby_l();
+}
+
+status_t AudioStreamOutA2DP::setParameters(const String8& keyValuePairs)
+{
+    AudioParameter param = AudioParameter(keyValuePairs);
+    String8 key = String8(AudioParameter::keyRouting);
+    status_t status = NO_ERROR;
+    int device;
+
+    LOGI("AudioStreamOutA2DP: setParameters: %s", keyValuePairs.string());
+
+    if (param.getInt(key, device) == NO_ERROR)
+    {
+        if (device != 0)
+        {
+            mDevices = device;
+        }
+        param.remove(key);
+    }
+
+    if (param.size())
+    {
+        status = BAD_VALUE;
+    }
+
+    return status;
+}
+
+String8 AudioStreamOutA2DP::getParameters(const String8& keys)
+{
+    AudioParameter param = AudioParameter(keys);
+    String8 value;
+    String8 key = String8(AudioParameter::keyRouting);
+    char buffer[32];
+
+    if (param.get(key, value) == NO_ERROR)
+    {
+        param.addInt(key, (int)mDevices);
+    }
+
+    key = String8("a2dp_bitpool");
+    if (param.get(key, value) == NO_ERROR)
+    {
+        param.addInt(key, (int)mEncoder.bitpool());
+    }
+
+    // percent of one core spent encoding, against real time audio encoded
+    key = String8("a2dp_encode_cpu");
+    if (param.get(key, value) == NO_ERROR)
+    {
+        nsecs_t cpuNs;
+        uint64_t frames;
+
+        getEncodeStats(&cpuNs, &frames);
+
+        double audioNs = frames * 1000000000.0 / mSampleRate;
+        snprintf(buffer, sizeof(buffer), "%.2f", audioNs > 0 ? cpuNs * 100.0 / audioNs : 0.0);
+        param.add(key, String8(buffer));
+    }
+
+    LOGI("AudioStreamOutA2DP: getParameters: %s", param.toString().string());
+
+    return param.toString();
+}
+
+status_t AudioStreamOutA2DP::getRenderPosition(uint32_t *dspFrames)
+{
+    AutoMutex lock(mRingLock);
+
+    *dspFrames = (uint32_t)mFramesSent;
+    return NO_ERROR;
+}
+
+void AudioStreamOutA2DP::getEncodeStats(nsecs_t *cpuNs, uint64_t *frames)
+{
+    AutoMutex lock(mRingLock);
+
+    *cpuNs = mEncodeCpuNs;
+    *frames = mEncodedFrames;
+}
+
+status_t AudioStreamOutA2DP::dump(int fd, const Vector<String16>& args)
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    String8 result;
+    nsecs_t cpuNs;
+    uint64_t frames;
+
+    getEncodeStats(&cpuNs, &frames);
+
+    double audioNs = frames * 1000000000.0 / mSampleRate;
+
+    snprintf(buffer, SIZE, "AudioStreamOutA2DP::dump\n");
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tsample rate: %d\n", sampleRate());
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tstandby: %d, mtu: %d\n", mStandby, mMtu);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tbitpool: %d (%d - %d), frame length: %d\n", mEncoder.bitpool(),
+             mMinBitpool, mMaxBitpool, mEncoder.frameLength());
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tpackets sent: %u, dropped: %u, congestions: %u\n",
+             mPacketsSent, mPacketsDropped, mCongestions);
+    result.append(buffer);
+    snprintf(buffer, SIZE, "\tencode cpu: %.2f%%, %.1f us per SBC frame\n",
+             audioNs > 0 ? cpuNs * 100.0 / audioNs : 0.0,
+             frames ? ns2us(cpuNs) * (double)mEncoder.codesize() / frames : 0.0);
+    result.append(buffer);
+    ::write(fd, result.string(), result.size());
+    return NO_ERROR;
+}
+
+// ----------------------------------------------------------------------------
+
+}; // namespace android
@@ -0,0 +1,144 @@
+/*
+**
+** Copyright 2007, Google Inc.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef ANDROID_A2DP_OUTPUT_H
+#define ANDROID_A2DP_OUTPUT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <hardware_legacy/AudioHardwareBase.h>
+#include <utils/threads.h>
+#include <utils/Timers.h>
+#include "SbcEncoder.h"
+
+namespace android {
+
+// ----------------------------------------------------------------------------
+class AudioStreamOutA2DP;
+
+class A2dpSender : public Thread
+{
+public:
+                        A2dpSender(AudioStreamOutA2DP *stream) : mStream(stream) {}
+
+private:
+    virtual bool        threadLoop();
+
+    AudioStreamOutA2DP  *mStream;
+};
+
+/*
+ A2DP output. write() fills a PCM ring, the sender thread encodes SBC and
+ sends RTP packets in real time to the sink named by "audio.a2dp.sink":
+ "socket:<path>" for a local datagram socket (the transport, or a test
+ receiver), "file:<path>" for a raw SBC file. The bitpool drops when the
+ sink pushes back and climbs again once packets go through freely.
+*/
+class AudioStreamOutA2DP : public AudioStreamOut {
+public:
+                        AudioStreamOutA2DP();
+    virtual             ~AudioStreamOutA2DP();
+
+    status_t    set(uint32_t devices,
+                    int *pFormat,
+                    uint32_t *pChannels,
+                    uint32_t *pRate);
+
+    virtual uint32_t    sampleRate() const { return mSampleRate; }
+    virtual size_t      bufferSize() const { return 4096; }
+    virtual uint32_t    channels() const { return AudioSystem::CHANNEL_OUT_STEREO; }
+    virtual int         format() const { return AudioSystem::PCM_16_BIT; }
+    virtual uint32_t    latency() const;
+    virtual status_t    setVolume(float left, float right) { return INVALID_OPERATION; }
+    virtual ssize_t     write(const void* buffer, size_t bytes);
+    virtual status_t    standby();
+    virtual status_t    dump(int fd, const Vector<String16>& args);
+
+    virtual status_t    setParameters(const String8& keyValuePairs);
+    virtual String8     getParameters(const String8& keys);
+
+    virtual status_t    getRenderPosition(uint32_t *dspFrames);
+
+    uint32_t    devices() { return mDevices; }
+
+    // true when "audio.a2dp.sink" names a sink this stream can open
+    static bool isSinkConfigured();
+
+private:
+    friend class A2dpSender;
+
+    status_t        start_l();
+    status_t        standby_l();
+    int             openSink();
+    void            closeSink();
+
+    // one packet per call, false when the thread is asked to exit
+    bool            sendPacket();
+    ssize_t         sendBuffer(const uint8_t *buffer, size_t length);
+    void            adaptBitpool(bool pressure);
+    void            getEncodeStats(nsecs_t *cpuNs, uint64_t *frames);
+
+    Mutex           mLock;          // stream state, taken by write() and standby()
+    Mutex           mRingLock;
+    Condition       mRingData;
+    Condition       mRingSpace;
+
+    sp<A2dpSender>  mSender;
+    SbcEncoder      mEncoder;
+
+    uint32_t        mDevices;
+    uint32_t        mSampleRate;
+    bool            mStandby;
+    bool            mExiting;
+
+    // PCM ring, stereo frames
+    int16_t         *mRing;
+    size_t          mRingFrames;
+    size_t          mRingRead;
+    size_t          mRingFill;
+
+    // sink
+    int             mSink;
+    bool            mSinkIsFile;    // raw SBC frames instead of RTP
+    size_t          mMtu;
+    uint8_t         *mPacket;
+    uint16_t        mSequence;
+    uint32_t        mTimestamp;
+
+    // pacing, the sender keeps at most one packet ahead of real time
+    nsecs_t         mStartTime;
+    uint64_t        mFramesSent;    // written under mRingLock, read by binder threads
+
+    // adaptive bitpool
+    unsigned int    mMinBitpool;
+    unsigned int    mMaxBitpool;
+    unsigned int    mCleanPackets;
+
+    // statistics
+    uint32_t        mPacketsSent;
+    uint32_t        mPacketsDropped;
+    uint32_t        mCongestions;
+    // 64 bit, so the sender updates them and readers copy them under mRingLock
+    nsecs_t         mEncodeCpuNs;   // thread CPU time spent in the encoder
+    uint64_t        mEncodedFrames;
+};
+
+// ----------------------------------------------------------------------------
+
+}; // namespace android
+
+#endif // ANDROID_A2DP_OUTPUT_H
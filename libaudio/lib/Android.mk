@@ -33,7 +33,9 @@ LOCAL_CFLAGS += \
 
 # build AUDIO
 LOCAL_SRC_FILES+= \
-	AudioHardware.cpp
+	AudioHardware.cpp \
+	A2dpOutput.cpp \
+	SbcEncoder.cpp
 
 LOCAL_MODULE:= libaudio
 
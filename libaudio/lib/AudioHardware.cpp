@@ -20,20 +20,95 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
 #include <cutils/properties.h>
 #include <unistd.h>
 #include <sched.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
 
 #define LOG_TAG "AudioHardwareASTER"
 #include <utils/Log.h>
 #include <utils/String8.h>
+#include <utils/Timers.h>
 #include "AudioHardware.h"
 
 #define MMAP_ENABLE
 
+// snd_pcm_resume() retries back off from 1 ms to 8 ms, after 50 ms the
+// stream is re-prepared instead
+#define RESUME_BACKOFF_MIN_US 1000
+#define RESUME_BACKOFF_MAX_US 8000
+#define RESUME_TIMEOUT_US     50000
+
 namespace android {
 
+/*
+ Negotiated PCM parameters. Streams reopen the PCM on every standby exit, a
+ cache hit installs the parameters found last time with one snd_pcm_hw_params()
+ call instead of probing access, rate, period and buffer sizes again. The
+ profile is the requested period size, it tells the deep buffer, direct and
+ voice opens of the same device apart.
+*/
+#define PCM_PARAMS_CACHE_SIZE 8
+
+typedef struct
+{
+    bool used;
+    unsigned int gen;
+    String8 device;
+    snd_pcm_stream_t stream;
+    snd_pcm_format_t format;
+    unsigned int channels;              // requested
+    unsigned int rate;                  // requested
+    snd_pcm_uframes_t profile;          // requested period size
+    snd_pcm_hw_params_t *hwParams;
+    ALSAHandle::hwParamType negotiated;
+    snd_pcm_sw_params_t *swParams[ALSAHandle::SW_DUPLEX_RECORD + 1];
+    snd_pcm_uframes_t startThreshold[ALSAHandle::SW_DUPLEX_RECORD + 1];
+} pcmParamsCacheEntry;
+
+static pcmParamsCacheEntry pcmParamsCache[PCM_PARAMS_CACHE_SIZE];
+static unsigned int pcmParamsCacheNext = 0;
+static Mutex pcmParamsCacheLock;
+
+// called with pcmParamsCacheLock held
+static void freePcmParamsCacheEntry(pcmParamsCacheEntry *entry)
+{
+    if (entry->hwParams)
+    {
+        snd_pcm_hw_params_free(entry->hwParams);
+        entry->hwParams = NULL;
+    }
+
+    for (int flag = 0; flag <= ALSAHandle::SW_DUPLEX_RECORD; flag++)
+    {
+        if (entry->swParams[flag])
+        {
+            snd_pcm_sw_params_free(entry->swParams[flag]);
+            entry->swParams[flag] = NULL;
+        }
+    }
+
+    entry->used = false;
+}
+
+static void clearPcmParamsCache()
+{
+    AutoMutex lock(pcmParamsCacheLock);
+
+    for (int i = 0; i < PCM_PARAMS_CACHE_SIZE; i++)
+    {
+        freePcmParamsCacheEntry(&pcmParamsCache[i]);
+    }
+}
+
 // ----------------------------------------------------------------------------
 static char const * const audioDevice[] =
 {
@@ -42,8 +117,24 @@ static char const * const audioDevice[] =
     "plughw:0,0",//ALSA_MONO_OUT
 //  "default",
     "default", //ALSA_MONO_IN
+    "plughw:0,1", //ALSA_VOICE_CALL
+    "plughw:0,1", //ALSA_VOICE_CALL_IN
 };
 
+// Codec opens go straight to the hw device, the HAL adapts channels and rate.
+// Set "audio.alsa.native" to 0 to always go through the plug devices above.
+#define NATIVE_PCM "hw:0,0"
+#define NATIVE_PCM_PROPERTY "audio.alsa.native"
+
+// voice PCM override, "null" or a loopback card runs calls without a modem
+#define VOICE_PCM_PROPERTY "audio.voice.pcm"
+// 8000 or 16000 for wideband calls
+#define VOICE_RATE_PROPERTY "audio.voice.rate"
+// call recording buffers this many engine periods
+#define VOICE_CAPTURE_PERIODS 16
+// a call recording read gives up after this long without engine frames
+#define VOICE_CAPTURE_TIMEOUT_NS 100000000LL
+
 static uint32_t supportedOutSampleRate[] = 
 {
     8000, 11025, 16000, 22050, 32000, 44100, 48000
@@ -179,6 +270,19 @@ ALSAHandle::ALSAHandle()
     mDeviceType = ALSA_NULL;
     mPcmHandle = NULL;
     mStreamType = SND_PCM_STREAM_PLAYBACK;
+    mLinked = false;
+    mStartThreshold = 0;
+    memset(&mRecovery, 0, sizeof(mRecovery));
+    mCacheSlot = -1;
+    mCacheGen = 0;
+    mNative = false;
+    mClientChannels = 0;
+    mClientRate = 0;
+    mResampleStep = 0;
+    mResamplePhase = 0;
+    mResampleLast[0] = mResampleLast[1] = 0;
+    mConvBuffer = NULL;
+    mConvSamples = 0;
 
 #ifdef MMAP_ENABLE
     writei_func = snd_pcm_mmap_writei;
@@ -196,11 +300,15 @@ ALSAHandle::ALSAHandle()
 ALSAHandle::~ALSAHandle()
 {
     close();
+    free(mConvBuffer);
 }
 
 status_t ALSAHandle::open(audioDeviceType type)
 {
     int err = -1;
+    char voicePcm[PROPERTY_VALUE_MAX];
+    char value[PROPERTY_VALUE_MAX];
+    const char *name = NULL;
 
     LOGI("ALSAHandle: open %d", type);
 
@@ -225,6 +333,18 @@ status_t ALSAHandle::open(audioDeviceType type)
             }
             break;
 
+        case ALSA_VOICE_CALL:
+            {
+                mStreamType = SND_PCM_STREAM_PLAYBACK;
+            }
+            break;
+
+        case ALSA_VOICE_CALL_IN:
+            {
+                mStreamType = SND_PCM_STREAM_CAPTURE;
+            }
+            break;
+
         default:
             {
                 LOGE("ALSAHandle: Invalid audioDeviceType: %d", type);
@@ -234,9 +354,35 @@ status_t ALSAHandle::open(audioDeviceType type)
             break;
     }
 
-    LOGI("ALSAHandle: snd_pcm_open ALSA device %s streamtype %d", audioDevice[type], (int)mStreamType);
+    name = audioDevice[type];
+    mNative = false;
+
+    if (type == ALSA_VOICE_CALL || type == ALSA_VOICE_CALL_IN)
+    {
+        property_get(VOICE_PCM_PROPERTY, voicePcm, audioDevice[type]);
+        name = voicePcm;
+    }
+    else
+    {
+        property_get(NATIVE_PCM_PROPERTY, value, "1");
+        if (atoi(value) != 0)
+        {
+            name = NATIVE_PCM;
+            mNative = true;
+        }
+    }
+
+    LOGI("ALSAHandle: snd_pcm_open ALSA device %s streamtype %d", name, (int)mStreamType);
+
+    err = snd_pcm_open(&mPcmHandle, name, mStreamType, 0);
+    if ((err < 0 || mPcmHandle == NULL) && mNative)
+    {
+        LOGW("ALSAHandle: %s open error: %s, using %s", name, snd_strerror(err), audioDevice[type]);
+        mNative = false;
+        name = audioDevice[type];
+        err = snd_pcm_open(&mPcmHandle, name, mStreamType, 0);
+    }
 
-    err = snd_pcm_open(&mPcmHandle, audioDevice[type], mStreamType, 0);
     if ((err < 0) || (mPcmHandle == NULL))
     {
         LOGE("ALSAHandle: alsa open error: %s", snd_strerror(err));
@@ -245,6 +391,9 @@ status_t ALSAHandle::open(audioDeviceType type)
     }
 
     mDeviceType = type;
+    mDeviceName = name;
+    mCacheSlot = -1;
+    memset(&mRecovery, 0, sizeof(mRecovery));
  
 #ifdef DUMP_PCM
     const char *filename = "/sdcard/alsa.pcm";
@@ -256,23 +405,63 @@ status_t ALSAHandle::open(audioDeviceType type)
 
 status_t ALSAHandle::setHwParams(snd_pcm_format_t format, unsigned int channels, unsigned int sampleRate, snd_pcm_uframes_t periodSize)
 {
-    int err = -1;
-    snd_pcm_hw_params_t *params = NULL;
-
     if (NULL == mPcmHandle)
     {
         LOGE("ALSAHandle: setHwParams mPcmHandle is NULL");
         return -1;
     }
-    
-    mHwparams.format = format;  //format is always SND_PCM_FORMAT_S16_LE
-    mHwparams.channels = channels;
-    mHwparams.rate = sampleRate;
-    mHwparams.periodSize = periodSize;
-    mHwparams.bits_per_sample = snd_pcm_format_physical_width(mHwparams.format);
-    mHwparams.bits_per_frame = mHwparams.bits_per_sample * mHwparams.channels;
-    mHwparams.bytes_per_frame = mHwparams.bits_per_frame / 8;
-    
+
+    mClientChannels = channels;
+    mClientRate = sampleRate;
+
+    for (;;)
+    {
+        mHwparams.format = format;  //format is always SND_PCM_FORMAT_S16_LE
+        mHwparams.channels = channels;
+        mHwparams.rate = sampleRate;
+        mHwparams.periodSize = periodSize;
+        mHwparams.bits_per_sample = snd_pcm_format_physical_width(mHwparams.format);
+        mHwparams.bits_per_frame = mHwparams.bits_per_sample * mHwparams.channels;
+        mHwparams.bytes_per_frame = mHwparams.bits_per_frame / 8;
+
+        if ((applyCachedHwParams(sampleRate, periodSize) || negotiateHwParams() == NO_ERROR)
+            && setupConversion())
+        {
+            return NO_ERROR;
+        }
+
+        if (!mNative)
+        {
+            return -1;
+        }
+
+        // the hardware cannot take this configuration, let the plug chain adapt it
+        LOGW("ALSAHandle: %s cannot be configured natively, using %s", NATIVE_PCM, audioDevice[mDeviceType]);
+
+        snd_pcm_close(mPcmHandle);
+        mPcmHandle = NULL;
+        mNative = false;
+        mCacheSlot = -1;
+
+        int err = snd_pcm_open(&mPcmHandle, audioDevice[mDeviceType], mStreamType, 0);
+        if ((err < 0) || (mPcmHandle == NULL))
+        {
+            LOGE("ALSAHandle: alsa open error: %s", snd_strerror(err));
+            mPcmHandle = NULL;
+            return -1;
+        }
+
+        mDeviceName = audioDevice[mDeviceType];
+    }
+}
+
+status_t ALSAHandle::negotiateHwParams(void)
+{
+    int err = -1;
+    snd_pcm_hw_params_t *params = NULL;
+    unsigned int sampleRate = mHwparams.rate;
+    snd_pcm_uframes_t periodSize = mHwparams.periodSize;
+
     snd_pcm_hw_params_alloca(&params);
 
     err = snd_pcm_hw_params_any(mPcmHandle, params);
@@ -307,7 +496,18 @@ status_t ALSAHandle::setHwParams(snd_pcm_format_t format, unsigned int channels,
         return -1;
     }
     
-    err = snd_pcm_hw_params_set_channels(mPcmHandle, params, mHwparams.channels);
+    // the hw device keeps its own channel count, the HAL up or down mixes
+    if (mNative)
+    {
+        err = snd_pcm_hw_params_set_channels_near(mPcmHandle, params, &(mHwparams.channels));
+        mHwparams.bits_per_frame = mHwparams.bits_per_sample * mHwparams.channels;
+        mHwparams.bytes_per_frame = mHwparams.bits_per_frame / 8;
+    }
+    else
+    {
+        err = snd_pcm_hw_params_set_channels(mPcmHandle, params, mHwparams.channels);
+    }
+
     if (err < 0)
     {
         LOGE("ALSAHandle: Channels count non available, result is %s", snd_strerror(err));
@@ -328,7 +528,7 @@ status_t ALSAHandle::setHwParams(snd_pcm_format_t format, unsigned int channels,
         return -1;
     }
     
-    mHwparams.bufferSize = mHwparams.periodSize*4;
+    mHwparams.bufferSize = mHwparams.periodSize * PERIOD_COUNT;
     err = snd_pcm_hw_params_set_buffer_size_near(mPcmHandle, params, &(mHwparams.bufferSize));
     if (err<0)
     {
@@ -346,6 +546,8 @@ status_t ALSAHandle::setHwParams(snd_pcm_format_t format, unsigned int channels,
     snd_pcm_hw_params_get_period_size(params, &(mHwparams.periodSize), 0);
     snd_pcm_hw_params_get_buffer_size(params, &(mHwparams.bufferSize));
 
+    cacheHwParams(params, sampleRate, periodSize);
+
     LOGI("ALSAHandle: periodSize: %d, bufferSize: %d", (int)(mHwparams.periodSize), (int)(mHwparams.bufferSize));
 
     return NO_ERROR;
@@ -365,6 +567,12 @@ status_t ALSAHandle::setSwParams(ALSA_SET_SW_FLAG flag)
     snd_pcm_uframes_t bufferSize = 0;
     snd_pcm_uframes_t periodSize = 0;
     snd_pcm_uframes_t startThreshold = 0, stopThreshold = 0;
+    snd_pcm_uframes_t boundary = 0;
+
+    if (applyCachedSwParams(flag))
+    {
+        return NO_ERROR;
+    }
 
     if (snd_pcm_sw_params_malloc(&softwareParams) < 0)
     {
@@ -395,6 +603,14 @@ status_t ALSAHandle::setSwParams(ALSA_SET_SW_FLAG flag)
         startThreshold = 1;
         stopThreshold = bufferSize;
     }
+    else if (flag == SW_DUPLEX_PLAY || flag == SW_DUPLEX_RECORD)
+    {
+        // The linked pair is started explicitly and must never stop on an
+        // xrun, a restart of one side would shift it against the other.
+        snd_pcm_sw_params_get_boundary(softwareParams, &boundary);
+        startThreshold = boundary;
+        stopThreshold = boundary;
+    }
 
     err = snd_pcm_sw_params_set_start_threshold(mPcmHandle, softwareParams, startThreshold);
     if (err < 0)
@@ -403,6 +619,8 @@ status_t ALSAHandle::setSwParams(ALSA_SET_SW_FLAG flag)
         goto done;
     }
 
+    mStartThreshold = startThreshold;
+
     err = snd_pcm_sw_params_set_stop_threshold(mPcmHandle, softwareParams, stopThreshold);
     if (err < 0)
     {
@@ -410,6 +628,32 @@ status_t ALSAHandle::setSwParams(ALSA_SET_SW_FLAG flag)
         goto done;
     }
 
+    if (flag == SW_DUPLEX_PLAY)
+    {
+        // play silence instead of stale samples when the writer falls behind
+        err = snd_pcm_sw_params_set_silence_threshold(mPcmHandle, softwareParams, 0);
+        if (err >= 0)
+        {
+            err = snd_pcm_sw_params_set_silence_size(mPcmHandle, softwareParams, boundary);
+        }
+        if (err < 0)
+        {
+            LOGE("ALSAHandle: Unable to set silence fill: %s", snd_strerror(err));
+            goto done;
+        }
+    }
+
+    if (flag == SW_DUPLEX_PLAY || flag == SW_DUPLEX_RECORD)
+    {
+        // both sides stamp their status from the same kernel clock
+        err = snd_pcm_sw_params_set_tstamp_mode(mPcmHandle, softwareParams, SND_PCM_TSTAMP_ENABLE);
+        if (err < 0)
+        {
+            LOGE("ALSAHandle: Unable to enable timestamps: %s", snd_strerror(err));
+            goto done;
+        }
+    }
+
     // Allow the transfer to start when at least periodSize samples can be processed.
     err = snd_pcm_sw_params_set_avail_min(mPcmHandle, softwareParams, periodSize);
     if (err < 0)
@@ -424,6 +668,10 @@ status_t ALSAHandle::setSwParams(ALSA_SET_SW_FLAG flag)
     {
         LOGE("ALSAHandle: Unable to configure software parameters: %s", snd_strerror(err));
     }
+    else
+    {
+        cacheSwParams(softwareParams, flag);
+    }
 
 done:
     snd_pcm_sw_params_free(softwareParams);
@@ -441,6 +689,7 @@ void ALSAHandle::close()
     
     if (NULL != mPcmHandle) 
     {
+        unlink();
         snd_pcm_close(mPcmHandle);
         mPcmHandle = NULL;
     }
@@ -456,6 +705,36 @@ void ALSAHandle::close()
 }
 
 ssize_t ALSAHandle::write(const void* buffer, size_t bytes)
+{
+    if (NULL == mPcmHandle)
+    {
+        LOGE("ALSAHandle: mPcmHandle is NULL");
+        return -1;
+    }
+
+    if (!mNative || (mClientChannels == mHwparams.channels && mResampleStep == 0))
+    {
+        return writeFrames(buffer, bytes);
+    }
+
+    size_t frames = bytes / (mClientChannels * sizeof(int16_t));
+    if (frames == 0)
+    {
+        return bytes;
+    }
+
+    size_t hwFrames = convertPlayback((const int16_t *)buffer, frames);
+    if (hwFrames == 0)
+    {
+        return bytes;
+    }
+
+    ssize_t r = writeFrames(mConvBuffer, hwFrames * mHwparams.bytes_per_frame);
+
+    return (r < 0) ? r : (ssize_t)bytes;
+}
+
+ssize_t ALSAHandle::writeFrames(const void* buffer, size_t bytes)
 {
     ssize_t r = 0, remain_frames = 0, written_frames = 0;
     char * data = (char*)buffer;
@@ -512,7 +791,208 @@ ssize_t ALSAHandle::write(const void* buffer, size_t bytes)
     return written_frames * mHwparams.bytes_per_frame;
 }
 
-ssize_t ALSAHandle::read(void* buffer, ssize_t bytes)
+static void upmixMonoToStereo(int16_t *dst, const int16_t *src, size_t frames)
+{
+#ifdef __ARM_NEON__
+    for (; frames >= 8; frames -= 8)
+    {
+        int16x8x2_t v;
+        v.val[0] = vld1q_s16(src);
+        v.val[1] = v.val[0];
+        vst2q_s16(dst, v);
+        src += 8;
+        dst += 16;
+    }
+#endif
+    while (frames--)
+    {
+        dst[0] = dst[1] = *src++;
+        dst += 2;
+    }
+}
+
+static void downmixStereoToMono(int16_t *dst, const int16_t *src, size_t frames)
+{
+#ifdef __ARM_NEON__
+    for (; frames >= 8; frames -= 8)
+    {
+        int16x8x2_t v = vld2q_s16(src);
+        vst1q_s16(dst, vhaddq_s16(v.val[0], v.val[1]));
+        src += 16;
+        dst += 8;
+    }
+#endif
+    while (frames--)
+    {
+        *dst++ = (int16_t)((src[0] + src[1]) >> 1);
+        src += 2;
+    }
+}
+
+ssize_t ALSAHandle::read(void* buffer, ssize_t bytes, CapturePreprocessor *filter)
+{
+    if (NULL == mPcmHandle)
+    {
+        LOGE("ALSAHandle: mPcmHandle is NULL");
+        return -1;
+    }
+
+    // capture runs at the client rate, only the channel count can differ
+    if (!mNative || mClientChannels == mHwparams.channels)
+    {
+        if (filter && filter->channels() == mHwparams.channels)
+        {
+            return readFused(buffer, bytes, filter);
+        }
+
+        return readFrames(buffer, bytes);
+    }
+
+    size_t frames = bytes / (mClientChannels * sizeof(int16_t));
+    if (!growConvBuffer(frames * mHwparams.channels))
+    {
+        return -1;
+    }
+
+    ssize_t r = readFrames(mConvBuffer, frames * mHwparams.bytes_per_frame);
+    if (r < 0)
+    {
+        return r;
+    }
+
+    frames = r / mHwparams.bytes_per_frame;
+
+    if (mClientChannels == 1)
+    {
+        downmixStereoToMono((int16_t *)buffer, mConvBuffer, frames);
+    }
+    else
+    {
+        upmixMonoToStereo((int16_t *)buffer, mConvBuffer, frames);
+    }
+
+    if (filter && filter->channels() == mClientChannels)
+    {
+        filter->process((int16_t *)buffer, (int16_t *)buffer, frames);
+    }
+
+    return frames * mClientChannels * sizeof(int16_t);
+}
+
+/*
+ Reads straight out of the mmap ring through the preprocessing chain, the
+ filter output is the copy to the caller's buffer. Non interleaved layouts
+ and builds without mmap read normally and filter in place.
+*/
+ssize_t ALSAHandle::readFused(void* buffer, ssize_t bytes, CapturePreprocessor *filter)
+{
+    ssize_t remain_frames = bytes / mHwparams.bytes_per_frame, read_frames = 0;
+    int16_t *data = (int16_t *)buffer;
+
+#ifdef MMAP_ENABLE
+    while (remain_frames > 0)
+    {
+        const snd_pcm_channel_area_t *areas = NULL;
+        snd_pcm_uframes_t offset = 0, frames = 0;
+        snd_pcm_sframes_t avail = 0, committed = 0;
+        int err = 0;
+
+        if (snd_pcm_state(mPcmHandle) == SND_PCM_STATE_PREPARED)
+        {
+            snd_pcm_start(mPcmHandle);
+        }
+
+        avail = snd_pcm_avail_update(mPcmHandle);
+        if (avail == -EPIPE)
+        {
+            LOGE("ALSAHandle: read error: r = -EPIPE");
+            if (xrun() < 0)
+            {
+                return -1;
+            }
+            continue;
+        }
+        else if (avail == -ESTRPIPE)
+        {
+            LOGE("ALSAHandle: read error: r = -ESTRPIPE");
+            if (suspend() < 0)
+            {
+                return -1;
+            }
+            continue;
+        }
+        else if (avail < 0)
+        {
+            LOGE("ALSAHandle: read error: %s", snd_strerror(avail));
+            return avail;
+        }
+        else if (avail == 0)
+        {
+            snd_pcm_wait(mPcmHandle, 1000);
+            continue;
+        }
+
+        frames = (avail < remain_frames) ? avail : remain_frames;
+
+        err = snd_pcm_mmap_begin(mPcmHandle, &areas, &offset, &frames);
+        if (err < 0)
+        {
+            LOGE("ALSAHandle: mmap begin error: %s", snd_strerror(err));
+            return err;
+        }
+
+        if (areas[0].step != mHwparams.bits_per_frame
+            || (mHwparams.channels > 1 && areas[1].addr != areas[0].addr))
+        {
+            snd_pcm_mmap_commit(mPcmHandle, offset, 0);
+            break;
+        }
+
+        const int16_t *src = (const int16_t *)((const char *)areas[0].addr
+                                               + (areas[0].first + offset * areas[0].step) / 8);
+        filter->process(data, src, frames);
+
+        committed = snd_pcm_mmap_commit(mPcmHandle, offset, frames);
+        if (committed < 0 || (snd_pcm_uframes_t)committed != frames)
+        {
+            // the frames were copied before the overrun was seen, keep them
+            LOGE("ALSAHandle: mmap commit error: %d", (int)committed);
+            if (xrun() < 0)
+            {
+                return -1;
+            }
+        }
+
+        data += frames * mHwparams.channels;
+        remain_frames -= frames;
+        read_frames += frames;
+    }
+#endif
+
+    if (remain_frames > 0)
+    {
+        ssize_t r = readFrames(data, remain_frames * mHwparams.bytes_per_frame);
+        if (r < 0)
+        {
+            return r;
+        }
+
+        filter->process(data, data, r / mHwparams.bytes_per_frame);
+        read_frames += r / mHwparams.bytes_per_frame;
+    }
+
+#ifdef DUMP_PCM
+    if (mPcmFile) 
+    {
+        fwrite(buffer, sizeof(char), read_frames * mHwparams.bytes_per_frame, mPcmFile);
+        fflush(mPcmFile);
+    }
+#endif
+
+    return read_frames * mHwparams.bytes_per_frame;
+}
+
+ssize_t ALSAHandle::readFrames(void* buffer, ssize_t bytes)
 {
     ssize_t n = 0, remain_frames = 0, read_frames = 0;
     char *data = (char*)buffer;
@@ -574,604 +1054,1934 @@ ALSAHandle::audioDeviceType ALSAHandle::status()
     return mDeviceType;
 }
 
-ssize_t ALSAHandle::xrun(void)
+bool ALSAHandle::setupConversion(void)
 {
-#ifndef timersub
-#define    timersub(a, b, result) \
-do { \
-    (result)->tv_sec = (a)->tv_sec - (b)->tv_sec; \
-    (result)->tv_usec = (a)->tv_usec - (b)->tv_usec; \
-    if ((result)->tv_usec < 0) { \
-        --(result)->tv_sec; \
-        (result)->tv_usec += 1000000; \
-    } \
-} while (0)
-#endif
+    mResampleStep = 0;
+    mResamplePhase = 0;
+    mResampleLast[0] = mResampleLast[1] = 0;
 
-    snd_pcm_status_t *status = NULL;
-    int res = -1;
-    
-    snd_pcm_status_alloca(&status);
-   
-    if ((res = snd_pcm_status(mPcmHandle, status)) < 0) 
+    if (!mNative)
     {
-        LOGE("ALSAHandle: status error: %s", snd_strerror(res));
-        return -1;
+        return true;
     }
-    
-    if (snd_pcm_status_get_state(status) == SND_PCM_STATE_XRUN)
-    {
-        struct timeval now, diff, tstamp;
-        gettimeofday(&now, 0);
-        snd_pcm_status_get_trigger_tstamp(status, &tstamp);
-        timersub(&now, &tstamp, &diff);
-
-        LOGI("ALSAHandle: %s!!! (at least %.3f ms long)", mStreamType == SND_PCM_STREAM_PLAYBACK ? "underrun" : "overrun",diff.tv_sec * 1000 + diff.tv_usec / 1000.0);
 
-        if ((res = snd_pcm_prepare(mPcmHandle)) < 0)
-        {
-            LOGE("ALSAHandle: prepare error: %s", snd_strerror(res));
-            return -1;
-        }
+    if (mHwparams.format != SND_PCM_FORMAT_S16_LE
+        || mHwparams.channels < 1 || mHwparams.channels > 2
+        || mClientChannels < 1 || mClientChannels > 2)
+    {
+        return false;
+    }
 
-        return 0;        /* ok, data should be accepted again */
-    } 
-    
-    if (snd_pcm_status_get_state(status) == SND_PCM_STATE_DRAINING)
+    if (mHwparams.rate != mClientRate)
     {
-        if (mStreamType == SND_PCM_STREAM_CAPTURE)
+        // capture would need a look-ahead resampler, leave it to plug
+        if (mStreamType != SND_PCM_STREAM_PLAYBACK)
         {
-            LOGE("ALSAHandle: capture stream format change? attempting recover...");
-
-            if ((res = snd_pcm_prepare(mPcmHandle)) < 0) 
-            {
-                LOGE("ALSAHandle: prepare error: %s", snd_strerror(res));
-                return -1;
-            }
-
-            return 0;
+            return false;
         }
+
+        mResampleStep = (uint32_t)(((uint64_t)mClientRate << 16) / mHwparams.rate);
     }
 
-    LOGE("ALSAHandle: read/write error, state = %s", snd_pcm_state_name(snd_pcm_status_get_state(status)));
+    LOGI("ALSAHandle: native %u ch %u Hz, stream %u ch %u Hz", mHwparams.channels, mHwparams.rate,
+                                                               mClientChannels, mClientRate);
 
-    return -1;
+    return true;
 }
 
-ssize_t ALSAHandle::suspend(void)
+bool ALSAHandle::growConvBuffer(size_t samples)
 {
-    int res = -1;
-
-    while ((res = snd_pcm_resume(mPcmHandle)) == -EAGAIN)
+    if (samples <= mConvSamples)
     {
-        sleep(1);   /* wait until suspend flag is released */
+        return true;
     }
 
-    if (res < 0)
+    int16_t *buffer = (int16_t *)realloc(mConvBuffer, samples * sizeof(int16_t));
+    if (NULL == buffer)
     {
-        if ((res = snd_pcm_prepare(mPcmHandle)) < 0)
-        {
-            LOGE("ALSAHandle: prepare error: %s", snd_strerror(res));
-            return -1;
-        }
+        return false;
     }
 
-    return 0;
-}
-
-// ----------------------------------------------------------------------------
-AudioHardware::AudioHardware()
-{
-    mOutput = NULL;
-    mInput = NULL;
-    mAlsaHandle = new ALSAHandle();
-    mCurMode = mMode;
-    mCurDevices = 0;
-    mVoiceVolume = 100;
-    mMicMute = false;
-    mFirstEnableDevice = false;
+    mConvBuffer = buffer;
+    mConvSamples = samples;
 
-    HWA_Init();
+    return true;
 }
 
-AudioHardware::~AudioHardware()
+/*
+ Adapts client frames to the hw channel count and rate in mConvBuffer and
+ returns the number of hw frames. The resampler is linear, with the phase
+ and last input frame carried across writes.
+*/
+size_t ALSAHandle::convertPlayback(const int16_t *in, size_t frames)
 {
-    if (NULL!=mOutput)
+    unsigned int hwChannels = mHwparams.channels;
+
+    if (mResampleStep == 0)
     {
-        delete mOutput;
+        if (!growConvBuffer(frames * hwChannels))
+        {
+            return 0;
+        }
+
+        if (mClientChannels == 1)
+        {
+            upmixMonoToStereo(mConvBuffer, in, frames);
+        }
+        else
+        {
+            downmixStereoToMono(mConvBuffer, in, frames);
+        }
+
+        return frames;
     }
-    if (NULL!=mInput) 
+
+    size_t maxOut = (size_t)((((uint64_t)frames << 16) + mResamplePhase) / mResampleStep) + 2;
+    if (!growConvBuffer(maxOut * hwChannels))
     {
-        delete mInput;
+        return 0;
     }
-    if (NULL!=mAlsaHandle) 
+
+    int16_t *out = mConvBuffer;
+    size_t produced = 0;
+    uint32_t phase = mResamplePhase;
+
+    for (;;)
     {
-        delete mAlsaHandle;
-    }
-}
+        size_t idx = phase >> 16;
+        if (idx >= frames)
+        {
+            break;
+        }
 
-status_t AudioHardware::initCheck()
-{
-    return NO_ERROR;
-}
+        int32_t frac = phase & 0xFFFF;
+        int16_t s0[2], s1[2];
 
-size_t AudioHardware::getInputBufferSize(uint32_t sampleRate, int format, int channelCount)
-{
-    if (format != AudioSystem::PCM_16_BIT) {
-            LOGW("getInputBufferSize bad format: %d", format);
-            return 0;
-    }
-    if (channelCount < 1 || channelCount > 2) {
-            LOGW("getInputBufferSize bad channel count: %d", channelCount);
-            return 0;
-    }
-    return 320;
-}
-AudioStreamOut* AudioHardware::openOutputStream(
-                                uint32_t devices,
-                                int *format,
-                                uint32_t *channels,
-                                uint32_t *sampleRate,
-                                status_t *status) 
-{
-    AutoMutex lock(mLock);
+        // previous and current input frame, mapped to the hw channel count
+        for (unsigned int c = 0; c < hwChannels; c++)
+        {
+            const int16_t *cur = in + idx * mClientChannels;
+            int16_t a, b;
 
-    LOGI("openOutputStream: devices: 0x%x format: %d, channels: 0x%x, sampleRate: %d",
-                                              devices, *format, *channels, *sampleRate);
+            if (mClientChannels == hwChannels)
+            {
+                b = cur[c];
+            }
+            else if (mClientChannels == 1)
+            {
+                b = cur[0];
+            }
+            else
+            {
+                b = (int16_t)((cur[0] + cur[1]) >> 1);
+            }
 
-    // only one output stream allowed
-    if (mOutput)
-    {
-        if (status)
+            if (idx == 0)
+            {
+                a = mResampleLast[c];
+            }
+            else if (mClientChannels == hwChannels)
+            {
+                a = cur[c - mClientChannels];
+            }
+            else if (mClientChannels == 1)
+            {
+                a = cur[-1];
+            }
+            else
+            {
+                a = (int16_t)((cur[-2] + cur[-1]) >> 1);
+            }
+
+            s0[c] = a;
+            s1[c] = b;
+        }
+
+        for (unsigned int c = 0; c < hwChannels; c++)
         {
-            *status = INVALID_OPERATION;
+            *out++ = (int16_t)(s0[c] + (((s1[c] - s0[c]) * (frac >> 1)) >> 15));
         }
 
-        return NULL;
+        produced++;
+        phase += mResampleStep;
     }
 
-    // create new output stream
-    AudioStreamOutASTER* out = new AudioStreamOutASTER();
-    status_t lStatus = out->set(this,devices, format, channels, sampleRate);
-    if (status)
-    {
-        *status = lStatus;
-    }
+    mResamplePhase = phase - (uint32_t)(frames << 16);
 
-    if (lStatus == NO_ERROR)
-    {
-        mOutput = out;
-    }
-    else
+    // keep the last input frame for the next write
+    const int16_t *last = in + (frames - 1) * mClientChannels;
+    for (unsigned int c = 0; c < hwChannels; c++)
     {
-        delete out;
+        if (mClientChannels == hwChannels)
+        {
+            mResampleLast[c] = last[c];
+        }
+        else if (mClientChannels == 1)
+        {
+            mResampleLast[c] = last[0];
+        }
+        else
+        {
+            mResampleLast[c] = (int16_t)((last[0] + last[1]) >> 1);
+        }
     }
 
-    return mOutput;
+    return produced;
 }
 
-void AudioHardware::closeOutputStream(AudioStreamOut* out)
+bool ALSAHandle::applyCachedHwParams(unsigned int rate, snd_pcm_uframes_t periodSize)
 {
-    LOGI("closeOutputStream: closing Output Stream");
+    AutoMutex lock(pcmParamsCacheLock);
 
-    if (out == mOutput)
+    for (int i = 0; i < PCM_PARAMS_CACHE_SIZE; i++)
     {
-        mOutput = NULL;
+        pcmParamsCacheEntry *entry = &pcmParamsCache[i];
+
+        if (!entry->used || entry->stream != mStreamType || entry->format != mHwparams.format
+            || entry->channels != mClientChannels || entry->rate != rate
+            || entry->profile != periodSize || entry->device != mDeviceName)
+        {
+            continue;
+        }
+
+        int err = snd_pcm_hw_params(mPcmHandle, entry->hwParams);
+        if (err < 0)
+        {
+            // the device changed under us, negotiate again
+            LOGW("ALSAHandle: cached hw params rejected: %s", snd_strerror(err));
+            freePcmParamsCacheEntry(entry);
+            return false;
+        }
+
+        mHwparams = entry->negotiated;
+        mCacheSlot = i;
+        mCacheGen = entry->gen;
+
+        return true;
     }
 
-    if (out) 
+    return false;
+}
+
+void ALSAHandle::cacheHwParams(snd_pcm_hw_params_t *params, unsigned int rate, snd_pcm_uframes_t periodSize)
+{
+    AutoMutex lock(pcmParamsCacheLock);
+
+    int slot = pcmParamsCacheNext;
+    pcmParamsCacheEntry *entry = &pcmParamsCache[slot];
+
+    pcmParamsCacheNext = (pcmParamsCacheNext + 1) % PCM_PARAMS_CACHE_SIZE;
+
+    // evict the previous occupant
+    freePcmParamsCacheEntry(entry);
+
+    if (snd_pcm_hw_params_malloc(&entry->hwParams) < 0)
     {
-        delete out;
+        entry->hwParams = NULL;
+        return;
     }
+
+    snd_pcm_hw_params_copy(entry->hwParams, params);
+    entry->used = true;
+    entry->gen++;
+    entry->device = mDeviceName;
+    entry->stream = mStreamType;
+    entry->format = mHwparams.format;
+    entry->channels = mClientChannels;
+    entry->rate = rate;
+    entry->profile = periodSize;
+    entry->negotiated = mHwparams;
+
+    mCacheSlot = slot;
+    mCacheGen = entry->gen;
 }
 
-AudioStreamIn* AudioHardware::openInputStream(
-        uint32_t devices,
-        int *format,
-        uint32_t *channels,
-        uint32_t *sampleRate,
-        status_t *status,
-        AudioSystem::audio_in_acoustics acoustics)
+bool ALSAHandle::applyCachedSwParams(ALSA_SET_SW_FLAG flag)
 {
-    AutoMutex lock(mLock);
-    
-    LOGI("openInputStream: devices: 0x%x, format: %d, channels: %d, sampleRate: %d",
-                                          devices, *format, *channels, *sampleRate);
+    AutoMutex lock(pcmParamsCacheLock);
 
-    // only one input stream allowed
-    if (mInput) 
+    if (mCacheSlot < 0)
     {
-        if (status) 
-        {
-            *status = INVALID_OPERATION;
-        }
-
-        return NULL;
+        return false;
     }
 
-    // create new output stream
-    AudioStreamInASTER* in = new AudioStreamInASTER();
-    status_t lStatus = in->set(this,devices, format, channels, sampleRate, acoustics);
-    if (status) 
+    pcmParamsCacheEntry *entry = &pcmParamsCache[mCacheSlot];
+
+    if (!entry->used || entry->gen != mCacheGen || entry->swParams[flag] == NULL)
     {
-        *status = lStatus;
+        return false;
     }
 
-    if (lStatus == NO_ERROR) 
-    {
-        mInput = in;
-    } 
-    else 
+    if (snd_pcm_sw_params(mPcmHandle, entry->swParams[flag]) < 0)
     {
-        delete in;
+        snd_pcm_sw_params_free(entry->swParams[flag]);
+        entry->swParams[flag] = NULL;
+        return false;
     }
 
-    return mInput;
+    mStartThreshold = entry->startThreshold[flag];
+
+    return true;
 }
 
-void AudioHardware::closeInputStream(AudioStreamIn* in)
+void ALSAHandle::cacheSwParams(snd_pcm_sw_params_t *params, ALSA_SET_SW_FLAG flag)
 {
-    LOGI("closeInputStream: closing Input Stream");
+    AutoMutex lock(pcmParamsCacheLock);
 
-    if (in == mInput)
+    if (mCacheSlot < 0)
     {
-        mInput = NULL;
+        return;
     }
 
-    if (in) 
+    pcmParamsCacheEntry *entry = &pcmParamsCache[mCacheSlot];
+
+    if (!entry->used || entry->gen != mCacheGen)
     {
-        delete in;
+        return;
     }
-}
 
-status_t AudioHardware::setMode(int mode)
-{
-    status_t status = AudioHardwareBase::setMode(mode);
-    return status;
+    if (entry->swParams[flag] == NULL && snd_pcm_sw_params_malloc(&entry->swParams[flag]) < 0)
+    {
+        entry->swParams[flag] = NULL;
+        return;
+    }
+
+    snd_pcm_sw_params_copy(entry->swParams[flag], params);
+    entry->startThreshold[flag] = mStartThreshold;
 }
 
-status_t AudioHardware::setVoiceVolume(float v)
+status_t ALSAHandle::link(ALSAHandle *other)
 {
-    AutoMutex lock(mLock);
-
-    int CurrentMode = getCurMode();
+    int err = -1;
 
-    if (v < 0 || v > 1)
+    if (NULL == mPcmHandle || NULL == other || NULL == other->mPcmHandle)
     {
-        v = 1;
+        LOGE("ALSAHandle: link without an open PCM");
+        return -1;
     }
 
-    mVoiceVolume = (unsigned int)(v * 100);
+    err = snd_pcm_link(mPcmHandle, other->mPcmHandle);
+    if (err < 0)
+    {
+        LOGE("ALSAHandle: link error: %s", snd_strerror(err));
+        return -1;
+    }
 
-    LOGI("setVoiceVolume: volume: %u, current mode: %d", mVoiceVolume, CurrentMode);
+    mLinked = true;
+    other->mLinked = true;
 
     return NO_ERROR;
 }
 
-status_t AudioHardware::setMasterVolume(float v)
+void ALSAHandle::unlink()
 {
-    // Implement: set master volume
-    // return error - software mixer will handle it
-    return INVALID_OPERATION;
+    if (mLinked && NULL != mPcmHandle)
+    {
+        snd_pcm_unlink(mPcmHandle);
+    }
+
+    mLinked = false;
 }
 
-status_t AudioHardware::setMicMute(bool state)
+status_t ALSAHandle::start()
 {
-    AutoMutex lock(mLock);    
-    int CurrentMode = 0;
-
-    mMicMute = state;
+    int err = -1;
 
-    CurrentMode = getCurMode();
+    if (NULL == mPcmHandle)
+    {
+        LOGE("ALSAHandle: start mPcmHandle is NULL");
+        return -1;
+    }
 
-    if (CurrentMode != AudioSystem::MODE_IN_CALL)
+    // starts every PCM linked to this one in the same trigger
+    err = snd_pcm_start(mPcmHandle);
+    if (err < 0)
     {
-        return NO_ERROR;
+        LOGE("ALSAHandle: start error: %s", snd_strerror(err));
+        return -1;
     }
 
     return NO_ERROR;
 }
 
-status_t AudioHardware::getMicMute(bool* state)
+status_t ALSAHandle::prefill(snd_pcm_uframes_t frames)
+{
+    snd_pcm_sframes_t r = 0;
+    void *silence = NULL;
+
+    if (NULL == mPcmHandle || mStreamType != SND_PCM_STREAM_PLAYBACK)
+    {
+        return -1;
+    }
+
+    silence = calloc(frames, mHwparams.bytes_per_frame);
+    if (NULL == silence)
+    {
+        return NO_MEMORY;
+    }
+
+    r = writei_func(mPcmHandle, silence, frames);
+    free(silence);
+
+    if (r < 0)
+    {
+        LOGE("ALSAHandle: prefill error: %s", snd_strerror(r));
+        return -1;
+    }
+
+    return NO_ERROR;
+}
+
+status_t ALSAHandle::getDelay(snd_pcm_sframes_t *delay, struct timespec *tstamp)
+{
+    snd_pcm_status_t *status = NULL;
+    snd_htimestamp_t htstamp;
+    int res = -1;
+
+    if (NULL == mPcmHandle)
+    {
+        return -1;
+    }
+
+    snd_pcm_status_alloca(&status);
+
+    if ((res = snd_pcm_status(mPcmHandle, status)) < 0)
+    {
+        LOGE("ALSAHandle: status error: %s", snd_strerror(res));
+        return -1;
+    }
+
+    // delay and timestamp come from the same status snapshot
+    *delay = snd_pcm_status_get_delay(status);
+    snd_pcm_status_get_htstamp(status, &htstamp);
+    tstamp->tv_sec = htstamp.tv_sec;
+    tstamp->tv_nsec = htstamp.tv_nsec;
+
+    return NO_ERROR;
+}
+
+ssize_t ALSAHandle::xrun(void)
+{
+#ifndef timersub
+#define    timersub(a, b, result) \
+do { \
+    (result)->tv_sec = (a)->tv_sec - (b)->tv_sec; \
+    (result)->tv_usec = (a)->tv_usec - (b)->tv_usec; \
+    if ((result)->tv_usec < 0) { \
+        --(result)->tv_sec; \
+        (result)->tv_usec += 1000000; \
+    } \
+} while (0)
+#endif
+
+    snd_pcm_status_t *status = NULL;
+    int res = -1;
+    
+    snd_pcm_status_alloca(&status);
+   
+    if ((res = snd_pcm_status(mPcmHandle, status)) < 0) 
+    {
+        LOGE("ALSAHandle: status error: %s", snd_strerror(res));
+        return -1;
+    }
+    
+    if (snd_pcm_status_get_state(status) == SND_PCM_STATE_XRUN)
+    {
+        struct timeval now, diff, tstamp;
+        gettimeofday(&now, 0);
+        snd_pcm_status_get_trigger_tstamp(status, &tstamp);
+        timersub(&now, &tstamp, &diff);
+
+        LOGI("ALSAHandle: %s!!! (at least %.3f ms long)", mStreamType == SND_PCM_STREAM_PLAYBACK ? "underrun" : "overrun",diff.tv_sec * 1000 + diff.tv_usec / 1000.0);
+
+        nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+
+        if ((res = snd_pcm_prepare(mPcmHandle)) < 0)
+        {
+            LOGE("ALSAHandle: prepare error: %s", snd_strerror(res));
+            return -1;
+        }
+
+        preroll();
+        recovered(start);
+
+        return 0;        /* ok, data should be accepted again */
+    } 
+    
+    if (snd_pcm_status_get_state(status) == SND_PCM_STATE_DRAINING)
+    {
+        if (mStreamType == SND_PCM_STREAM_CAPTURE)
+        {
+            LOGE("ALSAHandle: capture stream format change? attempting recover...");
+
+            if ((res = snd_pcm_prepare(mPcmHandle)) < 0) 
+            {
+                LOGE("ALSAHandle: prepare error: %s", snd_strerror(res));
+                return -1;
+            }
+
+            return 0;
+        }
+    }
+
+    LOGE("ALSAHandle: read/write error, state = %s", snd_pcm_state_name(snd_pcm_status_get_state(status)));
+
+    return -1;
+}
+
+ssize_t ALSAHandle::suspend(void)
+{
+    int res = -1;
+    unsigned int waitUs = RESUME_BACKOFF_MIN_US;
+    unsigned int waitedUs = 0;
+    nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    /* wait until suspend flag is released, but never stall the audio thread */
+    while ((res = snd_pcm_resume(mPcmHandle)) == -EAGAIN && waitedUs < RESUME_TIMEOUT_US)
+    {
+        usleep(waitUs);
+        waitedUs += waitUs;
+        waitUs = (waitUs * 2 > RESUME_BACKOFF_MAX_US) ? RESUME_BACKOFF_MAX_US : waitUs * 2;
+    }
+
+    if (res < 0)
+    {
+        if ((res = snd_pcm_prepare(mPcmHandle)) < 0)
+        {
+            LOGE("ALSAHandle: prepare error: %s", snd_strerror(res));
+            return -1;
+        }
+
+        preroll();
+    }
+
+    recovered(start);
+
+    return 0;
+}
+
+/*
+ After a prepare playback restarts from an empty buffer. Silence up to one
+ period below the start threshold lets the next period start the stream
+ instead of it underrunning again right at the threshold.
+*/
+void ALSAHandle::preroll(void)
+{
+    if (mStreamType != SND_PCM_STREAM_PLAYBACK
+        || mStartThreshold <= mHwparams.periodSize
+        || mStartThreshold > mHwparams.bufferSize)
+    {
+        return;    /* capture, or a linked pair started explicitly */
+    }
+
+    prefill(mStartThreshold - mHwparams.periodSize);
+}
+
+void ALSAHandle::recovered(nsecs_t start)
+{
+    unsigned int us = (unsigned int)ns2us(systemTime(SYSTEM_TIME_MONOTONIC) - start);
+
+    mRecovery.count++;
+    mRecovery.lastUs = us;
+    mRecovery.totalUs += us;
+    if (us > mRecovery.maxUs)
+    {
+        mRecovery.maxUs = us;
+    }
+
+    LOGI("ALSAHandle: recovered in %u us (%u recoveries, max %u us)", us, mRecovery.count, mRecovery.maxUs);
+}
+
+// ----------------------------------------------------------------------------
+// Playback substreams of the codec device. Outputs opened next to the primary
+// one play on substreams of their own, with a single substream they would take
+// the PCM from each other on every write.
+static unsigned int countPlaybackSubstreams()
+{
+    snd_pcm_t *pcm = NULL;
+    snd_pcm_info_t *info;
+    unsigned int count = 1;
+
+    if (snd_pcm_open(&pcm, NATIVE_PCM, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK) < 0 || pcm == NULL)
+    {
+        LOGW("countPlaybackSubstreams: cannot open %s, assuming one substream", NATIVE_PCM);
+        return count;
+    }
+
+    snd_pcm_info_alloca(&info);
+    if (snd_pcm_info(pcm, info) == 0 && snd_pcm_info_get_subdevices_count(info) > 1)
+    {
+        count = snd_pcm_info_get_subdevices_count(info);
+    }
+
+    snd_pcm_close(pcm);
+
+    LOGI("countPlaybackSubstreams: %s has %u playback substreams", NATIVE_PCM, count);
+
+    return count;
+}
+
+AudioHardware::AudioHardware()
+{
+    mOutput = NULL;
+    mDirectOutput = NULL;
+    mDeepBufferOutput = NULL;
+    mOutputSubstreams = countPlaybackSubstreams();
+    mA2dpOutput = NULL;
+    mInput = NULL;
+    mAlsaHandle = new ALSAHandle();
+    mCurMode = mMode;
+    mCurDevices = 0;
+    mVoiceVolume = 100;
+    mMicMute = false;
+    mFirstEnableDevice = false;
+    mActiveStreams = 0;
+    mDuplexMode = false;
+    mDuplexRunning = false;
+    mDuplexUsers = 0;
+    mDuplexPlay = NULL;
+    mDuplexRec = NULL;
+    mDuplexLatency = 0;
+    mVoiceCall = false;
+    mVoiceEngine = NULL;
+
+    mJackMonitor = new AudioJackMonitor(this);
+    mJackMonitor->run("AudioJackMonitor", ANDROID_PRIORITY_AUDIO);
+
+    // Codec programming and calibration run off the mediaserver start-up
+    // path, the first routing call waits in HWA_WaitReady
+    HWA_InitAsync();
+}
+
+AudioHardware::~AudioHardware()
+{
+    if (mJackMonitor != 0)
+    {
+        mJackMonitor->stop();
+        mJackMonitor.clear();
+    }
+
+    {
+        AutoMutex lock(mLock);
+
+        stopDuplex_l();
+    }
+
+    if (NULL!=mOutput)
+    {
+        delete mOutput;
+    }
+    if (NULL!=mDirectOutput)
+    {
+        delete mDirectOutput;
+    }
+    if (NULL!=mDeepBufferOutput)
+    {
+        delete mDeepBufferOutput;
+    }
+    if (NULL!=mA2dpOutput)
+    {
+        delete mA2dpOutput;
+    }
+    if (NULL!=mInput) 
+    {
+        delete mInput;
+    }
+    if (NULL!=mAlsaHandle) 
+    {
+        delete mAlsaHandle;
+    }
+
+    HWA_WaitReady();
+    HWA_SetPowerMode(SGTL5000_COMPONENT, HWA_POWER_OFF);
+    HWA_SetPowerMode(GPO_COMPONENT, HWA_POWER_OFF);
+    HWA_Deinit();
+
+    clearPcmParamsCache();
+}
+
+status_t AudioHardware::initCheck()
+{
+    return NO_ERROR;
+}
+
+size_t AudioHardware::getInputBufferSize(uint32_t sampleRate, int format, int channelCount)
+{
+    if (format != AudioSystem::PCM_16_BIT) {
+            LOGW("getInputBufferSize bad format: %d", format);
+            return 0;
+    }
+    if (channelCount < 1 || channelCount > 2) {
+            LOGW("getInputBufferSize bad channel count: %d", channelCount);
+            return 0;
+    }
+    return 320;
+}
+AudioStreamOut* AudioHardware::openOutputStream(
+                                uint32_t devices,
+                                int *format,
+                                uint32_t *channels,
+                                uint32_t *sampleRate,
+                                status_t *status) 
+{
+    AutoMutex lock(mLock);
+
+    LOGI("openOutputStream: devices: 0x%x format: %d, channels: 0x%x, sampleRate: %d",
+                                              devices, *format, *channels, *sampleRate);
+
+    // A2DP outputs get the SBC encoder when a sink is configured, otherwise
+    // they fall through to a codec stream that plays nothing on A2DP
+    if ((devices & AudioSystem::DEVICE_OUT_ALL_A2DP) && mA2dpOutput == NULL &&
+        AudioStreamOutA2DP::isSinkConfigured())
+    {
+        AudioStreamOutA2DP* a2dpOut = new AudioStreamOutA2DP();
+        status_t lStatus = a2dpOut->set(devices, format, channels, sampleRate);
+        if (status)
+        {
+            *status = lStatus;
+        }
+
+        if (lStatus != NO_ERROR)
+        {
+            delete a2dpOut;
+            return NULL;
+        }
+
+        mA2dpOutput = a2dpOut;
+        return a2dpOut;
+    }
+
+    // The primary output is opened first. Of the codec outputs the policy
+    // manager opens later, the one at the primary rate is the deep buffer music
+    // output and one at another rate is a direct output at the stream's native
+    // rate. Those play next to the primary output, so they need a substream of
+    // their own.
+    bool deepBuffer = false;
+    bool a2dpOnly = (devices & AudioSystem::DEVICE_OUT_ALL_A2DP) && !(devices & ~AudioSystem::DEVICE_OUT_ALL_A2DP);
+
+    if (mOutput && !a2dpOnly)
+    {
+        unsigned int codecOutputs = 1 + (mDeepBufferOutput ? 1 : 0) + (mDirectOutput ? 1 : 0);
+
+        deepBuffer = (sampleRate == NULL) || (*sampleRate == 0) || (*sampleRate == mOutput->sampleRate());
+
+        if (codecOutputs >= mOutputSubstreams || (deepBuffer && mDeepBufferOutput) || (!deepBuffer && mDirectOutput))
+        {
+            LOGW("openOutputStream: no codec substream left for another output");
+
+            if (status)
+            {
+                *status = INVALID_OPERATION;
+            }
+
+            return NULL;
+        }
+    }
+
+    // create new output stream
+    AudioStreamOutASTER* out = new AudioStreamOutASTER(deepBuffer);
+    status_t lStatus = out->set(this,devices, format, channels, sampleRate);
+    if (status)
+    {
+        *status = lStatus;
+    }
+
+    if (lStatus != NO_ERROR)
+    {
+        delete out;
+        return NULL;
+    }
+
+    if (mOutput == NULL)
+    {
+        mOutput = out;
+    }
+    else if (a2dpOnly)
+    {
+        // without a sink it never opens the codec, it is not tracked
+    }
+    else if (deepBuffer)
+    {
+        mDeepBufferOutput = out;
+    }
+    else
+    {
+        mDirectOutput = out;
+    }
+
+    return out;
+}
+
+void AudioHardware::closeOutputStream(AudioStreamOut* out)
+{
+    AutoMutex releaseLock(mReleaseLock);
+
+    LOGI("closeOutputStream: closing Output Stream");
+
+    {
+        AutoMutex lock(mLock);
+
+        if (out == mOutput)
+        {
+            stopDuplex_l();
+            mOutput = NULL;
+        }
+        else if (out == mDirectOutput)
+        {
+            mDirectOutput = NULL;
+        }
+        else if (out == mDeepBufferOutput)
+        {
+            mDeepBufferOutput = NULL;
+        }
+        else if (out == mA2dpOutput)
+        {
+            mA2dpOutput = NULL;
+        }
+    }
+
+    if (out) 
+    {
+        delete out;
+    }
+}
+
+AudioStreamIn* AudioHardware::openInputStream(
+        uint32_t devices,
+        int *format,
+        uint32_t *channels,
+        uint32_t *sampleRate,
+        status_t *status,
+        AudioSystem::audio_in_acoustics acoustics)
+{
+    AutoMutex lock(mLock);
+    
+    LOGI("openInputStream: devices: 0x%x, format: %d, channels: %d, sampleRate: %d",
+                                          devices, *format, *channels, *sampleRate);
+
+    // only one input stream allowed
+    if (mInput) 
+    {
+        if (status) 
+        {
+            *status = INVALID_OPERATION;
+        }
+
+        return NULL;
+    }
+
+    // create new output stream
+    AudioStreamInASTER* in = new AudioStreamInASTER();
+    status_t lStatus = in->set(this,devices, format, channels, sampleRate, acoustics);
+    if (status) 
+    {
+        *status = lStatus;
+    }
+
+    if (lStatus == NO_ERROR) 
+    {
+        mInput = in;
+    } 
+    else 
+    {
+        delete in;
+    }
+
+    return mInput;
+}
+
+void AudioHardware::closeInputStream(AudioStreamIn* in)
+{
+    AutoMutex releaseLock(mReleaseLock);
+
+    LOGI("closeInputStream: closing Input Stream");
+
+    {
+        AutoMutex lock(mLock);
+
+        if (in == mInput)
+        {
+            stopDuplex_l();
+            mInput = NULL;
+        }
+    }
+
+    if (in) 
+    {
+        delete in;
+    }
+}
+
+status_t AudioHardware::setMode(int mode)
+{
+    status_t status = AudioHardwareBase::setMode(mode);
+
+    if (status != NO_ERROR)
+    {
+        return status;
+    }
+
+    if (mode == AudioSystem::MODE_IN_CALL)
+    {
+        // the voice engine owns the codec PCMs for the whole call, the
+        // streams do not open them again from here on
+        {
+            AutoMutex lock(mLock);
+
+            mVoiceCall = true;
+            stopDuplex_l();
+        }
+
+        // outside mLock, a stream in read() or write() may be waiting for it
+        releaseStreamPcms();
+
+        AutoMutex lock(mLock);
+
+        startVoiceEngine_l();
+    }
+    else
+    {
+        AutoMutex lock(mLock);
+
+        mVoiceCall = false;
+
+        if (mVoiceEngine != 0)
+        {
+            mVoiceEngine->stop();
+            mVoiceEngine.clear();
+            updateCodecPower(false);
+        }
+    }
+
+    return status;
+}
+
+status_t AudioHardware::setVoiceVolume(float v)
+{
+    AutoMutex lock(mLock);
+
+    int CurrentMode = getCurMode();
+
+    if (v < 0 || v > 1)
+    {
+        v = 1;
+    }
+
+    mVoiceVolume = (unsigned int)(v * 100);
+
+    if (mVoiceEngine != 0)
+    {
+        mVoiceEngine->setVolume(mVoiceVolume);
+    }
+
+    LOGI("setVoiceVolume: volume: %u, current mode: %d", mVoiceVolume, CurrentMode);
+
+    return NO_ERROR;
+}
+
+status_t AudioHardware::setMasterVolume(float v)
+{
+    // Implement: set master volume
+    // return error - software mixer will handle it
+    return INVALID_OPERATION;
+}
+
+status_t AudioHardware::setMicMute(bool state)
+{
+    AutoMutex lock(mLock);    
+    int CurrentMode = 0;
+
+    mMicMute = state;
+
+    if (mVoiceEngine != 0)
+    {
+        mVoiceEngine->setMicMute(state);
+    }
+
+    CurrentMode = getCurMode();
+
+    if (CurrentMode != AudioSystem::MODE_IN_CALL)
+    {
+        return NO_ERROR;
+    }
+
+    return NO_ERROR;
+}
+
+status_t AudioHardware::getMicMute(bool* state)
 {
     *state = mMicMute;
     return NO_ERROR;
 }
 
-status_t AudioHardware::setParameters(const String8& keyValuePairs)
+status_t AudioHardware::setParameters(const String8& keyValuePairs)
+{
+    AudioParameter param = AudioParameter(keyValuePairs);
+    status_t status = NO_ERROR;
+    String8 values;
+    const  char *value_t;
+
+    if (keyValuePairs.length() == 0) 
+        return BAD_VALUE;
+
+    LOGI("setParameters: %s", keyValuePairs.string());
+
+    if (param.get(String8("duplex"), values) == NO_ERROR)
+    {
+        AutoMutex lock(mLock);
+
+        // takes effect the next time the streams leave standby
+        mDuplexMode = (values == "on");
+        LOGI("setParameters: duplex mode %s", mDuplexMode ? "on" : "off");
+        param.remove(String8("duplex"));
+    }
+
+    return status;
+}
+
+String8 AudioHardware::getParameters(const String8& keys)
+{
+    AudioParameter param = AudioParameter(keys);
+    String8 value;
+
+    if (param.get(String8("duplex_latency"), value) == NO_ERROR)
+    {
+        AutoMutex lock(mLock);
+        uint32_t latency = mDuplexLatency;
+
+        // measured only while neither stream is inside its read or write
+        if (mDuplexRunning && mOutput->pcmLock().tryLock() == NO_ERROR)
+        {
+            if (mInput->pcmLock().tryLock() == NO_ERROR)
+            {
+                latency = measureDuplexLatency_l();
+                mInput->pcmLock().unlock();
+            }
+            mOutput->pcmLock().unlock();
+        }
+
+        param.addInt(String8("duplex_latency"), (int)latency);
+    }
+
+    if (param.get(String8("output_substreams"), value) == NO_ERROR)
+    {
+        param.addInt(String8("output_substreams"), (int)mOutputSubstreams);
+    }
+
+    if (param.get(String8("voice_latency"), value) == NO_ERROR)
+    {
+        AutoMutex lock(mLock);
+
+        param.addInt(String8("voice_latency"), mVoiceEngine != 0 ? (int)mVoiceEngine->latency() : 0);
+    }
+
+    LOGI("getParameters: %s", param.toString().string());
+    return param.toString();
+}
+
+status_t AudioHardware::setModeAndDevices(int on, int mode, uint32_t devices)
+{
+    AutoMutex lock(mLock);
+
+    return setModeAndDevices_l(on, mode, devices);
+}
+
+// the HWA transaction state is global, every routing change runs under mLock
+status_t AudioHardware::setModeAndDevices_l(int on, int mode, uint32_t devices)
+{
+    LOGI("setModeAndDevices: on: %d, mode: %d, devices: 0x%x",on, mode, devices);
+
+    if(0x0 == devices)
+    {
+        goto end;
+    }
+
+    HWA_WaitReady();
+
+    // Collect the per-device requests and let HWA apply the net path changes once
+    HWA_Begin();
+
+    switch(mode)
+    {
+        case AudioSystem::MODE_NORMAL:
+        case AudioSystem::MODE_RINGTONE:
+        {
+            if(devices & AudioSystem::DEVICE_IN_BUILTIN_MIC || devices & AudioSystem::DEVICE_IN_AMBIENT)
+            {
+                if(on)
+                {
+			HWA_AudioDeviceEnable(HWA_LOUD_MIC, HWA_I2S, 100);
+                }
+                else
+                {
+			HWA_AudioDeviceDisable(HWA_LOUD_MIC, HWA_I2S);
+                }
+            }
+           
+            if (devices & AudioSystem::DEVICE_OUT_EARPIECE) 
+            {
+                if(on)
+                {
+			HWA_AudioDeviceEnable(HWA_LOUDSPEAKER, HWA_I2S, 100);
+                }
+                else
+                {
+			HWA_AudioDeviceDisable(HWA_LOUDSPEAKER, HWA_I2S);
+                }
+            }
+
+            if(devices & AudioSystem::DEVICE_OUT_SPEAKER)
+            {
+                if(on)
+                {
+			HWA_AudioDeviceEnable(HWA_LOUDSPEAKER, HWA_I2S, 100);
+                }
+                else
+                {
+			HWA_AudioDeviceDisable(HWA_LOUDSPEAKER, HWA_I2S);
+                }
+            }
+
+            if(devices & AudioSystem::DEVICE_IN_BLUETOOTH_SCO_HEADSET)
+            {
+                if(on)
+                {
+                }
+                else
+                {
+                }
+            }
+                        
+            if(devices & AudioSystem::DEVICE_IN_WIRED_HEADSET)
+            {
+                if(on)
+                {
+			HWA_AudioDeviceEnable(HWA_HP_MIC, HWA_I2S, 100);
+                }
+                else
+                {
+			HWA_AudioDeviceDisable(HWA_HP_MIC, HWA_I2S);
+                }
+            }
+
+            if(devices & (AudioSystem::DEVICE_OUT_WIRED_HEADSET | AudioSystem::DEVICE_OUT_WIRED_HEADPHONE))
+            {
+                if(on)
+                {
+			HWA_AudioDeviceEnable(HWA_HP_SPEAKER, HWA_I2S, 100);
+                }
+                else
+                {
+			HWA_AudioDeviceDisable(HWA_HP_SPEAKER, HWA_I2S);
+                }
+            }
+
+        }            
+        break;
+        // PAD call: the voice engine plays the downlink through these paths
+        // and takes the uplink from the mic that goes with the output
+        case AudioSystem::MODE_IN_CALL:
+        {
+            if(devices & AudioSystem::DEVICE_OUT_EARPIECE)
+            {
+                if(on) 
+                {
+			HWA_AudioDeviceEnable(HWA_LOUDSPEAKER, HWA_I2S, mVoiceVolume);
+			HWA_AudioDeviceEnable(HWA_LOUD_MIC, HWA_I2S, 100);
+                }
+                else 
+                {
+			HWA_AudioDeviceDisable(HWA_LOUDSPEAKER, HWA_I2S);
+			HWA_AudioDeviceDisable(HWA_LOUD_MIC, HWA_I2S);
+                }
+            }
+
+            if(devices & AudioSystem::DEVICE_OUT_SPEAKER)
+            {
+                if(on)
+                {
+			HWA_AudioDeviceEnable(HWA_LOUDSPEAKER, HWA_I2S, mVoiceVolume);
+			HWA_AudioDeviceEnable(HWA_LOUD_MIC, HWA_I2S, 100);
+                }
+                else 
+                {
+			HWA_AudioDeviceDisable(HWA_LOUDSPEAKER, HWA_I2S);
+			HWA_AudioDeviceDisable(HWA_LOUD_MIC, HWA_I2S);
+                }
+            }
+
+            if(devices & (AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_HEADSET |
+                          AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_HEADSET |
+                          AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_CARKIT))
+            {
+                if(on) 
+                {
+                }
+                else 
+                {
+                }
+            }
+
+            if(devices & AudioSystem::DEVICE_OUT_WIRED_HEADSET)
+            {
+                if(on)
+                {   
+			HWA_AudioDeviceEnable(HWA_HP_SPEAKER, HWA_I2S, mVoiceVolume);
+			HWA_AudioDeviceEnable(HWA_HP_MIC, HWA_I2S, 100);
+                }
+                else
+                {
+			HWA_AudioDeviceDisable(HWA_HP_SPEAKER, HWA_I2S);
+			HWA_AudioDeviceDisable(HWA_HP_MIC, HWA_I2S);
+                }
+            }
+            
+            // headphones have no mic, the call uses the internal one
+            if(devices & AudioSystem::DEVICE_OUT_WIRED_HEADPHONE)
+            {
+                if(on)
+                {
+			HWA_AudioDeviceEnable(HWA_HP_SPEAKER, HWA_I2S, mVoiceVolume);
+			HWA_AudioDeviceEnable(HWA_LOUD_MIC, HWA_I2S, 100);
+                }
+                else
+                {
+			HWA_AudioDeviceDisable(HWA_HP_SPEAKER, HWA_I2S);
+			HWA_AudioDeviceDisable(HWA_LOUD_MIC, HWA_I2S);
+                }
+            }
+        }
+        break;
+    }
+
+    HWA_Commit();
+
+end:
+    return NO_ERROR;
+}
+
+status_t AudioHardware::updateAudioDevices(AudioStreamInASTER* input)
+{
+    AutoMutex lock(mLock);
+
+    return updateAudioDevices_l(input);
+}
+
+status_t AudioHardware::updateAudioDevices_l(AudioStreamInASTER* input)
+{
+    int doMode = mMode;
+    uint32_t doDevices = 0x0;
+
+    if (mOutput)
+    {
+        doDevices = mOutput->devices();
+    }
+
+    if (mDirectOutput)
+    {
+        doDevices |= mDirectOutput->devices();
+    }
+
+    if (mDeepBufferOutput)
+    {
+        doDevices |= mDeepBufferOutput->devices();
+    }
+
+    if (0x0 == mCurDevices && false == mFirstEnableDevice)
+    {
+	mFirstEnableDevice = true;
+    	mCurDevices = doDevices;
+	return NO_ERROR;
+    }
+
+
+    if(input)
+    {
+        doDevices |= input->devices();
+    }
+
+    LOGI("updateAudioDevices: Current Mode: %d, Current Device: 0x%x, new Mode: %d, new Device: 0x%x",
+                                                            mCurMode, mCurDevices, doMode, doDevices);
+
+    if ((mCurMode != AudioSystem::MODE_IN_CALL) && (doMode == AudioSystem::MODE_IN_CALL))
+    {
+        mMicMute = false; // MIC is unmute at the beginning of voice call
+    }
+    else if ((mCurMode == AudioSystem::MODE_IN_CALL) && (doMode != AudioSystem::MODE_IN_CALL))
+    {
+        mMicMute = false; // MIC is unmute at the end of voice call
+    }
+
+    /*2010-11-19-Nathan:don't enable the same devices when voice call recording.*/
+    if (mCurMode == AudioSystem::MODE_IN_CALL && 
+        doMode == AudioSystem::MODE_IN_CALL &&
+        doDevices & mCurDevices)
+    {
+        LOGI("updateAudioDevices: Don't enable the same devices when voice call recording");
+        mCurDevices = doDevices;
+        return NO_ERROR;
+    }
+
+    HWA_WaitReady();
+
+    // Disable and enable are one HWA transaction, so paths shared by the
+    // old and new routing are never toggled
+    HWA_Begin();
+
+    //Disable current audio routing
+    switch(mCurMode)
+    {
+        case AudioSystem::MODE_NORMAL:
+        case AudioSystem::MODE_RINGTONE:
+            {
+                setModeAndDevices_l(0, mCurMode, mCurDevices);
+            }
+            break;
+
+        case AudioSystem::MODE_IN_CALL:
+            {
+                setModeAndDevices_l(0, mCurMode, mCurDevices);
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    //Enable audio routing
+    switch(doMode)
+    {
+        case AudioSystem::MODE_NORMAL:
+        case AudioSystem::MODE_RINGTONE:
+            {
+                setModeAndDevices_l(1, doMode, doDevices);
+            }
+            break;
+
+        case AudioSystem::MODE_IN_CALL:
+            {
+                setModeAndDevices_l(1, doMode, doDevices);
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    HWA_Commit();
+
+    mCurMode = doMode;
+    mCurDevices = doDevices;
+
+    // retry a voice engine that did not start with the call
+    startVoiceEngine_l();
+
+    LOGI("updateAudioDevices: return");
+
+    return NO_ERROR;
+}
+
+status_t AudioHardware::dump(int fd, const Vector<String16>& args) 
+{ 
+    if (mInput) 
+    { 
+        mInput->dump(fd, args); 
+    }
+
+    if (mOutput) 
+    { 
+        mOutput->dump(fd, args); 
+    } 
+
+    if (mDirectOutput) 
+    { 
+        mDirectOutput->dump(fd, args); 
+    } 
+
+    if (mDeepBufferOutput) 
+    { 
+        mDeepBufferOutput->dump(fd, args); 
+    } 
+
+    if (mA2dpOutput) 
+    { 
+        mA2dpOutput->dump(fd, args); 
+    } 
+
+    return NO_ERROR; 
+} 
+
+int AudioHardware::getCurMode(void)
+{
+    return mCurMode;
+}
+
+uint32_t AudioHardware::getCurDevices(void)
+{
+    return mCurDevices;
+}
+
+AudioStreamInASTER* AudioHardware::getInputStream(void)
+{
+    return mInput;
+}
+
+status_t AudioHardware::setOutputDevices(uint32_t devices)
+{
+    AutoMutex lock(mLock);
+
+    AudioStreamOutASTER *outputs[] = { mOutput, mDirectOutput, mDeepBufferOutput };
+    for (size_t i = 0; i < sizeof(outputs) / sizeof(outputs[0]); i++)
+    {
+        if (outputs[i])
+        {
+            outputs[i]->setDevices(devices);
+        }
+    }
+
+    LOGI_IF(mInput, "setOutputDevices: Has input streaming, will merge the input devices to output devices");
+    return updateAudioDevices_l(mInput);
+}
+
+void AudioHardware::releaseStreamPcms()
+{
+    // closeOutputStream() and closeInputStream() wait, the streams stay valid
+    // without mLock
+    AutoMutex releaseLock(mReleaseLock);
+    AudioStreamOutASTER *outputs[3];
+    AudioStreamInASTER *input;
+
+    {
+        AutoMutex lock(mLock);
+
+        outputs[0] = mOutput;
+        outputs[1] = mDirectOutput;
+        outputs[2] = mDeepBufferOutput;
+        input = mInput;
+    }
+
+    for (size_t i = 0; i < sizeof(outputs) / sizeof(outputs[0]); i++)
+    {
+        if (outputs[i])
+        {
+            outputs[i]->releasePcm();
+        }
+    }
+
+    // a recording keeps the codec capture the engine opens
+    if (input)
+    {
+        input->releasePcm();
+    }
+}
+
+sp<AudioVoiceEngine> AudioHardware::getVoiceEngine()
+{
+    AutoMutex lock(mLock);
+
+    return mVoiceEngine;
+}
+
+// with mLock held, a start that fails is retried on the next routing change
+void AudioHardware::startVoiceEngine_l()
+{
+    if (!mVoiceCall || mVoiceEngine != 0)
+    {
+        return;
+    }
+
+    mVoiceEngine = new AudioVoiceEngine();
+    mVoiceEngine->setVolume(mVoiceVolume);
+    mVoiceEngine->setMicMute(mMicMute);
+
+    if (mVoiceEngine->start() == NO_ERROR)
+    {
+        updateCodecPower(true);
+    }
+    else
+    {
+        LOGE("startVoiceEngine: voice engine did not start");
+        mVoiceEngine.clear();
+    }
+}
+
+status_t AudioHardware::startDuplex(AudioStreamOutASTER* out)
+{
+    return startDuplex(DUPLEX_OUT, out->alsaHandle());
+}
+
+status_t AudioHardware::startDuplex(AudioStreamInASTER* in)
+{
+    return startDuplex(DUPLEX_IN, in->alsaHandle());
+}
+
+// the caller holds the pcmLock() of the stream owning pcm
+status_t AudioHardware::startDuplex(int user, ALSAHandle *pcm)
+{
+    {
+        AutoMutex lock(mLock);
+
+        // left open by a pair stopped while the stream was busy
+        if (!mDuplexRunning && (pcm == mDuplexPlay || pcm == mDuplexRec))
+        {
+            closeDuplexPcm_l(pcm);
+        }
+
+        if (mDuplexRunning)
+        {
+            if (pcm != mDuplexPlay && pcm != mDuplexRec)
+            {
+                return INVALID_OPERATION;
+            }
+
+            mDuplexUsers |= user;
+            return NO_ERROR;
+        }
+
+        if (!mDuplexMode || mVoiceCall || mOutput == NULL || mInput == NULL
+            || mDuplexPlay != NULL || mDuplexRec != NULL)
+        {
+            return INVALID_OPERATION;
+        }
+
+        ALSAHandle *play = mOutput->alsaHandle();
+        ALSAHandle *rec = mInput->alsaHandle();
+
+        // only the primary output takes part in the duplex pair
+        if (pcm != (user == DUPLEX_OUT ? play : rec))
+        {
+            return INVALID_OPERATION;
+        }
+
+        // the other stream locks itself before mLock, so it is only tried;
+        // a stream busy in its own read or write keeps the pair from starting
+        Mutex &otherLock = (user == DUPLEX_OUT) ? mInput->pcmLock() : mOutput->pcmLock();
+
+        if (otherLock.tryLock() != NO_ERROR)
+        {
+            return INVALID_OPERATION;
+        }
+
+        // a stream already running on its own keeps its PCM
+        if (play->status() != ALSAHandle::ALSA_NULL || rec->status() != ALSAHandle::ALSA_NULL
+            || mOutput->sampleRate() != mInput->sampleRate())
+        {
+            otherLock.unlock();
+            return INVALID_OPERATION;
+        }
+
+        if (play->open(ALSAHandle::ALSA_STEREO_OUT) != NO_ERROR
+            || play->setHwParams(SND_PCM_FORMAT_S16_LE, mOutput->channelCount(),
+                                 mOutput->sampleRate(), (snd_pcm_uframes_t)mOutput->periodSize()) != NO_ERROR
+            || play->setSwParams(ALSAHandle::SW_DUPLEX_PLAY) < 0
+            || rec->open(ALSAHandle::ALSA_MONO_IN) != NO_ERROR
+            || rec->setHwParams(SND_PCM_FORMAT_S16_LE, mInput->channelCount(),
+                                mInput->sampleRate(), (snd_pcm_uframes_t)mInput->periodSize()) != NO_ERROR
+            || rec->setSwParams(ALSAHandle::SW_DUPLEX_RECORD) < 0
+            || play->rate() != rec->rate()
+            || play->link(rec) != NO_ERROR
+            || play->prefill(mOutput->periodSize() * 2) != NO_ERROR
+            || play->start() != NO_ERROR)
+        {
+            LOGE("startDuplex: could not start linked PCMs, streams run standalone");
+            rec->close();
+            play->close();
+            otherLock.unlock();
+            return INVALID_OPERATION;
+        }
+
+        mDuplexRunning = true;
+        mDuplexUsers = user;
+        mDuplexPlay = play;
+        mDuplexRec = rec;
+
+        LOGI("startDuplex: round trip latency %u ms", measureDuplexLatency_l());
+        otherLock.unlock();
+
+        updateCodecPower(true);
+        setModeAndDevices_l(1, mCurMode, mOutput->devices() | mInput->devices());
+    }
+
+    return NO_ERROR;
+}
+
+// the caller holds the pcmLock() of the stream owning pcm
+bool AudioHardware::stopDuplex(ALSAHandle *pcm)
 {
-    AudioParameter param = AudioParameter(keyValuePairs);
-    status_t status = NO_ERROR;
-    String8 values;
-    const  char *value_t;
+    AutoMutex lock(mLock);
 
-    if (keyValuePairs.length() == 0) 
-        return BAD_VALUE;
+    if (pcm == NULL || (pcm != mDuplexPlay && pcm != mDuplexRec))
+    {
+        return false;
+    }
 
-    LOGI("setParameters: %s", keyValuePairs.string());
+    mDuplexUsers &= ~(pcm == mDuplexPlay ? DUPLEX_OUT : DUPLEX_IN);
 
-    return status;
+    if (!mDuplexRunning)
+    {
+        closeDuplexPcm_l(pcm);
+    }
+    else if (mDuplexUsers == 0)
+    {
+        stopDuplex_l(pcm);
+    }
+
+    return true;
 }
 
-String8 AudioHardware::getParameters(const String8& keys)
+// Stops the pair and closes the PCMs it can lock. A stream busy in its read
+// or write keeps its PCM until its next startDuplex() or stopDuplex().
+void AudioHardware::stopDuplex_l(ALSAHandle *own)
 {
-    AudioParameter param = AudioParameter(keys);
+    if (mDuplexRunning)
+    {
+        LOGI("stopDuplex: closing linked PCMs");
 
-    LOGI("getParameters: %s", param.toString().string());
-    return param.toString();
+        mDuplexRunning = false;
+        mDuplexUsers = 0;
+    }
+
+    ALSAHandle *pcms[] = { mDuplexPlay, mDuplexRec };
+    for (size_t i = 0; i < sizeof(pcms) / sizeof(pcms[0]); i++)
+    {
+        Mutex *streamLock = NULL;
+
+        if (pcms[i] == NULL)
+        {
+            continue;
+        }
+
+        if (pcms[i] == own)
+        {
+            closeDuplexPcm_l(pcms[i]);
+            continue;
+        }
+
+        if (mOutput && mOutput->alsaHandle() == pcms[i])
+        {
+            streamLock = &mOutput->pcmLock();
+        }
+        else if (mInput && mInput->alsaHandle() == pcms[i])
+        {
+            streamLock = &mInput->pcmLock();
+        }
+
+        if (streamLock && streamLock->tryLock() == NO_ERROR)
+        {
+            closeDuplexPcm_l(pcms[i]);
+            streamLock->unlock();
+        }
+    }
 }
 
-status_t AudioHardware::setModeAndDevices(int on, int mode, uint32_t devices)
+void AudioHardware::closeDuplexPcm_l(ALSAHandle *pcm)
 {
-    LOGI("setModeAndDevices: on: %d, mode: %d, devices: 0x%x",on, mode, devices);
+    pcm->close();
 
-    if(0x0 == devices)
+    if (pcm == mDuplexPlay)
     {
-        goto end;
+        mDuplexPlay = NULL;
+    }
+    else if (pcm == mDuplexRec)
+    {
+        mDuplexRec = NULL;
     }
 
-    switch(mode)
+    // the pair holds one codec power reference
+    if (mDuplexPlay == NULL && mDuplexRec == NULL)
     {
-        case AudioSystem::MODE_NORMAL:
-        case AudioSystem::MODE_RINGTONE:
+        updateCodecPower(false);
+    }
+}
+
+uint32_t AudioHardware::measureDuplexLatency_l()
+{
+    snd_pcm_sframes_t playDelay = 0, recDelay = 0;
+    struct timespec playStamp, recStamp;
+
+    if (mOutput->alsaHandle()->getDelay(&playDelay, &playStamp) != NO_ERROR
+        || mInput->alsaHandle()->getDelay(&recDelay, &recStamp) != NO_ERROR)
+    {
+        return mDuplexLatency;
+    }
+
+    unsigned int rate = mOutput->alsaHandle()->rate();
+
+    // Frames queued for the DAC plus frames captured and not read yet, with
+    // the capture delay moved back to the playback snapshot time. Both stamps
+    // come from the kernel clock the linked trigger started from.
+    int64_t ns = (int64_t)(recStamp.tv_sec - playStamp.tv_sec) * 1000000000LL
+                 + (recStamp.tv_nsec - playStamp.tv_nsec);
+    int64_t frames = (int64_t)playDelay + recDelay - ns * rate / 1000000000LL;
+
+    mDuplexLatency = frames > 0 ? (uint32_t)(frames * 1000 / rate) : 0;
+
+    return mDuplexLatency;
+}
+
+void AudioHardware::updateCodecPower(bool streamActive)
+{
+    AutoMutex lock(mPowerLock);
+
+    HWA_WaitReady();
+
+    if (streamActive)
+    {
+        if (mActiveStreams++ == 0)
         {
-            if(devices & AudioSystem::DEVICE_IN_BUILTIN_MIC || devices & AudioSystem::DEVICE_IN_AMBIENT)
-            {
-                if(on)
-                {
-			HWA_AudioDeviceEnable(HWA_LOUD_MIC, HWA_I2S, 100);
-                }
-                else
-                {
-			HWA_AudioDeviceDisable(HWA_LOUD_MIC, HWA_I2S);
-                }
-            }
-           
-            if (devices & AudioSystem::DEVICE_OUT_EARPIECE) 
-            {
-                if(on)
-                {
-			HWA_AudioDeviceEnable(HWA_LOUDSPEAKER, HWA_I2S, 100);
-                }
-                else
-                {
-			HWA_AudioDeviceDisable(HWA_LOUDSPEAKER, HWA_I2S);
-                }
-            }
+            HWA_SetPowerMode(SGTL5000_COMPONENT, HWA_POWER_AWAKE);
+        }
+    }
+    else if (mActiveStreams > 0)
+    {
+        if (--mActiveStreams == 0)
+        {
+            HWA_SetPowerMode(SGTL5000_COMPONENT, HWA_POWER_ASLEEP);
+        }
+    }
+}
 
-            if(devices & AudioSystem::DEVICE_OUT_SPEAKER)
-            {
-                if(on)
-                {
-			HWA_AudioDeviceEnable(HWA_LOUDSPEAKER, HWA_I2S, 100);
-                }
-                else
-                {
-			HWA_AudioDeviceDisable(HWA_LOUDSPEAKER, HWA_I2S);
-                }
-            }
+void AudioHardware::jackChanged(int state)
+{
+    AutoMutex lock(mLock);
 
-            if(devices & AudioSystem::DEVICE_IN_BLUETOOTH_SCO_HEADSET)
-            {
-                if(on)
-                {
-                }
-                else
-                {
-                }
-            }
-                        
-            if(devices & AudioSystem::DEVICE_IN_WIRED_HEADSET)
-            {
-                if(on)
-                {
-			HWA_AudioDeviceEnable(HWA_HP_MIC, HWA_I2S, 100);
-                }
-                else
-                {
-			HWA_AudioDeviceDisable(HWA_HP_MIC, HWA_I2S);
-                }
-            }
+    const uint32_t codecOut = AudioSystem::DEVICE_OUT_EARPIECE | AudioSystem::DEVICE_OUT_SPEAKER |
+                              AudioSystem::DEVICE_OUT_WIRED_HEADSET | AudioSystem::DEVICE_OUT_WIRED_HEADPHONE;
+    const uint32_t wired = AudioSystem::DEVICE_OUT_WIRED_HEADSET | AudioSystem::DEVICE_OUT_WIRED_HEADPHONE;
+    uint32_t headset = 0;
+    uint32_t newDevices;
 
-            if(devices & (AudioSystem::DEVICE_OUT_WIRED_HEADSET | AudioSystem::DEVICE_OUT_WIRED_HEADPHONE))
-            {
-                if(on)
-                {
-			HWA_AudioDeviceEnable(HWA_HP_SPEAKER, HWA_I2S, 100);
-                }
-                else
-                {
-			HWA_AudioDeviceDisable(HWA_HP_SPEAKER, HWA_I2S);
-                }
-            }
+    if (state == 1)
+    {
+        headset = AudioSystem::DEVICE_OUT_WIRED_HEADSET;
+    }
+    else if (state == 2)
+    {
+        headset = AudioSystem::DEVICE_OUT_WIRED_HEADPHONE;
+    }
 
-        }            
-        break;
-        //reserve for PAD call feature 
-        case AudioSystem::MODE_IN_CALL:
+    // nothing on the codec, A2DP and SCO routing are left to the framework
+    if (!(mCurDevices & codecOut))
+    {
+        return;
+    }
+
+    // Plugged: the headset replaces the speaker at once. Unplugged: the
+    // headset path goes off and the speaker stays silent until the
+    // framework decides where audio goes.
+    newDevices = headset ? ((mCurDevices & ~codecOut) | headset) : (mCurDevices & ~wired);
+
+    if (newDevices == mCurDevices)
+    {
+        return;
+    }
+
+    LOGI("jackChanged: state %d, devices 0x%x -> 0x%x", state, mCurDevices, newDevices);
+
+    HWA_WaitReady();
+
+    HWA_Begin();
+    setModeAndDevices_l(0, mCurMode, mCurDevices);
+    setModeAndDevices_l(1, mCurMode, newDevices);
+    HWA_Commit();
+
+    mCurDevices = newDevices;
+
+    // the routing request that follows finds the outputs already there
+    AudioStreamOutASTER *outputs[] = { mOutput, mDirectOutput, mDeepBufferOutput };
+    for (size_t i = 0; i < sizeof(outputs) / sizeof(outputs[0]); i++)
+    {
+        if (outputs[i] && (outputs[i]->devices() & codecOut))
         {
-            if(devices & AudioSystem::DEVICE_OUT_EARPIECE)
-            {
-                if(on) 
-                {
-                }
-                else 
-                {
-                }
-            }
+            outputs[i]->setDevices(headset ? ((outputs[i]->devices() & ~codecOut) | headset)
+                                           : (outputs[i]->devices() & ~wired));
+        }
+    }
+}
 
-            if(devices & AudioSystem::DEVICE_OUT_SPEAKER)
-            {
-                if(on)
-                {
-                }
-                else 
-                {
-                }
-            }
+// ----------------------------------------------------------------------------
+// headset jack monitor
 
-            if(devices & (AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_HEADSET |
-                          AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_HEADSET |
-                          AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_CARKIT))
-            {
-                if(on) 
-                {
-                }
-                else 
-                {
-                }
-            }
+#define H2W_SWITCH_STATE    "/sys/class/switch/h2w/state"
+#define H2W_POLL_MS         200
 
-            if(devices & AudioSystem::DEVICE_OUT_WIRED_HEADSET)
-            {
-                if(on)
-                {   
-                }
-                else
-                {
-                }
-            }
-            
-            if(devices & AudioSystem::DEVICE_OUT_WIRED_HEADPHONE)
-            {
-                if(on)
-                {
-                }
-                else
-                {
-                }
-            }
+AudioJackMonitor::AudioJackMonitor(AudioHardware *hw)
+    : Thread(false)
+{
+    mAudioHardware = hw;
+    mSocket = -1;
+    mWakePipe[0] = mWakePipe[1] = -1;
+    mState = -1;
+}
+
+AudioJackMonitor::~AudioJackMonitor()
+{
+    if (mSocket >= 0)
+    {
+        ::close(mSocket);
+    }
+
+    if (mWakePipe[0] >= 0)
+    {
+        ::close(mWakePipe[0]);
+        ::close(mWakePipe[1]);
+    }
+}
+
+void AudioJackMonitor::stop()
+{
+    requestExit();
+
+    if (mWakePipe[1] >= 0)
+    {
+        char c = 0;
+        ::write(mWakePipe[1], &c, 1);
+    }
+
+    requestExitAndWait();
+}
+
+int AudioJackMonitor::readSwitchState()
+{
+    char value[8];
+    int fd = ::open(H2W_SWITCH_STATE, O_RDONLY);
+    ssize_t len;
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    len = ::read(fd, value, sizeof(value) - 1);
+    ::close(fd);
+
+    if (len <= 0)
+    {
+        return -1;
+    }
+
+    value[len] = 0;
+
+    return atoi(value);
+}
+
+status_t AudioJackMonitor::readyToRun()
+{
+    struct sockaddr_nl addr;
+
+    if (pipe(mWakePipe) < 0)
+    {
+        mWakePipe[0] = mWakePipe[1] = -1;
+    }
+
+    // the framework reacts to the current state itself
+    mState = readSwitchState();
+
+    mSocket = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+    if (mSocket >= 0)
+    {
+        memset(&addr, 0, sizeof(addr));
+        addr.nl_family = AF_NETLINK;
+        addr.nl_pid = 0;    // let the kernel pick, the framework has getpid()
+        addr.nl_groups = 0xffffffff;
+
+        if (bind(mSocket, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            ::close(mSocket);
+            mSocket = -1;
         }
-        break;
     }
 
-end:
+    if (mSocket < 0)
+    {
+        LOGW("AudioJackMonitor: no uevent socket, polling %s", H2W_SWITCH_STATE);
+    }
+
     return NO_ERROR;
 }
 
-status_t AudioHardware::updateAudioDevices(AudioStreamInASTER* input)
+bool AudioJackMonitor::threadLoop()
 {
-    int doMode = mMode;
-    uint32_t doDevices = 0x0;
-
-    doDevices = mOutput->devices();
+    struct pollfd fds[2];
+    int nfds = 0;
+    int state = mState;
 
-    if (0x0 == mCurDevices && false == mFirstEnableDevice)
+    if (mSocket >= 0)
     {
-	mFirstEnableDevice = true;
-    	mCurDevices = doDevices;
-	return NO_ERROR;
+        fds[nfds].fd = mSocket;
+        fds[nfds].events = POLLIN;
+        nfds++;
     }
 
-
-    if(input)
+    if (mWakePipe[0] >= 0)
     {
-        doDevices |= input->devices();
+        fds[nfds].fd = mWakePipe[0];
+        fds[nfds].events = POLLIN;
+        nfds++;
     }
 
-    LOGI("updateAudioDevices: Current Mode: %d, Current Device: 0x%x, new Mode: %d, new Device: 0x%x",
-                                                            mCurMode, mCurDevices, doMode, doDevices);
+    int ret = poll(fds, nfds, (mSocket >= 0) ? -1 : H2W_POLL_MS);
 
-    if ((mCurMode != AudioSystem::MODE_IN_CALL) && (doMode == AudioSystem::MODE_IN_CALL))
+    if (exitPending())
     {
-        mMicMute = false; // MIC is unmute at the beginning of voice call
+        return false;
     }
-    else if ((mCurMode == AudioSystem::MODE_IN_CALL) && (doMode != AudioSystem::MODE_IN_CALL))
+
+    if (ret < 0)
     {
-        mMicMute = false; // MIC is unmute at the end of voice call
+        return true;
     }
 
-    /*2010-11-19-Nathan:don't enable the same devices when voice call recording.*/
-    if (mCurMode == AudioSystem::MODE_IN_CALL && 
-        doMode == AudioSystem::MODE_IN_CALL &&
-        doDevices & mCurDevices)
+    if (mSocket < 0)
     {
-        LOGI("updateAudioDevices: Don't enable the same devices when voice call recording");
-        mCurDevices = doDevices;
-        return NO_ERROR;
+        state = readSwitchState();
     }
-
-    //Disable current audio routing
-    switch(mCurMode)
+    else if (fds[0].revents & POLLIN)
     {
-        case AudioSystem::MODE_NORMAL:
-        case AudioSystem::MODE_RINGTONE:
-            {
-                setModeAndDevices(0, mCurMode, mCurDevices);
-            }
-            break;
+        char buffer[1024];
+        ssize_t len = recv(mSocket, buffer, sizeof(buffer) - 1, 0);
+        bool h2w = false;
+        int switchState = -1;
 
-        case AudioSystem::MODE_IN_CALL:
-            {
-                setModeAndDevices(0, mCurMode, mCurDevices);
-            }
-            break;
+        if (len <= 0)
+        {
+            return true;
+        }
 
-        default:
-            break;
-    }
+        buffer[len] = 0;
 
-    //Enable audio routing
-    switch(doMode)
-    {
-        case AudioSystem::MODE_NORMAL:
-        case AudioSystem::MODE_RINGTONE:
+        // "action@path" followed by NUL separated KEY=value pairs
+        for (char *s = buffer; s < buffer + len; s += strlen(s) + 1)
+        {
+            if (!strcmp(s, "SWITCH_NAME=h2w"))
             {
-                setModeAndDevices(1, doMode, doDevices);
+                h2w = true;
             }
-            break;
-
-        case AudioSystem::MODE_IN_CALL:
+            else if (!strncmp(s, "SWITCH_STATE=", 13))
             {
-                setModeAndDevices(1, doMode, doDevices);
+                switchState = atoi(s + 13);
             }
-            break;
+        }
 
-        default:
-            break;
+        if (h2w && switchState >= 0)
+        {
+            state = switchState;
+        }
     }
 
-    mCurMode = doMode;
-    mCurDevices = doDevices;
-
-    LOGI("updateAudioDevices: return");
-
-    return NO_ERROR;
-}
-
-status_t AudioHardware::dump(int fd, const Vector<String16>& args) 
-{ 
-    if (mInput) 
-    { 
-        mInput->dump(fd, args); 
+    if (state >= 0 && state != mState)
+    {
+        mState = state;
+        mAudioHardware->jackChanged(state);
     }
 
-    if (mOutput) 
-    { 
-        mOutput->dump(fd, args); 
-    } 
-
-    return NO_ERROR; 
-} 
-
-int AudioHardware::getCurMode(void)
-{
-    return mCurMode;
-}
-
-uint32_t AudioHardware::getCurDevices(void)
-{
-    return mCurDevices;
-}
-
-AudioStreamInASTER* AudioHardware::getInputStream(void)
-{
-    return mInput;
+    return true;
 }
 
 // ----------------------------------------------------------------------------
-AudioStreamOutASTER::AudioStreamOutASTER()
+AudioStreamOutASTER::AudioStreamOutASTER(bool deepBuffer)
 {
+    mDeepBuffer = deepBuffer;
     mSampleRate = 44100;
     mBufferSize = 6144;
     mChannels = AudioSystem::CHANNEL_OUT_STEREO;
@@ -1210,10 +3020,8 @@ status_t AudioStreamOutASTER::setParameters(const String8& keyValuePairs)
             return status;
         }
 		
-        mDevices = device;
-        LOGI("AudioStreamOutASTER: set AudioStreamOut Device 0x%x", mDevices);
-        LOGI_IF( mAudioHardware->getInputStream(), "AudioStreamOutASTER: Has input streaming, will merge the input devices to output devices");
-        status = mAudioHardware->getInputStream() ? mAudioHardware->updateAudioDevices(mAudioHardware->getInputStream()) : mAudioHardware->updateAudioDevices(NULL);
+        LOGI("AudioStreamOutASTER: set AudioStreamOut Device 0x%x", device);
+        status = mAudioHardware->setOutputDevices(device);
 	    param.remove(key);
     }
 
@@ -1272,6 +3080,19 @@ status_t AudioStreamOutASTER::set(
         lRate = sampleRate();
     }
 
+    // any rate/channel count the codec runs natively is accepted, the PCM is
+    // configured for it when the stream leaves standby
+    int lChannelCounts = AudioSystem::popCount(lChannels);
+
+    if ((lChannels & ~(uint32_t)AudioSystem::CHANNEL_OUT_STEREO) == 0 &&
+        isOutFormatSupported(lFormat) &&
+        isOutChannelsSupported(lChannelCounts) &&
+        isOutSampleRateSupported(lRate))
+    {
+        mSampleRate = lRate;
+        mChannels = lChannels;
+    }
+
     // check values
     if ((lFormat != format()) || (lChannels != channels()) || (lRate != sampleRate())) 
     {
@@ -1316,6 +3137,8 @@ status_t AudioStreamOutASTER::set(
     {
         mChannelCounts = 1;
     }
+
+    mBufferSize = periodSize() * mChannelCounts * sizeof(int16_t);
  
     LOGI("AudioStreamOutASTER: set() devices = 0x%x , format = %d, channels = 0x%x , rate = %d, channelcounts = %d",
                                                             (int)devices, lFormat, lChannels, lRate, mChannelCounts);
@@ -1343,6 +3166,7 @@ uint32_t AudioStreamOutASTER::channels() const
 
 ssize_t AudioStreamOutASTER::write(const void* buffer, size_t bytes)
 {
+    AutoMutex lock(mLock);
     int         mode;
 
     if (mAudioHardware == NULL)
@@ -1352,7 +3176,7 @@ ssize_t AudioStreamOutASTER::write(const void* buffer, size_t bytes)
 
     mode = mAudioHardware->getCurMode();
 
-    if (mode == AudioSystem::MODE_IN_CALL)
+    if (mode == AudioSystem::MODE_IN_CALL || mAudioHardware->isVoiceCall())
     {
         usleep(bytes * 1000000 / sizeof(int16_t) / mChannelCounts / sampleRate());
         return bytes;
@@ -1368,89 +3192,349 @@ ssize_t AudioStreamOutASTER::write(const void* buffer, size_t bytes)
     }
     else
     {
-        if (mAlsaHandle->status() != ALSAHandle::ALSA_STEREO_OUT 
-            && mAlsaHandle->status() != ALSAHandle::ALSA_NULL)
-        {
-            this->standby();
-        }
+        if (mAlsaHandle->status() != ALSAHandle::ALSA_STEREO_OUT 
+            && mAlsaHandle->status() != ALSAHandle::ALSA_NULL)
+        {
+            this->standby_l();
+        }
+
+        if (mAudioHardware->isDuplexMode() && mAudioHardware->startDuplex(this) == NO_ERROR)
+        {
+            // playback and capture run from the linked pair
+        }
+        else if (mAlsaHandle->status() == ALSAHandle::ALSA_NULL)
+        {
+            if (mAlsaHandle->open(ALSAHandle::ALSA_STEREO_OUT) != NO_ERROR
+                || mAlsaHandle->setHwParams(SND_PCM_FORMAT_S16_LE, mChannelCounts, sampleRate(), (snd_pcm_uframes_t)this->periodSize()) != NO_ERROR
+                || mAlsaHandle->setSwParams(ALSAHandle::SW_PLAY) < 0)
+            {
+                // the codec is only counted awake for an open PCM
+                mAlsaHandle->close();
+            }
+
+            if (mAlsaHandle->status() != ALSAHandle::ALSA_NULL)
+            {
+                mAudioHardware->updateCodecPower(true);
+                mAudioHardware->setModeAndDevices(1, mode, devices());
+                usleep(200000);
+            }
+        }
+
+        if (mAlsaHandle->status() != ALSAHandle::ALSA_NULL)
+        {
+            mAlsaHandle->write(buffer, bytes);
+            mFrameCount += bytes;
+        }
+
+        return bytes;
+    } 
+    return -1;
+}
+
+status_t AudioStreamOutASTER::standby()
+{
+    AutoMutex lock(mLock);
+    return standby_l();
+}
+
+void AudioStreamOutASTER::releasePcm()
+{
+    AutoMutex lock(mLock);
+
+    if (mAlsaHandle && mAlsaHandle->status() != ALSAHandle::ALSA_NULL)
+    {
+        LOGI("AudioStreamOutASTER: release PCM to the voice engine");
+        closePcm();
+    }
+}
+
+// with mLock held, a PCM of the duplex pair is closed by AudioHardware once
+// the pair stops
+void AudioStreamOutASTER::closePcm()
+{
+    if (mAudioHardware && mAudioHardware->stopDuplex(mAlsaHandle))
+    {
+        // the pair closes when the input stops too
+    }
+    else if (mAlsaHandle)
+    {
+        if (mAlsaHandle->status() != ALSAHandle::ALSA_NULL)
+        {
+            mAlsaHandle->close();
+            mAudioHardware->updateCodecPower(false);
+        }
+    }
+}
+
+status_t AudioStreamOutASTER::standby_l()
+{
+    LOGD("AudioStreamOutASTER: standby");
+    int mode = 0;
+    
+    if(!mAudioHardware->getInputStream())
+    {
+    	if (mAudioHardware)
+    	{
+        	mode = mAudioHardware->getCurMode();
+
+        	if (mode != AudioSystem::MODE_IN_CALL)
+        	{
+            		mAudioHardware->setModeAndDevices(0, mode, devices());
+        	}
+    	}
+    }
+
+    closePcm();
+    
+    mFrameCount = 0;
+
+    return NO_ERROR;
+}
+
+// return the number of audio frames written by the audio dsp to DAC since
+// the output has exited standby
+status_t AudioStreamOutASTER::getRenderPosition(uint32_t *dspFrames)
+{
+    *dspFrames = mFrameCount;
+    return NO_ERROR;
+}
+
+status_t AudioStreamOutASTER::dump(int fd, const Vector<String16>& args) 
+{ 
+    const size_t SIZE = 256; 
+    char buffer[SIZE]; 
+    String8 result; 
+    snprintf(buffer, SIZE, "AudioStreamOutASTER::dump\n"); 
+    result.append(buffer); 
+    snprintf(buffer, SIZE, "\tsample rate: %d\n", sampleRate()); 
+    result.append(buffer); 
+    snprintf(buffer, SIZE, "\tbuffer size: %d\n", bufferSize()); 
+    result.append(buffer); 
+    snprintf(buffer, SIZE, "\tchannel count: %d\n", mChannelCounts); 
+    result.append(buffer); 
+    snprintf(buffer, SIZE, "\tformat: %d\n", format()); 
+    result.append(buffer); 
+    snprintf(buffer, SIZE, "\tmAudioHardware: %p\n", mAudioHardware); 
+    result.append(buffer); 
+    snprintf(buffer, SIZE, "\txrun recoveries: %u, last %u us, max %u us\n", mAlsaHandle->recoveryStats().count,
+             mAlsaHandle->recoveryStats().lastUs, mAlsaHandle->recoveryStats().maxUs); 
+    result.append(buffer); 
+    ::write(fd, result.string(), result.size()); 
+    return NO_ERROR; 
+} 
+
+// ----------------------------------------------------------------------------
+// capture preprocessing
+
+// DC blocker pole, 0.995 in Q15
+#define DC_BLOCK_POLE     32604
+// AGC: peak level aimed for, -12 dBFS, and gain range, 0.5x to 16x in Q12
+#define AGC_TARGET        8192
+#define AGC_MIN_GAIN      2048
+#define AGC_MAX_GAIN      65536
+// blocks quieter than this are noise, the gain is held
+#define AGC_NOISE_FLOOR   64
+
+static inline int16_t clamp16(int32_t sample)
+{
+    if (sample > 32767)
+    {
+        return 32767;
+    }
+    if (sample < -32768)
+    {
+        return -32768;
+    }
+    return (int16_t)sample;
+}
+
+CapturePreprocessor::CapturePreprocessor()
+{
+    mRate = 8000;
+    mChannels = 1;
+    mDcBlock = false;
+    mHighPass = false;
+    mCutoff = 0;
+    mB0 = mB1 = mB2 = mA1 = mA2 = 0;
+    mAgc = false;
+    memset(&mStaged, 0, sizeof(mStaged));
+    mStagedChanged = false;
+    reset();
+}
+
+void CapturePreprocessor::configure(unsigned int rate, unsigned int channels)
+{
+    unsigned int cutoff;
+
+    {
+        AutoMutex lock(mLock);
+
+        mRate = rate;
+        mChannels = (channels > 2) ? 2 : channels;
+        cutoff = mStaged.cutoff;
+    }
+
+    // the coefficients for the new rate go in with the first block
+    setHighPass(cutoff);
+    reset();
+}
+
+void CapturePreprocessor::reset()
+{
+    for (int c = 0; c < 2; c++)
+    {
+        mDcX1[c] = mDcY1[c] = 0;
+        mHpX1[c] = mHpX2[c] = mHpY1[c] = mHpY2[c] = 0;
+    }
+
+    mGain = 4096;
+}
+
+void CapturePreprocessor::setDcBlock(bool on)
+{
+    AutoMutex lock(mLock);
+
+    mStaged.dcBlock = on;
+    mStagedChanged = true;
+}
+
+// second order Butterworth high-pass, coefficients in Q14
+void CapturePreprocessor::setHighPass(unsigned int cutoffHz)
+{
+    AutoMutex lock(mLock);
+
+    mStaged.cutoff = cutoffHz;
+    mStaged.highPass = (cutoffHz != 0 && cutoffHz * 2 < mRate);
+    mStagedChanged = true;
+
+    if (!mStaged.highPass)
+    {
+        return;
+    }
+
+    double w0 = 2 * M_PI * cutoffHz / mRate;
+    double cosw = cos(w0);
+    double alpha = sin(w0) / (2 * M_SQRT1_2);
+    double a0 = 1 + alpha;
+
+    mStaged.b0 = (int32_t)lrint((1 + cosw) / 2 / a0 * 16384);
+    mStaged.b1 = (int32_t)lrint(-(1 + cosw) / a0 * 16384);
+    mStaged.b2 = mStaged.b0;
+    mStaged.a1 = (int32_t)lrint(-2 * cosw / a0 * 16384);
+    mStaged.a2 = (int32_t)lrint((1 - alpha) / a0 * 16384);
+}
+
+void CapturePreprocessor::setAgc(bool on)
+{
+    AutoMutex lock(mLock);
+
+    mStaged.agc = on;
+    mStagedChanged = true;
+}
+
+// capture thread, between blocks
+void CapturePreprocessor::apply()
+{
+    AutoMutex lock(mLock);
+
+    if (!mStagedChanged)
+    {
+        return;
+    }
 
-        if (mAlsaHandle->status() == ALSAHandle::ALSA_NULL)
+    // a stage turned back on starts from silence, not from its old state
+    for (int c = 0; c < 2; c++)
+    {
+        if (mStaged.dcBlock && !mDcBlock)
         {
-            mAlsaHandle->open(ALSAHandle::ALSA_STEREO_OUT);
-            mAlsaHandle->setHwParams(SND_PCM_FORMAT_S16_LE, mChannelCounts, sampleRate(), (snd_pcm_uframes_t)this->periodSize());
-            mAlsaHandle->setSwParams(ALSAHandle::SW_PLAY);
-            mAudioHardware->setModeAndDevices(1, mode, devices());
-	    usleep(200000);
+            mDcX1[c] = mDcY1[c] = 0;
         }
-
-        if (mAlsaHandle->status() != ALSAHandle::ALSA_NULL)
+        if (mStaged.highPass && !mHighPass)
         {
-            mAlsaHandle->write(buffer, bytes);
-            mFrameCount += bytes;
+            mHpX1[c] = mHpX2[c] = mHpY1[c] = mHpY2[c] = 0;
         }
+    }
 
-        return bytes;
-    } 
-    return -1;
+    mDcBlock = mStaged.dcBlock;
+    mHighPass = mStaged.highPass;
+    mCutoff = mStaged.cutoff;
+    mB0 = mStaged.b0;
+    mB1 = mStaged.b1;
+    mB2 = mStaged.b2;
+    mA1 = mStaged.a1;
+    mA2 = mStaged.a2;
+    mAgc = mStaged.agc;
+    mStagedChanged = false;
 }
 
-status_t AudioStreamOutASTER::standby()
+void CapturePreprocessor::process(int16_t *dst, const int16_t *src, size_t frames)
 {
-    LOGD("AudioStreamOutASTER: standby");
-    int mode = 0;
-    
-    if(!mAudioHardware->getInputStream())
+    bool dcBlock = mDcBlock;
+    bool highPass = mHighPass;
+    bool agc = mAgc;
+    int32_t gain = mGain;
+    int32_t peak = 0;
+
+    for (size_t i = 0; i < frames; i++)
     {
-    	if (mAudioHardware)
-    	{
-        	mode = mAudioHardware->getCurMode();
+        for (unsigned int c = 0; c < mChannels; c++)
+        {
+            int32_t x = *src++;
 
-        	if (mode != AudioSystem::MODE_IN_CALL)
-        	{
-            		mAudioHardware->setModeAndDevices(0, mode, devices());
-        	}
-    	}
+            if (dcBlock)
+            {
+                // y[n] = x[n] - x[n-1] + p * y[n-1]
+                int64_t y = ((int64_t)(x - mDcX1[c]) << 15) + (((int64_t)DC_BLOCK_POLE * mDcY1[c]) >> 15);
+                mDcX1[c] = x;
+                mDcY1[c] = (int32_t)((y > (32767 << 15)) ? (32767 << 15) : (y < -(32768 << 15)) ? -(32768 << 15) : y);
+                x = mDcY1[c] >> 15;
+            }
+
+            if (highPass)
+            {
+                int64_t acc = (int64_t)mB0 * x + (int64_t)mB1 * mHpX1[c] + (int64_t)mB2 * mHpX2[c]
+                              - (int64_t)mA1 * mHpY1[c] - (int64_t)mA2 * mHpY2[c];
+                int32_t y = clamp16((int32_t)(acc >> 14));
+                mHpX2[c] = mHpX1[c];
+                mHpX1[c] = x;
+                mHpY2[c] = mHpY1[c];
+                mHpY1[c] = y;
+                x = y;
+            }
+
+            if (agc)
+            {
+                int32_t level = (x < 0) ? -x : x;
+                if (level > peak)
+                {
+                    peak = level;
+                }
+                x = (int32_t)(((int64_t)x * gain) >> 12);
+            }
+
+            *dst++ = clamp16(x);
+        }
     }
 
-    if (mAlsaHandle)
+    if (!agc || peak < AGC_NOISE_FLOOR)
     {
-        mAlsaHandle->close();
+        return;
     }
-    
-    mFrameCount = 0;
 
-    return NO_ERROR;
-}
+    // cut at once when loud, recover slowly over the next buffers
+    int32_t wanted = (AGC_TARGET << 12) / peak;
+    if (wanted < AGC_MIN_GAIN)
+    {
+        wanted = AGC_MIN_GAIN;
+    }
+    else if (wanted > AGC_MAX_GAIN)
+    {
+        wanted = AGC_MAX_GAIN;
+    }
 
-// return the number of audio frames written by the audio dsp to DAC since
-// the output has exited standby
-status_t AudioStreamOutASTER::getRenderPosition(uint32_t *dspFrames)
-{
-    *dspFrames = mFrameCount;
-    return NO_ERROR;
+    mGain = (wanted < gain) ? wanted : gain + ((wanted - gain) >> 4);
 }
 
-status_t AudioStreamOutASTER::dump(int fd, const Vector<String16>& args) 
-{ 
-    const size_t SIZE = 256; 
-    char buffer[SIZE]; 
-    String8 result; 
-    snprintf(buffer, SIZE, "AudioStreamOutASTER::dump\n"); 
-    result.append(buffer); 
-    snprintf(buffer, SIZE, "\tsample rate: %d\n", sampleRate()); 
-    result.append(buffer); 
-    snprintf(buffer, SIZE, "\tbuffer size: %d\n", bufferSize()); 
-    result.append(buffer); 
-    snprintf(buffer, SIZE, "\tchannel count: %d\n", mChannelCounts); 
-    result.append(buffer); 
-    snprintf(buffer, SIZE, "\tformat: %d\n", format()); 
-    result.append(buffer); 
-    snprintf(buffer, SIZE, "\tmAudioHardware: %p\n", mAudioHardware); 
-    result.append(buffer); 
-    ::write(fd, result.string(), result.size()); 
-    return NO_ERROR; 
-} 
-
 // ----------------------------------------------------------------------------
 // record functions
 AudioStreamInASTER::AudioStreamInASTER()
@@ -1526,6 +3610,7 @@ status_t AudioStreamInASTER::set(
     
     mAudioHardware = hw;
     mDevices = devices; 
+    mPreprocessor.configure(mInSampleRate, mChannelCounts);
 
     return NO_ERROR;
 }
@@ -1556,6 +3641,27 @@ status_t AudioStreamInASTER::setParameters(const String8& keyValuePairs)
         param.remove(key);
     }
 
+    // capture preprocessing, applied from the next read
+    int value;
+
+    if (param.getInt(String8("dc_block"), value) == NO_ERROR)
+    {
+        mPreprocessor.setDcBlock(value != 0);
+        param.remove(String8("dc_block"));
+    }
+
+    if (param.getInt(String8("hpf"), value) == NO_ERROR)
+    {
+        mPreprocessor.setHighPass(value > 0 ? value : 0);
+        param.remove(String8("hpf"));
+    }
+
+    if (param.getInt(String8("agc"), value) == NO_ERROR)
+    {
+        mPreprocessor.setAgc(value != 0);
+        param.remove(String8("agc"));
+    }
+
     if (param.size()) 
     {
         status = BAD_VALUE;
@@ -1581,8 +3687,24 @@ String8 AudioStreamInASTER::getParameters(const String8& keys)
     return param.toString();
 }
 
+// the codec is only counted awake for an open PCM, a failed open leaves the
+// handle closed
+status_t AudioStreamInASTER::openPcm()
+{
+    if (mAlsaHandle->open(ALSAHandle::ALSA_MONO_IN) != NO_ERROR
+        || mAlsaHandle->setHwParams(SND_PCM_FORMAT_S16_LE, mChannelCounts, sampleRate(), (snd_pcm_uframes_t) this->periodSize()) != NO_ERROR
+        || mAlsaHandle->setSwParams(ALSAHandle::SW_RECORD) < 0)
+    {
+        mAlsaHandle->close();
+        return NO_INIT;
+    }
+
+    return NO_ERROR;
+}
+
 ssize_t AudioStreamInASTER::read(void* buffer, ssize_t bytes)
 {
+    AutoMutex lock(mLock);
     int   mode;
 
     if (mAudioHardware == NULL)
@@ -1593,34 +3715,42 @@ ssize_t AudioStreamInASTER::read(void* buffer, ssize_t bytes)
     mode = mAudioHardware->getCurMode();
 
     //Recording voice call
-    if (mode == AudioSystem::MODE_IN_CALL)
+    if (mode == AudioSystem::MODE_IN_CALL || mAudioHardware->isVoiceCall())
     {
-        if (mAlsaHandle->status() == ALSAHandle::ALSA_NULL)
+        // the voice engine holds the codec capture, a recording from before
+        // the call hands it over
+        if (mAlsaHandle->status() != ALSAHandle::ALSA_NULL)
         {
-            mAlsaHandle->open(ALSAHandle::ALSA_MONO_IN);
-            mAlsaHandle->setHwParams(SND_PCM_FORMAT_S16_LE, mChannelCounts, sampleRate(), (snd_pcm_uframes_t) this->periodSize());
-            mAlsaHandle->setSwParams(ALSAHandle::SW_RECORD);
+            closePcm();
         }
 
-        if (mAlsaHandle->status() != ALSAHandle::ALSA_NULL)
+        sp<AudioVoiceEngine> engine = mAudioHardware->getVoiceEngine();
+        size_t frames = bytes / (mChannelCounts * sizeof(int16_t));
+
+        if (engine == 0 || engine->readCapture((int16_t *)buffer, frames, sampleRate(), mChannelCounts) != NO_ERROR)
         {
-            mAlsaHandle->read(buffer, bytes);
+            memset(buffer, 0, bytes);
+            usleep(frames * 1000000 / sampleRate());
         }
         return bytes;
     }
     else
     {
-        if (mAlsaHandle->status() == ALSAHandle::ALSA_NULL)
+        if (mAudioHardware->isDuplexMode() && mAudioHardware->startDuplex(this) == NO_ERROR)
+        {
+            // capture runs linked to the primary output
+        }
+        else if (mAlsaHandle->status() == ALSAHandle::ALSA_NULL && openPcm() == NO_ERROR)
         {
-            mAlsaHandle->open(ALSAHandle::ALSA_MONO_IN);
-            mAlsaHandle->setHwParams(SND_PCM_FORMAT_S16_LE, mChannelCounts, sampleRate(), (snd_pcm_uframes_t) this->periodSize());
-            mAlsaHandle->setSwParams(ALSAHandle::SW_RECORD);
+            mAudioHardware->updateCodecPower(true);
             mAudioHardware->setModeAndDevices(1, mode, devices());
+            mPreprocessor.reset();
         }
 
         if (mAlsaHandle->status() != ALSAHandle::ALSA_NULL)
         {
-            mAlsaHandle->read(buffer, bytes);
+            mPreprocessor.apply();
+            mAlsaHandle->read(buffer, bytes, mPreprocessor.enabled() ? &mPreprocessor : NULL);
         }
         return bytes;
     }
@@ -1628,8 +3758,21 @@ ssize_t AudioStreamInASTER::read(void* buffer, ssize_t bytes)
     return -1;
 }
 
+void AudioStreamInASTER::releasePcm()
+{
+    AutoMutex lock(mLock);
+
+    if (mAlsaHandle && mAlsaHandle->status() != ALSAHandle::ALSA_NULL)
+    {
+        LOGI("AudioStreamInASTER: release PCM to the voice engine");
+        closePcm();
+    }
+}
+
 status_t AudioStreamInASTER::standby()
 {
+    AutoMutex lock(mLock);
+
     LOGD("AudioStreamInASTER: standby");
 
     int mode = 0;
@@ -1642,16 +3785,37 @@ status_t AudioStreamInASTER::standby()
         {
             mAudioHardware->setModeAndDevices(0, mode, devices());
         }
-    }
 
-    if (mAlsaHandle)
-    {
-        mAlsaHandle->close();
+        sp<AudioVoiceEngine> engine = mAudioHardware->getVoiceEngine();
+        if (engine != 0)
+        {
+            engine->stopCapture();
+        }
     }
 
+    closePcm();
+
     return NO_ERROR;
 }
 
+// with mLock held, a PCM of the duplex pair is closed by AudioHardware once
+// the pair stops
+void AudioStreamInASTER::closePcm()
+{
+    if (mAudioHardware && mAudioHardware->stopDuplex(mAlsaHandle))
+    {
+        // the pair closes when the output stops too
+    }
+    else if (mAlsaHandle)
+    {
+        if (mAlsaHandle->status() != ALSAHandle::ALSA_NULL)
+        {
+            mAlsaHandle->close();
+            mAudioHardware->updateCodecPower(false);
+        }
+    }
+}
+
 void AudioStreamInASTER::resetFramesLost()
 {
     mFramesLost = 0;
@@ -1684,11 +3848,256 @@ status_t AudioStreamInASTER::dump(int fd, const Vector<String16>& args)
     result.append(buffer); 
     snprintf(buffer, SIZE, "\tmAudioHardware: %p\n", mAudioHardware); 
     result.append(buffer); 
+    snprintf(buffer, SIZE, "\txrun recoveries: %u, last %u us, max %u us\n", mAlsaHandle->recoveryStats().count,
+             mAlsaHandle->recoveryStats().lastUs, mAlsaHandle->recoveryStats().maxUs); 
+    result.append(buffer); 
     ::write(fd, result.string(), result.size()); 
 
     return NO_ERROR; 
 } 
 
+// ----------------------------------------------------------------------------
+// in-call voice engine
+AudioVoiceEngine::AudioVoiceEngine()
+    : Thread(false)
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get(VOICE_RATE_PROPERTY, value, "8000");
+    mRate = (atoi(value) == 16000) ? 16000 : 8000;
+    mPeriodSize = mRate / 100;
+    mUplink = new int16_t[mPeriodSize];
+    mDownlink = new int16_t[mPeriodSize];
+    mVolume = 100;
+    mMicMute = false;
+
+    mCaptureFrames = mPeriodSize * VOICE_CAPTURE_PERIODS;
+    mCaptureRing = new int16_t[mCaptureFrames];
+    mCaptureRead = mCaptureWrite = 0;
+    mCapturePhase = 0;
+    mCaptureActive = false;
+}
+
+AudioVoiceEngine::~AudioVoiceEngine()
+{
+    close();
+
+    delete[] mUplink;
+    delete[] mDownlink;
+    delete[] mCaptureRing;
+}
+
+status_t AudioVoiceEngine::openPair(ALSAHandle *play, ALSAHandle::audioDeviceType playType,
+                                    ALSAHandle *rec, ALSAHandle::audioDeviceType recType)
+{
+    if (play->open(playType) != NO_ERROR
+        || play->setHwParams(SND_PCM_FORMAT_S16_LE, 1, mRate, mPeriodSize) != NO_ERROR
+        || play->setSwParams(ALSAHandle::SW_DUPLEX_PLAY) < 0
+        || rec->open(recType) != NO_ERROR
+        || rec->setHwParams(SND_PCM_FORMAT_S16_LE, 1, mRate, mPeriodSize) != NO_ERROR
+        || rec->setSwParams(ALSAHandle::SW_DUPLEX_RECORD) < 0)
+    {
+        return -1;
+    }
+
+    // linking fails across cards, the pair then starts back to back
+    bool linked = (play->link(rec) == NO_ERROR);
+
+    if (play->prefill(mPeriodSize) != NO_ERROR || play->start() != NO_ERROR)
+    {
+        return -1;
+    }
+
+    if (!linked && rec->start() != NO_ERROR)
+    {
+        return -1;
+    }
+
+    return NO_ERROR;
+}
+
+status_t AudioVoiceEngine::start()
+{
+    LOGI("AudioVoiceEngine: start %u Hz, %u frame periods", mRate, (unsigned int)mPeriodSize);
+
+    // downlink pair: modem capture and codec playback, uplink pair: codec
+    // capture and modem playback
+    if (openPair(&mCodecOut, ALSAHandle::ALSA_MONO_OUT, &mVoiceIn, ALSAHandle::ALSA_VOICE_CALL_IN) != NO_ERROR
+        || openPair(&mVoiceOut, ALSAHandle::ALSA_VOICE_CALL, &mCodecIn, ALSAHandle::ALSA_MONO_IN) != NO_ERROR)
+    {
+        LOGE("AudioVoiceEngine: could not open voice PCMs");
+        close();
+        return NO_INIT;
+    }
+
+    status_t status = run("AudioVoiceEngine", ANDROID_PRIORITY_URGENT_AUDIO);
+    if (status != NO_ERROR)
+    {
+        close();
+        return status;
+    }
+
+    LOGI("AudioVoiceEngine: round trip latency %u ms", latency());
+
+    return NO_ERROR;
+}
+
+void AudioVoiceEngine::stop()
+{
+    LOGI("AudioVoiceEngine: stop");
+
+    requestExitAndWait();
+
+    // a call recording waiting for frames gets silence from here on
+    {
+        AutoMutex lock(mCaptureLock);
+        mCaptureCond.broadcast();
+    }
+
+    close();
+}
+
+void AudioVoiceEngine::close()
+{
+    mCodecIn.close();
+    mVoiceOut.close();
+    mVoiceIn.close();
+    mCodecOut.close();
+}
+
+uint32_t AudioVoiceEngine::latency()
+{
+    ALSAHandle *handles[] = { &mCodecIn, &mVoiceOut, &mVoiceIn, &mCodecOut };
+    snd_pcm_sframes_t frames = 0;
+
+    for (size_t i = 0; i < sizeof(handles) / sizeof(handles[0]); i++)
+    {
+        snd_pcm_sframes_t delay = 0;
+        struct timespec tstamp;
+
+        if (handles[i]->getDelay(&delay, &tstamp) == NO_ERROR && delay > 0)
+        {
+            frames += delay;
+        }
+    }
+
+    return (uint32_t)(frames * 1000 / mRate);
+}
+
+// the recording hears the uplink after the mic mute and the downlink before
+// the voice volume
+void AudioVoiceEngine::pushCapture()
+{
+    AutoMutex lock(mCaptureLock);
+
+    if (!mCaptureActive)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < mPeriodSize; i++)
+    {
+        // a reader that falls behind loses the oldest frames
+        if (mCaptureWrite - mCaptureRead == mCaptureFrames)
+        {
+            mCaptureRead++;
+        }
+
+        mCaptureRing[mCaptureWrite++ % mCaptureFrames] = (int16_t)((mUplink[i] + mDownlink[i]) >> 1);
+    }
+
+    mCaptureCond.signal();
+}
+
+status_t AudioVoiceEngine::readCapture(int16_t *dst, size_t frames, unsigned int rate, unsigned int channels)
+{
+    // engine frames per client frame, Q16
+    uint32_t step = (uint32_t)(((uint64_t)mRate << 16) / rate);
+
+    AutoMutex lock(mCaptureLock);
+
+    if (!mCaptureActive)
+    {
+        mCaptureActive = true;
+        mCaptureRead = mCaptureWrite;
+        mCapturePhase = 0;
+    }
+
+    for (size_t i = 0; i < frames; i++)
+    {
+        // interpolate between the frame at the reader position and the next one
+        while (mCaptureWrite - mCaptureRead < (mCapturePhase >> 16) + 2)
+        {
+            if (exitPending() || mCaptureCond.waitRelative(mCaptureLock, VOICE_CAPTURE_TIMEOUT_NS) != NO_ERROR)
+            {
+                return NO_INIT;
+            }
+        }
+
+        size_t index = mCaptureRead + (mCapturePhase >> 16);
+        int32_t s0 = mCaptureRing[index % mCaptureFrames];
+        int32_t s1 = mCaptureRing[(index + 1) % mCaptureFrames];
+        int16_t sample = (int16_t)(s0 + (((s1 - s0) * (int32_t)(mCapturePhase & 0xFFFF)) >> 16));
+
+        for (unsigned int c = 0; c < channels; c++)
+        {
+            *dst++ = sample;
+        }
+
+        mCapturePhase += step;
+        mCaptureRead += mCapturePhase >> 16;
+        mCapturePhase &= 0xFFFF;
+    }
+
+    return NO_ERROR;
+}
+
+void AudioVoiceEngine::stopCapture()
+{
+    AutoMutex lock(mCaptureLock);
+
+    mCaptureActive = false;
+}
+
+bool AudioVoiceEngine::threadLoop()
+{
+    size_t bytes = mPeriodSize * sizeof(int16_t);
+
+    // both reads return a period every 10 ms, neither side stops on xrun
+    if (mCodecIn.read(mUplink, bytes) < 0)
+    {
+        memset(mUplink, 0, bytes);
+    }
+
+    if (mMicMute)
+    {
+        memset(mUplink, 0, bytes);
+    }
+
+    mVoiceOut.write(mUplink, bytes);
+
+    if (mVoiceIn.read(mDownlink, bytes) < 0)
+    {
+        memset(mDownlink, 0, bytes);
+    }
+
+    pushCapture();
+
+    // voice volume in Q15
+    int32_t gain = (int32_t)mVolume * 32768 / 100;
+    if (gain < 32768)
+    {
+        for (size_t i = 0; i < mPeriodSize; i++)
+        {
+            mDownlink[i] = (int16_t)((mDownlink[i] * gain) >> 15);
+        }
+    }
+
+    mCodecOut.write(mDownlink, bytes);
+
+    return true;
+}
+
 // ----------------------------------------------------------------------------
 extern "C" AudioHardwareInterface* createAudioHardware(void) 
 {
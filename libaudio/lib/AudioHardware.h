@@ -21,21 +21,79 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <hardware_legacy/AudioHardwareBase.h>
+#include <utils/threads.h>
+#include <utils/Timers.h>
 #include <asoundlib.h>
 #include "hwa.h"
+#include "A2dpOutput.h"
 
 namespace android {
 
 // ----------------------------------------------------------------------------
 class AudioHardware;
 
+// Capture preprocessing: one pole DC blocker, biquad high-pass and AGC in
+// fixed point. process() is the copy out of the ALSA buffer, so the chain
+// costs no extra pass over the data.
+class CapturePreprocessor
+{
+public:
+    CapturePreprocessor();
+
+    void configure(unsigned int rate, unsigned int channels);
+    void reset();
+
+    // the setters stage settings, the capture thread installs them with
+    // apply() before its next block
+    void setDcBlock(bool on);
+    void setHighPass(unsigned int cutoffHz);    // 0 turns it off
+    void setAgc(bool on);
+    void apply();
+
+    bool enabled() const { return mDcBlock || mHighPass || mAgc; }
+    unsigned int channels() const { return mChannels; }
+
+    void process(int16_t *dst, const int16_t *src, size_t frames);
+
+private:
+    unsigned int mRate;
+    unsigned int mChannels;
+
+    bool mDcBlock;
+    int32_t mDcX1[2];
+    int32_t mDcY1[2];               // Q15
+
+    bool mHighPass;
+    unsigned int mCutoff;
+    int32_t mB0, mB1, mB2, mA1, mA2;  // Q14
+    int32_t mHpX1[2], mHpX2[2], mHpY1[2], mHpY2[2];
+
+    bool mAgc;
+    int32_t mGain;                  // Q12
+
+    struct Settings
+    {
+        bool dcBlock;
+        bool highPass;
+        unsigned int cutoff;
+        int32_t b0, b1, b2, a1, a2;
+        bool agc;
+    };
+
+    Mutex mLock;                    // guards the staged settings and mRate
+    Settings mStaged;
+    bool mStagedChanged;
+};
+
 class ALSAHandle
 {
 public:
     typedef enum
     {
         SW_PLAY = 0,
-        SW_RECORD
+        SW_RECORD,
+        SW_DUPLEX_PLAY,     // linked pair, started explicitly and never stopped by ALSA
+        SW_DUPLEX_RECORD
     } ALSA_SET_SW_FLAG;
 
     typedef struct 
@@ -50,16 +108,28 @@ public:
         size_t bytes_per_frame;
     } hwParamType;
 
+    typedef struct
+    {
+        unsigned int count;     // xrun and suspend recoveries since open
+        unsigned int lastUs;
+        unsigned int maxUs;
+        uint64_t totalUs;
+    } recoveryStatsType;
+
     typedef enum
     {
         ALSA_STEREO_OUT = 0,
         ALSA_MONO_OUT,
         ALSA_MONO_IN,
-        ALSA_VOICE_CALL,
+        ALSA_VOICE_CALL,    // playback to the modem voice PCM
+        ALSA_VOICE_CALL_IN, // capture from the modem voice PCM
 
         ALSA_NULL = 0xFF
     } audioDeviceType;
 
+    // periods in the ALSA buffer
+    enum { PERIOD_COUNT = 4 };
+
     ALSAHandle();
     ~ALSAHandle();
     
@@ -68,12 +138,39 @@ public:
     status_t setSwParams(ALSA_SET_SW_FLAG flag);    
     void close();
     ssize_t write(const void *buffer, size_t bytes);
-    ssize_t read(void *buffer, ssize_t bytes);
+    ssize_t read(void *buffer, ssize_t bytes, CapturePreprocessor *filter = NULL);
     audioDeviceType status();
 
+    // full duplex: link a capture handle to this playback handle so that
+    // one start triggers both on the same hardware clock
+    status_t link(ALSAHandle *other);
+    void unlink();
+    status_t start();
+    status_t prefill(snd_pcm_uframes_t frames);
+    status_t getDelay(snd_pcm_sframes_t *delay, struct timespec *tstamp);
+    unsigned int rate() { return mHwparams.rate; }
+
+    const recoveryStatsType& recoveryStats() const { return mRecovery; }
+
 private:
     ssize_t xrun(void);
     ssize_t suspend(void);
+    void preroll(void);
+    void recovered(nsecs_t start);
+
+    status_t negotiateHwParams(void);
+    bool setupConversion(void);
+    bool growConvBuffer(size_t samples);
+    size_t convertPlayback(const int16_t *in, size_t frames);
+    ssize_t writeFrames(const void *buffer, size_t bytes);
+    ssize_t readFrames(void *buffer, ssize_t bytes);
+    ssize_t readFused(void *buffer, ssize_t bytes, CapturePreprocessor *filter);
+
+    // negotiated parameter cache, see pcmParamsCache in AudioHardware.cpp
+    bool applyCachedHwParams(unsigned int rate, snd_pcm_uframes_t periodSize);
+    void cacheHwParams(snd_pcm_hw_params_t *params, unsigned int rate, snd_pcm_uframes_t periodSize);
+    bool applyCachedSwParams(ALSA_SET_SW_FLAG flag);
+    void cacheSwParams(snd_pcm_sw_params_t *params, ALSA_SET_SW_FLAG flag);
     
     snd_pcm_sframes_t (*readi_func)(snd_pcm_t *handle, void *buffer, snd_pcm_uframes_t size);
     snd_pcm_sframes_t (*writei_func)(snd_pcm_t *handle, const void *buffer, snd_pcm_uframes_t size);
@@ -83,6 +180,24 @@ private:
     snd_pcm_t* mPcmHandle;
     snd_pcm_stream_t mStreamType;
     hwParamType mHwparams;
+    bool mLinked;
+    snd_pcm_uframes_t mStartThreshold;
+    recoveryStatsType mRecovery;
+
+    // Native mode: the raw hw device is opened and channel and playback rate
+    // adaptation happen here instead of in the alsa-lib plug chain
+    bool mNative;
+    unsigned int mClientChannels;
+    unsigned int mClientRate;
+    uint32_t mResampleStep;         // Q16 input frames per output frame, 0 when rates match
+    uint32_t mResamplePhase;
+    int16_t mResampleLast[2];
+    int16_t *mConvBuffer;
+    size_t mConvSamples;
+
+    String8 mDeviceName;
+    int mCacheSlot;             // entry holding this handle's hw params, -1 if none
+    unsigned int mCacheGen;     // generation of that entry when it was used
 
 #ifdef DUMP_PCM
     FILE *mPcmFile;
@@ -91,7 +206,7 @@ private:
 
 class AudioStreamOutASTER : public AudioStreamOut {
 public:
-                     AudioStreamOutASTER();
+                     AudioStreamOutASTER(bool deepBuffer = false);
     virtual          ~AudioStreamOutASTER();
 
     status_t    set(AudioHardware* mHardware,
@@ -104,8 +219,10 @@ public:
     virtual size_t      bufferSize() const;
     virtual uint32_t    channels() const;
     virtual int         format() const { return AudioSystem::PCM_16_BIT; }
-    size_t              periodSize() const { return 1536; }
-    virtual uint32_t    latency() const { return 20; };
+    // the deep buffer output wakes up a few times a second for music playback
+    size_t              periodSize() const { return mDeepBuffer ? 16384 : 1536; }
+    // the deep buffer output reports its whole buffer, A/V sync depends on it
+    virtual uint32_t    latency() const { return mDeepBuffer ? (periodSize() * ALSAHandle::PERIOD_COUNT * 1000 / mSampleRate) : 20; };
     virtual status_t    setVolume(float left, float right) { return INVALID_OPERATION; }
     virtual ssize_t     write(const void* buffer, size_t bytes);
     virtual status_t    standby();
@@ -121,10 +238,26 @@ public:
     virtual status_t    getRenderPosition(uint32_t *dspFrames);
 
     uint32_t    devices() { return mDevices; }
+    void        setDevices(uint32_t devices) { mDevices = devices; }
+    bool        isDeepBuffer() const { return mDeepBuffer; }
+
+    // give up the PCM to the voice engine without touching routing, waits for
+    // a write in progress
+    void        releasePcm();
+
+    // held around every use of alsaHandle(), taken before AudioHardware::mLock
+    Mutex       &pcmLock() { return mLock; }
+    ALSAHandle  *alsaHandle() { return mAlsaHandle; }
+    int         channelCount() const { return mChannelCounts; }
 
 private:
+    status_t        standby_l();
+    void            closePcm();
+
+    Mutex           mLock;
     AudioHardware   *mAudioHardware;
     ALSAHandle      *mAlsaHandle;
+    bool            mDeepBuffer;
 
     uint32_t        mDevices;
     uint32_t 	    mSampleRate;
@@ -167,17 +300,102 @@ public:
     virtual unsigned int  getInputFramesLost() const;
 
             uint32_t    devices() { return mDevices; }
+            // give up the PCM to the voice engine, waits for a read in progress
+            void        releasePcm();
+            // held around every use of alsaHandle(), taken before AudioHardware::mLock
+            Mutex       &pcmLock() { return mLock; }
+            ALSAHandle  *alsaHandle() { return mAlsaHandle; }
+            int         channelCount() const { return mChannelCounts; }
 
 private:
     void            resetFramesLost();
+    status_t        openPcm();
+    void            closePcm();
+    Mutex           mLock;
     AudioHardware   *mAudioHardware;
     ALSAHandle      *mAlsaHandle;
+    CapturePreprocessor mPreprocessor; // set with dc_block, hpf and agc parameters
     uint32_t        mDevices;
     uint32_t        mInSampleRate;
     int 	    mChannelCounts ;
     unsigned int    mFramesLost;
 };
 
+// In-call voice engine. One thread moves codec capture to the modem voice PCM
+// (uplink) and voice PCM capture to the codec (downlink) in 10 ms periods.
+// Each direction's PCMs are a linked pair that never stops on an xrun. The
+// voice PCM is "audio.voice.pcm", "null" or a loopback card for development.
+class AudioVoiceEngine : public Thread
+{
+public:
+                        AudioVoiceEngine();
+    virtual             ~AudioVoiceEngine();
+
+            status_t    start();
+            void        stop();
+
+            void        setVolume(unsigned int volume) { mVolume = volume; }
+            void        setMicMute(bool state) { mMicMute = state; }
+
+            // in-call recording of both sides of the call, the input stream
+            // reads here instead of opening the codec capture the engine holds
+            status_t    readCapture(int16_t *dst, size_t frames, unsigned int rate, unsigned int channels);
+            void        stopCapture();
+
+            // mic to modem plus modem to speaker, ms
+            uint32_t    latency();
+
+private:
+    virtual bool        threadLoop();
+            status_t    openPair(ALSAHandle *play, ALSAHandle::audioDeviceType playType,
+                                 ALSAHandle *rec, ALSAHandle::audioDeviceType recType);
+            void        close();
+            void        pushCapture();
+
+    ALSAHandle          mCodecOut;
+    ALSAHandle          mCodecIn;
+    ALSAHandle          mVoiceOut;
+    ALSAHandle          mVoiceIn;
+
+    unsigned int        mRate;
+    size_t              mPeriodSize;    // frames
+    int16_t             *mUplink;
+    int16_t             *mDownlink;
+
+    volatile unsigned int mVolume;      // downlink gain, 0 - 100
+    volatile bool       mMicMute;
+
+    Mutex               mCaptureLock;
+    Condition           mCaptureCond;
+    int16_t             *mCaptureRing;  // uplink and downlink mixed, mono at mRate
+    size_t              mCaptureFrames;
+    size_t              mCaptureRead;   // frame counts, the ring index is modulo mCaptureFrames
+    size_t              mCaptureWrite;
+    uint32_t            mCapturePhase;  // Q16 reader position past mCaptureRead
+    bool                mCaptureActive; // filled only while an input stream reads
+};
+
+// Watches the h2w headset switch, from uevents or by polling sysfs when the
+// netlink socket is not available, so that the HAL moves the codec to the
+// headset before the framework's routing request arrives.
+class AudioJackMonitor : public Thread
+{
+public:
+                        AudioJackMonitor(AudioHardware *hw);
+    virtual             ~AudioJackMonitor();
+
+            void        stop();
+
+private:
+    virtual status_t    readyToRun();
+    virtual bool        threadLoop();
+            int         readSwitchState();
+
+    AudioHardware       *mAudioHardware;
+    int                 mSocket;
+    int                 mWakePipe[2];
+    int                 mState;
+};
 
 class AudioHardware : public  AudioHardwareBase
 {
@@ -226,13 +444,63 @@ public:
             
             status_t    updateAudioDevices(AudioStreamInASTER* input);
             AudioStreamInASTER* getInputStream(void);
+
+            // all outputs play through the codec, they share one device set
+            status_t    setOutputDevices(uint32_t devices);
+            // the voice engine takes the codec PCMs from the streams
+            void        releaseStreamPcms();
+
+            // set from the start of a call, streams keep off the codec PCMs
+            bool        isVoiceCall() const { return mVoiceCall; }
+            sp<AudioVoiceEngine> getVoiceEngine();
+
+            // streams report PCM open/standby, the codec is gated when none is active
+            void        updateCodecPower(bool streamActive);
+
+            // h2w state from AudioJackMonitor: 0 none, 1 headset, 2 headphones
+            void        jackChanged(int state);
+
+            // Duplex mode, set with the "duplex" parameter: the primary output and
+            // the input share linked PCMs started together, so the mic to speaker
+            // offset stays fixed across standby. Streams call startDuplex() with
+            // their pcmLock() held before touching their PCM and fall back to a
+            // standalone open on failure. A pair stopped while a stream is busy
+            // leaves that stream's PCM open, the stream closes it on its next
+            // startDuplex() or stopDuplex().
+            bool        isDuplexMode() const { return mDuplexMode; }
+            status_t    startDuplex(AudioStreamOutASTER* out);
+            status_t    startDuplex(AudioStreamInASTER* in);
+            // returns true when pcm belongs to the duplex pair, it is closed
+            // once the pair stops
+            bool        stopDuplex(ALSAHandle *pcm);
             
 protected:
     virtual status_t    dump(int fd, const Vector<String16>& args); 
 
 private:
+    // routing with mLock held
+    status_t    setModeAndDevices_l(int on, int mode, uint32_t devices);
+    status_t    updateAudioDevices_l(AudioStreamInASTER* input);
+
+    void        startVoiceEngine_l();
+
+    enum
+    {
+        DUPLEX_OUT = 0x1,
+        DUPLEX_IN  = 0x2
+    };
+    status_t    startDuplex(int user, ALSAHandle *pcm);
+    // own is a pair PCM whose stream lock the caller holds
+    void        stopDuplex_l(ALSAHandle *own = NULL);
+    void        closeDuplexPcm_l(ALSAHandle *pcm);
+    uint32_t    measureDuplexLatency_l();
+
     Mutex                 mLock;
     AudioStreamOutASTER   *mOutput;
+    AudioStreamOutASTER   *mDirectOutput; // native rate output opened by the policy manager
+    AudioStreamOutASTER   *mDeepBufferOutput; // long period music output opened by the policy manager
+    unsigned int          mOutputSubstreams;  // codec playback substreams, each output needs its own
+    AudioStreamOutA2DP    *mA2dpOutput;       // SBC encoder output, see A2dpOutput.h
     AudioStreamInASTER    *mInput;
     ALSAHandle            *mAlsaHandle;
 
@@ -242,6 +510,21 @@ private:
     unsigned int    mVoiceVolume; // CP volume, range from 0 -100
     bool            mMicMute;
     bool            mFirstEnableDevice;
+
+    Mutex           mPowerLock;
+    int             mActiveStreams;
+
+    Mutex           mReleaseLock;   // streams are not closed while releaseStreamPcms() runs
+    volatile bool   mVoiceCall;
+    sp<AudioVoiceEngine> mVoiceEngine; // running while in call
+    sp<AudioJackMonitor> mJackMonitor;
+
+    bool            mDuplexMode;
+    bool            mDuplexRunning;
+    int             mDuplexUsers;   // DUPLEX_OUT/DUPLEX_IN streams on the linked pair
+    ALSAHandle      *mDuplexPlay;   // pair PCMs not closed yet, running or not
+    ALSAHandle      *mDuplexRec;
+    uint32_t        mDuplexLatency; // last measured round trip, ms
 };
 
 // ----------------------------------------------------------------------------
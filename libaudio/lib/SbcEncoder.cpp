@@ -0,0 +1,477 @@
+/*
+**
+** Copyright 2007, Google Inc.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+#define LOG_TAG "SbcEncoder"
+#include <utils/Log.h>
+#include "SbcEncoder.h"
+
+namespace android {
+
+// ----------------------------------------------------------------------------
+#define SBC_SYNCWORD 0x9C
+
+// A2DP specification Proto_8_80 analysis window, signs included, in Q15
+static const int16_t sbcWindow[80] =
+{
+        0,     5,    11,    18,    27,    37,    48,    58,
+       66,    69,    65,    53,    30,    -6,   -54,  -115,
+      185,   263,   343,   418,   480,   521,   532,   502,
+      424,   290,    96,  -161,  -480,  -856, -1280, -1743,
+     2228,  2719,  3197,  3644,  4039,  4367,  4612,  4764,
+     4815,  4764,  4612,  4367,  4039,  3644,  3197,  2719,
+    -2228, -1743, -1280,  -856,  -480,  -161,    96,   290,
+      424,   502,   532,   521,   480,   418,   343,   263,
+     -185,  -115,   -54,    -6,    30,    53,    65,    69,
+       66,    58,    48,    37,    27,    18,    11,     5
+};
+
+// cos((k + 0.5) * (i - 4) * pi / 8) in Q13
+static const int16_t sbcMatrix[8][16] =
+{
+    {  5793,  6811,  7568,  8035,  8192,  8035,  7568,  6811,  5793,  4551,  3135,  1598,     0, -1598, -3135, -4551 },
+    { -5793, -1598,  3135,  6811,  8192,  6811,  3135, -1598, -5793, -8035, -7568, -4551,     0,  4551,  7568,  8035 },
+    { -5793, -8035, -3135,  4551,  8192,  4551, -3135, -8035, -5793,  1598,  7568,  6811,     0, -6811, -7568, -1598 },
+    {  5793, -4551, -7568,  1598,  8192,  1598, -7568, -4551,  5793,  6811, -3135, -8035,     0,  8035,  3135, -6811 },
+    {  5793,  4551, -7568, -1598,  8192, -1598, -7568,  4551,  5793, -6811, -3135,  8035,     0, -8035,  3135,  6811 },
+    { -5793,  8035, -3135, -4551,  8192, -4551, -3135,  8035, -5793, -1598,  7568, -6811,     0,  6811, -7568,  1598 },
+    { -5793,  1598,  3135, -6811,  8192, -6811,  3135,  1598, -5793,  8035, -7568,  4551,     0, -4551,  7568, -8035 },
+    {  5793, -6811,  7568, -8035,  8192, -8035,  7568, -6811,  5793, -4551,  3135, -1598,     0,  1598, -3135,  4551 }
+};
+
+// loudness allocation offsets for 8 subbands, per sampling frequency
+static const int sbcOffset8[4][8] =
+{
+    { -2, 0, 0, 0, 0, 0, 0, 1 },    // 16 kHz
+    { -3, 0, 0, 0, 0, 0, 1, 2 },    // 32 kHz
+    { -4, 0, 0, 0, 0, 0, 1, 2 },    // 44.1 kHz
+    { -4, 0, 0, 0, 0, 0, 1, 2 }     // 48 kHz
+};
+
+// CRC-8, x^8 + x^4 + x^3 + x^2 + 1, over the header and scale factors
+static uint8_t sbcCrc8(const uint8_t *data, size_t len)
+{
+    uint8_t crc = 0x0F;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x1D) : (uint8_t)(crc << 1);
+        }
+    }
+
+    return crc;
+}
+
+class SbcBitWriter
+{
+public:
+    SbcBitWriter(uint8_t *out) : mOut(out), mCache(0), mBits(0), mBytes(0) {}
+
+    void put(uint32_t value, int bits)
+    {
+        mCache = (mCache << bits) | (value & ((1u << bits) - 1));
+        mBits += bits;
+        while (mBits >= 8)
+        {
+            mBits -= 8;
+            mOut[mBytes++] = (uint8_t)(mCache >> mBits);
+        }
+    }
+
+    size_t flush()
+    {
+        if (mBits > 0)
+        {
+            mOut[mBytes++] = (uint8_t)(mCache << (8 - mBits));
+            mBits = 0;
+        }
+        return mBytes;
+    }
+
+private:
+    uint8_t *mOut;
+    uint32_t mCache;
+    int mBits;
+    size_t mBytes;
+};
+
+// ----------------------------------------------------------------------------
+SbcEncoder::SbcEncoder()
+{
+    mRate = 44100;
+    mRateIndex = 2;
+    mChannels = 2;
+    mBlocks = 16;
+    mAllocation = ALLOC_LOUDNESS;
+    mBitpool = 53;
+    reset();
+}
+
+int SbcEncoder::configure(unsigned int rate, unsigned int channels, unsigned int blocks,
+                          allocationType allocation, unsigned int bitpool)
+{
+    switch (rate)
+    {
+        case 16000: mRateIndex = 0; break;
+        case 32000: mRateIndex = 1; break;
+        case 44100: mRateIndex = 2; break;
+        case 48000: mRateIndex = 3; break;
+        default:
+            LOGE("SbcEncoder: unsupported rate %u", rate);
+            return -1;
+    }
+
+    if (channels < 1 || channels > MAX_CHANNELS || blocks < 4 || blocks > MAX_BLOCKS || (blocks % 4) != 0)
+    {
+        LOGE("SbcEncoder: unsupported layout, %u channels %u blocks", channels, blocks);
+        return -1;
+    }
+
+    mRate = rate;
+    mChannels = channels;
+    mBlocks = blocks;
+    mAllocation = allocation;
+    setBitpool(bitpool);
+    reset();
+
+    return 0;
+}
+
+void SbcEncoder::reset()
+{
+    memset(mX, 0, sizeof(mX));
+}
+
+unsigned int SbcEncoder::maxBitpool() const
+{
+    return (mChannels == 1) ? 16 * SUBBANDS : 250;
+}
+
+void SbcEncoder::setBitpool(unsigned int bitpool)
+{
+    if (bitpool < 2)
+    {
+        bitpool = 2;
+    }
+    if (bitpool > maxBitpool())
+    {
+        bitpool = maxBitpool();
+    }
+
+    mBitpool = bitpool;
+}
+
+size_t SbcEncoder::frameLength() const
+{
+    // header, 4 bit scale factors, then blocks * bitpool bits of samples
+    return 4 + (4 * SUBBANDS * mChannels) / 8 + (mBlocks * mBitpool + 7) / 8;
+}
+
+/*
+ Analysis per block: shift 8 new samples into X newest first, window with
+ the prototype, fold the 80 products into 16 partial sums and matrix them
+ into 8 subband samples. Subband samples are kept with one fraction bit.
+*/
+void SbcEncoder::analyze(const int16_t *pcm)
+{
+    for (unsigned int blk = 0; blk < mBlocks; blk++)
+    {
+        for (unsigned int ch = 0; ch < mChannels; ch++)
+        {
+            int16_t *x = mX[ch];
+            int16_t y[16];
+
+            memmove(x + SUBBANDS, x, (10 - 1) * SUBBANDS * sizeof(int16_t));
+            for (int i = 0; i < SUBBANDS; i++)
+            {
+                x[SUBBANDS - 1 - i] = pcm[(blk * SUBBANDS + i) * mChannels + ch];
+            }
+
+#ifdef __ARM_NEON__
+            for (int i = 0; i < 16; i += 4)
+            {
+                int32x4_t acc = vmull_s16(vld1_s16(sbcWindow + i), vld1_s16(x + i));
+                acc = vmlal_s16(acc, vld1_s16(sbcWindow + i + 16), vld1_s16(x + i + 16));
+                acc = vmlal_s16(acc, vld1_s16(sbcWindow + i + 32), vld1_s16(x + i + 32));
+                acc = vmlal_s16(acc, vld1_s16(sbcWindow + i + 48), vld1_s16(x + i + 48));
+                acc = vmlal_s16(acc, vld1_s16(sbcWindow + i + 64), vld1_s16(x + i + 64));
+                vst1_s16(y + i, vshrn_n_s32(acc, 14));
+            }
+
+            int16x4_t y0 = vld1_s16(y), y1 = vld1_s16(y + 4);
+            int16x4_t y2 = vld1_s16(y + 8), y3 = vld1_s16(y + 12);
+
+            for (int k = 0; k < SUBBANDS; k++)
+            {
+                int32x4_t acc = vmull_s16(vld1_s16(sbcMatrix[k]), y0);
+                acc = vmlal_s16(acc, vld1_s16(sbcMatrix[k] + 4), y1);
+                acc = vmlal_s16(acc, vld1_s16(sbcMatrix[k] + 8), y2);
+                acc = vmlal_s16(acc, vld1_s16(sbcMatrix[k] + 12), y3);
+                int32x2_t sum = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+                sum = vpadd_s32(sum, sum);
+                mSamples[blk][ch][k] = vget_lane_s32(sum, 0) >> 13;
+            }
+#else
+            for (int i = 0; i < 16; i++)
+            {
+                int32_t acc = sbcWindow[i] * x[i] + sbcWindow[i + 16] * x[i + 16] + sbcWindow[i + 32] * x[i + 32]
+                              + sbcWindow[i + 48] * x[i + 48] + sbcWindow[i + 64] * x[i + 64];
+                y[i] = (int16_t)(acc >> 14);
+            }
+
+            for (int k = 0; k < SUBBANDS; k++)
+            {
+                int32_t acc = 0;
+                for (int i = 0; i < 16; i++)
+                {
+                    acc += sbcMatrix[k][i] * y[i];
+                }
+                mSamples[blk][ch][k] = acc >> 13;
+            }
+#endif
+        }
+    }
+}
+
+// A2DP specification bit allocation, mono and stereo share the bitpool rules
+void SbcEncoder::allocateBits(int bits[MAX_CHANNELS][SUBBANDS])
+{
+    int bitneed[MAX_CHANNELS][SUBBANDS];
+    int maxBitneed = 0;
+    int bitcount = 0, slicecount = 0, bitslice;
+    int bitpool = (int)mBitpool;
+
+    for (unsigned int ch = 0; ch < mChannels; ch++)
+    {
+        for (int sb = 0; sb < SUBBANDS; sb++)
+        {
+            int scf = mScaleFactor[ch][sb];
+
+            if (mAllocation == ALLOC_SNR)
+            {
+                bitneed[ch][sb] = scf;
+            }
+            else if (scf == 0)
+            {
+                bitneed[ch][sb] = -5;
+            }
+            else
+            {
+                int loudness = scf - sbcOffset8[mRateIndex][sb];
+                bitneed[ch][sb] = (loudness > 0) ? loudness / 2 : loudness;
+            }
+
+            if (bitneed[ch][sb] > maxBitneed)
+            {
+                maxBitneed = bitneed[ch][sb];
+            }
+        }
+    }
+
+    bitslice = maxBitneed + 1;
+    do
+    {
+        bitslice--;
+        bitcount += slicecount;
+        slicecount = 0;
+        for (unsigned int ch = 0; ch < mChannels; ch++)
+        {
+            for (int sb = 0; sb < SUBBANDS; sb++)
+            {
+                if (bitneed[ch][sb] > bitslice + 1 && bitneed[ch][sb] < bitslice + 16)
+                {
+                    slicecount++;
+                }
+                else if (bitneed[ch][sb] == bitslice + 1)
+                {
+                    slicecount += 2;
+                }
+            }
+        }
+    } while (bitcount + slicecount < bitpool);
+
+    if (bitcount + slicecount == bitpool)
+    {
+        bitcount += slicecount;
+        bitslice--;
+    }
+
+    for (unsigned int ch = 0; ch < mChannels; ch++)
+    {
+        for (int sb = 0; sb < SUBBANDS; sb++)
+        {
+            if (bitneed[ch][sb] < bitslice + 2)
+            {
+                bits[ch][sb] = 0;
+            }
+            else
+            {
+                bits[ch][sb] = bitneed[ch][sb] - bitslice;
+                if (bits[ch][sb] > 16)
+                {
+                    bits[ch][sb] = 16;
+                }
+            }
+        }
+    }
+
+    // hand out what is left, subband by subband, channels interleaved
+    for (int sb = 0; bitcount < bitpool && sb < SUBBANDS; sb++)
+    {
+        for (unsigned int ch = 0; ch < mChannels && bitcount < bitpool; ch++)
+        {
+            if (bits[ch][sb] >= 2 && bits[ch][sb] < 16)
+            {
+                bits[ch][sb]++;
+                bitcount++;
+            }
+            else if (bitneed[ch][sb] == bitslice + 1 && bitpool > bitcount + 1)
+            {
+                bits[ch][sb] = 2;
+                bitcount += 2;
+            }
+        }
+    }
+
+    for (int sb = 0; bitcount < bitpool && sb < SUBBANDS; sb++)
+    {
+        for (unsigned int ch = 0; ch < mChannels && bitcount < bitpool; ch++)
+        {
+            if (bits[ch][sb] < 16)
+            {
+                bits[ch][sb]++;
+                bitcount++;
+            }
+        }
+    }
+}
+
+ssize_t SbcEncoder::encode(const int16_t *pcm, uint8_t *out, size_t outSize)
+{
+    int bits[MAX_CHANNELS][SUBBANDS];
+    size_t length = frameLength();
+
+    if (outSize < length)
+    {
+        return -1;
+    }
+
+    analyze(pcm);
+
+    // smallest scale factor whose range 2^(scf + 1) holds every sample
+    for (unsigned int ch = 0; ch < mChannels; ch++)
+    {
+        for (int sb = 0; sb < SUBBANDS; sb++)
+        {
+            int32_t peak = 0;
+            for (unsigned int blk = 0; blk < mBlocks; blk++)
+            {
+                int32_t s = mSamples[blk][ch][sb];
+                s = (s < 0) ? -s : s;
+                if (s > peak)
+                {
+                    peak = s;
+                }
+            }
+
+            int scf = 0;
+            while (scf < 15 && peak >= (1 << (scf + 2)))
+            {
+                scf++;
+            }
+            mScaleFactor[ch][sb] = scf;
+        }
+    }
+
+    allocateBits(bits);
+
+    // header: sampling frequency, blocks, channel mode, allocation, 8 subbands
+    out[0] = SBC_SYNCWORD;
+    out[1] = (uint8_t)((mRateIndex << 6) | (((mBlocks / 4) - 1) << 4)
+                       | ((mChannels == 1 ? 0 : 2) << 2) | (mAllocation << 1) | 1);
+    out[2] = (uint8_t)mBitpool;
+    out[3] = 0;
+
+    SbcBitWriter writer(out + 4);
+
+    for (unsigned int ch = 0; ch < mChannels; ch++)
+    {
+        for (int sb = 0; sb < SUBBANDS; sb++)
+        {
+            writer.put(mScaleFactor[ch][sb], 4);
+        }
+    }
+
+    // scale factors end on a byte boundary without joint stereo
+    uint8_t crcData[2 + 4 * MAX_CHANNELS];
+    crcData[0] = out[1];
+    crcData[1] = out[2];
+    memcpy(crcData + 2, out + 4, 4 * mChannels);
+    out[3] = sbcCrc8(crcData, 2 + 4 * mChannels);
+
+    for (unsigned int blk = 0; blk < mBlocks; blk++)
+    {
+        for (unsigned int ch = 0; ch < mChannels; ch++)
+        {
+            for (int sb = 0; sb < SUBBANDS; sb++)
+            {
+                if (bits[ch][sb] == 0)
+                {
+                    continue;
+                }
+
+                // floor((sample / 2^(scf + 1) + 1) * levels / 2), samples carry one fraction bit
+                int scf = mScaleFactor[ch][sb];
+                int64_t levels = (1 << bits[ch][sb]) - 1;
+                int32_t range = 1 << (scf + 2);
+                int32_t s = mSamples[blk][ch][sb];
+
+                if (s >= range)
+                {
+                    s = range - 1;
+                }
+                else if (s <= -range)
+                {
+                    s = -range + 1;
+                }
+
+                writer.put((uint32_t)(((int64_t)(s + range) * levels) >> (scf + 3)), bits[ch][sb]);
+            }
+        }
+    }
+
+    size_t written = 4 + writer.flush();
+    if (written < length)
+    {
+        memset(out + written, 0, length - written);
+    }
+
+    return length;
+}
+
+// ----------------------------------------------------------------------------
+
+}; // namespace android
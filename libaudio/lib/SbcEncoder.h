@@ -0,0 +1,88 @@
+/*
+**
+** Copyright 2007, Google Inc.
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef ANDROID_SBC_ENCODER_H
+#define ANDROID_SBC_ENCODER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+namespace android {
+
+// ----------------------------------------------------------------------------
+/*
+ SBC encoder for the A2DP output, 8 subbands only. The analysis filterbank
+ is the A2DP specification's (Proto_8_80 window and cosine matrixing) in
+ fixed point, with NEON windowing and matrixing when built for it.
+ Mono and stereo channel modes, loudness or SNR allocation.
+*/
+class SbcEncoder
+{
+public:
+    enum
+    {
+        SUBBANDS   = 8,
+        MAX_BLOCKS = 16,
+        MAX_CHANNELS = 2
+    };
+
+    typedef enum
+    {
+        ALLOC_LOUDNESS = 0,
+        ALLOC_SNR
+    } allocationType;
+
+    SbcEncoder();
+
+    // rate 16000, 32000, 44100 or 48000; blocks 4, 8, 12 or 16
+    int configure(unsigned int rate, unsigned int channels, unsigned int blocks,
+                  allocationType allocation, unsigned int bitpool);
+    void reset();
+
+    void setBitpool(unsigned int bitpool);
+    unsigned int bitpool() const { return mBitpool; }
+    unsigned int maxBitpool() const;
+
+    // PCM frames consumed and bytes produced by one SBC frame
+    size_t codesize() const { return mBlocks * SUBBANDS; }
+    size_t frameLength() const;
+
+    // encodes codesize() interleaved frames, returns the frame length
+    ssize_t encode(const int16_t *pcm, uint8_t *out, size_t outSize);
+
+private:
+    void analyze(const int16_t *pcm);
+    void allocateBits(int bits[MAX_CHANNELS][SUBBANDS]);
+
+    unsigned int mRate;
+    unsigned int mRateIndex;
+    unsigned int mChannels;
+    unsigned int mBlocks;
+    allocationType mAllocation;
+    unsigned int mBitpool;
+
+    // newest input first, 10 * SUBBANDS samples per channel
+    int16_t mX[MAX_CHANNELS][10 * SUBBANDS];
+    int32_t mSamples[MAX_BLOCKS][MAX_CHANNELS][SUBBANDS];
+    int mScaleFactor[MAX_CHANNELS][SUBBANDS];
+};
+
+// ----------------------------------------------------------------------------
+
+}; // namespace android
+
+#endif // ANDROID_SBC_ENCODER_H
@@ -22,6 +22,243 @@
 
 namespace android {
 
+// Rates the codec runs at without resampling, keep in sync with
+// supportedOutSampleRate in libaudio
+static const uint32_t kNativeOutSampleRates[] =
+{
+    8000, 11025, 16000, 22050, 32000, 44100, 48000
+};
+
+bool AudioPolicyManagerALSA::isNativeOutput(AudioSystem::stream_type stream,
+                                            uint32_t samplingRate,
+                                            uint32_t format,
+                                            uint32_t channels)
+{
+    if (stream != AudioSystem::MUSIC || mPhoneState == AudioSystem::MODE_IN_CALL) {
+        return false;
+    }
+    if (format != AudioSystem::FORMAT_DEFAULT && format != AudioSystem::PCM_16_BIT) {
+        return false;
+    }
+    if (channels != AudioSystem::CHANNEL_OUT_MONO && channels != AudioSystem::CHANNEL_OUT_STEREO) {
+        return false;
+    }
+
+    // nothing to gain when the mixer already runs at this rate
+    AudioOutputDescriptor *hwOutputDesc = mOutputs.valueFor(mHardwareOutput);
+    if (hwOutputDesc == NULL || samplingRate == 0 || samplingRate == hwOutputDesc->mSamplingRate) {
+        return false;
+    }
+
+    // only codec devices, A2DP and SCO have their own rate
+    uint32_t device = getDeviceForStrategy(getStrategy(stream));
+    if (device & ~(AudioSystem::DEVICE_OUT_EARPIECE |
+                   AudioSystem::DEVICE_OUT_SPEAKER |
+                   AudioSystem::DEVICE_OUT_WIRED_HEADSET |
+                   AudioSystem::DEVICE_OUT_WIRED_HEADPHONE)) {
+        return false;
+    }
+
+    // The direct output plays next to the hardware and deep buffer outputs, it
+    // needs a codec substream of its own. Without one the HAL refuses it, or
+    // it would take the PCM from the hardware output while that one plays.
+    int usedSubstreams = (mDeepBufferOutput != 0) ? 2 : 1;
+    if (mOutputSubstreams <= usedSubstreams) {
+        return false;
+    }
+
+    // the HAL serves a single direct output
+    for (size_t i = 0; i < mOutputs.size(); i++) {
+        if (mOutputs.valueAt(i)->mFlags & AudioSystem::OUTPUT_FLAG_DIRECT) {
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(kNativeOutSampleRates) / sizeof(kNativeOutSampleRates[0]); i++) {
+        if (samplingRate == kNativeOutSampleRates[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// true when a stream other than music plays on the hardware output
+bool AudioPolicyManagerALSA::isLowLatencyActive()
+{
+    AudioOutputDescriptor *hwOutputDesc = mOutputs.valueFor(mHardwareOutput);
+    if (hwOutputDesc == NULL) {
+        return false;
+    }
+    return hwOutputDesc->refCount() > hwOutputDesc->mRefCount[AudioSystem::MUSIC];
+}
+
+bool AudioPolicyManagerALSA::isDeepBufferOutput(AudioSystem::stream_type stream,
+                                                uint32_t samplingRate,
+                                                uint32_t format,
+                                                uint32_t channels)
+{
+    if (mDeepBufferOutput == 0 || stream != AudioSystem::MUSIC ||
+        mPhoneState == AudioSystem::MODE_IN_CALL) {
+        return false;
+    }
+
+    AudioOutputDescriptor *outputDesc = mOutputs.valueFor(mDeepBufferOutput);
+    if (format != AudioSystem::FORMAT_DEFAULT && format != outputDesc->mFormat) {
+        return false;
+    }
+    if (samplingRate != 0 && samplingRate > outputDesc->mSamplingRate * 2) {
+        return false;
+    }
+    if (channels != 0 && AudioSystem::popCount(channels) > 2) {
+        return false;
+    }
+
+    // the deep buffer output only plays through the codec
+    uint32_t device = getDeviceForStrategy(getStrategy(stream));
+    if (device & ~(AudioSystem::DEVICE_OUT_EARPIECE |
+                   AudioSystem::DEVICE_OUT_SPEAKER |
+                   AudioSystem::DEVICE_OUT_WIRED_HEADSET |
+                   AudioSystem::DEVICE_OUT_WIRED_HEADPHONE)) {
+        return false;
+    }
+
+    return !isLowLatencyActive();
+}
+
+audio_io_handle_t AudioPolicyManagerALSA::getOutput(AudioSystem::stream_type stream,
+                                                    uint32_t samplingRate,
+                                                    uint32_t format,
+                                                    uint32_t channels,
+                                                    AudioSystem::output_flags flags)
+{
+    if (!(flags & AudioSystem::OUTPUT_FLAG_DIRECT) &&
+        isNativeOutput(stream, samplingRate, format, channels)) {
+        audio_io_handle_t output = AudioPolicyManagerBase::getOutput(stream, samplingRate,
+                format, channels,
+                (AudioSystem::output_flags)(flags | AudioSystem::OUTPUT_FLAG_DIRECT));
+        if (output != 0) {
+            LOGV("getOutput() direct output %d for rate %d channels %x", output, samplingRate, channels);
+            return output;
+        }
+        LOGW("getOutput() direct output refused for rate %d, using hardware output", samplingRate);
+    }
+
+    if (!(flags & AudioSystem::OUTPUT_FLAG_DIRECT) &&
+        isDeepBufferOutput(stream, samplingRate, format, channels)) {
+        LOGV("getOutput() deep buffer output %d for stream %d", mDeepBufferOutput, stream);
+        return mDeepBufferOutput;
+    }
+
+    return AudioPolicyManagerBase::getOutput(stream, samplingRate, format, channels, flags);
+}
+
+status_t AudioPolicyManagerALSA::startOutput(audio_io_handle_t output,
+                                             AudioSystem::stream_type stream,
+                                             int session)
+{
+    bool wasLowLatency = isLowLatencyActive();
+
+    status_t status = AudioPolicyManagerBase::startOutput(output, stream, session);
+    if (status != NO_ERROR || mDeepBufferOutput == 0) {
+        return status;
+    }
+
+    // Bring music back to the hardware output so that it mixes with the low
+    // latency stream instead of competing with it for the codec. AudioFlinger
+    // invalidates the music tracks and they come back through getOutput().
+    if (!wasLowLatency && isLowLatencyActive() &&
+        mOutputs.valueFor(mDeepBufferOutput)->mRefCount[AudioSystem::MUSIC] != 0) {
+        LOGV("startOutput() stream %d moves music to hardware output", stream);
+        mpClientInterface->setStreamOutput(AudioSystem::MUSIC, mHardwareOutput);
+    }
+    return status;
+}
+
+status_t AudioPolicyManagerALSA::stopOutput(audio_io_handle_t output,
+                                            AudioSystem::stream_type stream,
+                                            int session)
+{
+    bool wasLowLatency = isLowLatencyActive();
+
+    status_t status = AudioPolicyManagerBase::stopOutput(output, stream, session);
+    if (status != NO_ERROR || mDeepBufferOutput == 0) {
+        return status;
+    }
+
+    // last low latency stream gone, music can go back to long periods
+    AudioOutputDescriptor *hwOutputDesc = mOutputs.valueFor(mHardwareOutput);
+    if (wasLowLatency && !isLowLatencyActive() &&
+        hwOutputDesc->mRefCount[AudioSystem::MUSIC] != 0 &&
+        isDeepBufferOutput(AudioSystem::MUSIC, 0, AudioSystem::FORMAT_DEFAULT, 0)) {
+        LOGV("stopOutput() stream %d moves music to deep buffer output", stream);
+        mpClientInterface->setStreamOutput(AudioSystem::MUSIC, mDeepBufferOutput);
+    }
+    return status;
+}
+
+// Sends only the keys that differ from what the HAL last got for this input.
+// Base class routing of an active input updates inputDesc->mDevice along with
+// the HAL, so a stale entry here can only cause one redundant update.
+void AudioPolicyManagerALSA::setInputRouting(audio_io_handle_t input,
+                                             AudioInputDescriptor *inputDesc,
+                                             bool withVrMode,
+                                             int delayMs)
+{
+    ssize_t index = mInputRouting.indexOfKey(input);
+    if (index < 0) {
+        index = mInputRouting.add(input, InputRouting());
+    }
+    InputRouting &routing = mInputRouting.editValueAt(index);
+
+    AudioParameter param = AudioParameter();
+    if (routing.mDevice != inputDesc->mDevice) {
+        param.addInt(String8(AudioParameter::keyRouting), (int)inputDesc->mDevice);
+        routing.mDevice = inputDesc->mDevice;
+    }
+    if (withVrMode) {
+        // use Voice Recognition mode or not for this input based on input source
+        int vrEnabled = inputDesc->mInputSource == AUDIO_SOURCE_VOICE_RECOGNITION ? 1 : 0;
+        if (routing.mVrMode != vrEnabled) {
+            param.addInt(String8("vr_mode"), vrEnabled);
+            routing.mVrMode = vrEnabled;
+        }
+    }
+
+    if (param.size() == 0) {
+        LOGV("setInputRouting() input %d routing unchanged", input);
+        return;
+    }
+    mpClientInterface->setParameters(input, param.toString(), delayMs);
+}
+
+status_t AudioPolicyManagerALSA::startInput(audio_io_handle_t input)
+{
+    LOGV("startInput() input %d", input);
+    ssize_t index = mInputs.indexOfKey(input);
+    if (index < 0) {
+        LOGW("startInput() unknow input %d", input);
+        return BAD_VALUE;
+    }
+    AudioInputDescriptor *inputDesc = mInputs.valueAt(index);
+
+    // refuse 2 active AudioRecord clients at the same time
+    if (getActiveInput() != 0) {
+        LOGW("startInput() input %d failed: other input already started", input);
+        return INVALID_OPERATION;
+    }
+
+    // a routing still pending from a recent stop is merged with this one
+    setInputRouting(input, inputDesc, true, 0);
+    inputDesc->mRefCount = 1;
+    return NO_ERROR;
+}
+
+void AudioPolicyManagerALSA::releaseInput(audio_io_handle_t input)
+{
+    AudioPolicyManagerBase::releaseInput(input);
+    mInputRouting.removeItem(input);
+}
+
 status_t AudioPolicyManagerALSA::stopInput(audio_io_handle_t input)
 {
     LOGV("stopInput() input %d", input);
@@ -36,10 +273,8 @@ status_t AudioPolicyManagerALSA::stopInput(audio_io_handle_t input)
         LOGW("stopInput() input %d already stopped", input);
         return INVALID_OPERATION;
     } else {
-        AudioParameter param = AudioParameter();
-      //  param.addInt(String8(AudioParameter::keyRouting), 0);
-         param.addInt(String8(AudioParameter::keyRouting), inputDesc->mDevice); //set the device name
-        mpClientInterface->setParameters(input, param.toString());
+        // keep the device, the HAL only needs to hear about a change
+        setInputRouting(input, inputDesc, false, INPUT_ROUTING_BATCH_MS);
         inputDesc->mRefCount = 0;
         return NO_ERROR;
     }
@@ -63,8 +298,43 @@ extern "C" void destroyAudioPolicyManager(AudioPolicyInterface *interface)
 // Nothing currently different between the Base implementation.
 
 AudioPolicyManagerALSA::AudioPolicyManagerALSA(AudioPolicyClientInterface *clientInterface)
-    : AudioPolicyManagerBase(clientInterface)
+    : AudioPolicyManagerBase(clientInterface), mDeepBufferOutput(0), mOutputSubstreams(1)
 {
+    AudioOutputDescriptor *hwOutputDesc = mOutputs.valueFor(mHardwareOutput);
+    if (hwOutputDesc == NULL) {
+        return;
+    }
+
+    // with a single codec substream the outputs would take the PCM from each
+    // other, everything mixes on the hardware output instead
+    AudioParameter param = AudioParameter(
+            mpClientInterface->getParameters(0, String8("output_substreams")));
+    param.getInt(String8("output_substreams"), mOutputSubstreams);
+    if (mOutputSubstreams < 2) {
+        LOGI("single codec substream, music stays on hardware output");
+        return;
+    }
+
+    // same rate as the hardware output, the HAL gives it long periods
+    AudioOutputDescriptor *outputDesc = new AudioOutputDescriptor();
+    outputDesc->mDevice = hwOutputDesc->device();
+    outputDesc->mSamplingRate = hwOutputDesc->mSamplingRate;
+    outputDesc->mFormat = hwOutputDesc->mFormat;
+    outputDesc->mChannels = hwOutputDesc->mChannels;
+    outputDesc->mLatency = 0;
+    outputDesc->mFlags = AudioSystem::OUTPUT_FLAG_INDIRECT;
+    mDeepBufferOutput = mpClientInterface->openOutput(&outputDesc->mDevice,
+                                                      &outputDesc->mSamplingRate,
+                                                      &outputDesc->mFormat,
+                                                      &outputDesc->mChannels,
+                                                      &outputDesc->mLatency,
+                                                      outputDesc->mFlags);
+    if (mDeepBufferOutput == 0) {
+        LOGW("could not open deep buffer output, music stays on hardware output");
+        delete outputDesc;
+        return;
+    }
+    addOutput(mDeepBufferOutput, outputDesc);
 }
 
 AudioPolicyManagerALSA::~AudioPolicyManagerALSA()
@@ -35,6 +35,9 @@ namespace android {
 // Time in seconds during which we consider that music is still active after a music
 // track was stopped - see computeVolume()
 #define SONIFICATION_HEADSET_MUSIC_DELAY  5
+// Delay applied to input routing sent on stop so that a start following within
+// this time is merged with it by the command thread instead of re-routing twice
+#define INPUT_ROUTING_BATCH_MS 50
 class AudioPolicyManagerALSA: public AudioPolicyManagerBase
 {
 
@@ -42,8 +45,52 @@ public:
                 AudioPolicyManagerALSA(AudioPolicyClientInterface *clientInterface);
         virtual ~AudioPolicyManagerALSA();
         
+        virtual status_t startInput(audio_io_handle_t input);
 	status_t stopInput(audio_io_handle_t input);
-        // Nothing currently different between the Base implementation.
+        virtual void releaseInput(audio_io_handle_t input);
+
+        // opens a direct output for streams the hardware plays at their native
+        // rate, everything else goes to the mixed hardware output
+        virtual audio_io_handle_t getOutput(AudioSystem::stream_type stream,
+                                            uint32_t samplingRate = 0,
+                                            uint32_t format = AudioSystem::FORMAT_DEFAULT,
+                                            uint32_t channels = 0,
+                                            AudioSystem::output_flags flags =
+                                                    AudioSystem::OUTPUT_FLAG_INDIRECT);
+
+        // music leaves the deep buffer output while low latency streams play
+        virtual status_t startOutput(audio_io_handle_t output,
+                                     AudioSystem::stream_type stream,
+                                     int session = 0);
+        virtual status_t stopOutput(audio_io_handle_t output,
+                                    AudioSystem::stream_type stream,
+                                    int session = 0);
+
+protected:
+        bool isNativeOutput(AudioSystem::stream_type stream,
+                            uint32_t samplingRate,
+                            uint32_t format,
+                            uint32_t channels);
+        bool isDeepBufferOutput(AudioSystem::stream_type stream,
+                                uint32_t samplingRate,
+                                uint32_t format,
+                                uint32_t channels);
+        bool isLowLatencyActive();
+        void setInputRouting(audio_io_handle_t input,
+                             AudioInputDescriptor *inputDesc,
+                             bool withVrMode,
+                             int delayMs);
+
+        // routing last sent to the HAL for an input
+        struct InputRouting {
+            InputRouting() : mDevice(0), mVrMode(-1) {}
+            uint32_t mDevice;
+            int mVrMode;    // -1 until sent
+        };
+        KeyedVector<audio_io_handle_t, InputRouting> mInputRouting;
+
+        audio_io_handle_t mDeepBufferOutput;    // long period output for music, 0 if not opened
+        int mOutputSubstreams;  // codec playback substreams, outputs besides the hardware one need their own
 };
 
 };